@@ -82,6 +82,14 @@ contains(USE_UPNP, -) {
     win32:LIBS += -liphlpapi
 }
 
+# use: qmake "USE_SECP256K1=1"
+# libsecp256k1 (https://github.com/bitcoin/secp256k1) must be installed for support
+contains(USE_SECP256K1, 1) {
+    message(Building with libsecp256k1 signature verification)
+    DEFINES += USE_SECP256K1
+    LIBS += -lsecp256k1
+}
+
 # use: qmake "USE_DBUS=1" or qmake "USE_DBUS=0"
 linux:count(USE_DBUS, 0) {
     USE_DBUS=1
@@ -176,6 +184,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/util.h \
     src/uint256.h \
     src/kernel.h \
+    src/kernelhash.h \
     src/pbkdf2.h \
     src/serialize.h \
     src/strlcpy.h \
@@ -183,6 +192,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/main.h \
     src/net.h \
     src/key.h \
+    src/ecverify.h \
     src/db.h \
     src/txdb.h \
     src/walletdb.h \
@@ -264,6 +274,7 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/util.cpp \
     src/netbase.cpp \
     src/key.cpp \
+    src/ecverify.cpp \
     src/script.cpp \
     src/main.cpp \
     src/miner.cpp \
@@ -313,6 +324,7 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/qt/rpcconsole.cpp \
     src/noui.cpp \
     src/kernel.cpp \
+    src/kernelhash.cpp \
     src/scrypt-arm.S \
     src/scrypt-x86.S \
     src/scrypt-x86_64.S \
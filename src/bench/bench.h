@@ -0,0 +1,44 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BENCH_H
+#define BITCOIN_BENCH_H
+
+#include <string>
+
+#include "json/json_spirit_utils.h"
+
+/** One result line of bench_hobonickels: nItems processed in nRuns runs. */
+json_spirit::Object BenchResult(const std::string& strName, int nRuns, uint64_t nItems, int64_t nTotalMicros);
+
+/** Times the database writes and reads of connecting blocks in one CTxDB
+ *  transaction, for many small blocks and for one block of thousands of
+ *  transactions, and the pending batch lookups of the large block with and
+ *  without the batch index. */
+bool RunTxDBBench(int nRuns, json_spirit::Array& results);
+
+/** Times the kernel hashes of a synthetic wallet searching a full 60 second
+ *  window, hashed one by one through a stream and in batches. */
+bool RunKernelHashBench(int nRuns, json_spirit::Array& results);
+
+/** Times lookups of existing block hashes among 200000 in a std::map, which
+ *  is what mapBlockIndex used to be, and in the hashed BlockMap. */
+bool RunBlockIndexBench(int nRuns, json_spirit::Array& results);
+
+/** Times the kernel target check done once per coin and second of the search
+ *  window, with CBigNum and with the uint256 code of KernelHashMeetsTarget. */
+bool RunKernelTargetBench(int nRuns, json_spirit::Array& results);
+
+/** Times signature checks the way CheckSig did them, with a new CKey each
+ *  time, and through each CSignatureVerifier built in. */
+bool RunECVerifyBench(int nRuns, json_spirit::Array& results);
+
+/** Times the SIGHASH_ALL hashes of every input of 10, 100 and 1000 input
+ *  transactions, one SignatureHash call each and through CSignatureHashCache. */
+bool RunSigHashBench(int nRuns, json_spirit::Array& results);
+
+/** Times taking the hashes of 10, 100 and 1000 transaction blocks as often as
+ *  connecting a new best block does, without and with MemoizeHashes. */
+bool RunHashMemoBench(int nRuns, json_spirit::Array& results);
+
+#endif
@@ -0,0 +1,65 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <map>
+
+#include "bench/bench.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+using namespace json_spirit;
+
+bool RunBlockIndexBench(int nRuns, Array& results)
+{
+    const int nBlocks = 200000;
+    const int nLookups = 1000000;
+
+    vector<uint256> vHash;
+    vHash.reserve(nBlocks);
+    for (int i = 0; i < nBlocks; i++)
+        vHash.push_back(Hash(BEGIN(i), END(i)));
+
+    // The values are only compared, never dereferenced
+    map<uint256, CBlockIndex*> mapTree;
+    BlockMap mapHashed;
+    mapHashed.reserve(nBlocks);
+    for (int i = 0; i < nBlocks; i++)
+    {
+        mapTree.insert(make_pair(vHash[i], (CBlockIndex*)&vHash[i]));
+        mapHashed.insert(make_pair(vHash[i], (CBlockIndex*)&vHash[i]));
+    }
+
+    int64_t nTreeTotal = 0, nHashedTotal = 0;
+    for (int nRun = 0; nRun < nRuns; nRun++)
+    {
+        int nMismatch = 0;
+        int64_t nStart = GetTimeMicros();
+        for (int i = 0; i < nLookups; i++)
+        {
+            const uint256& hash = vHash[(i * 17) % nBlocks];
+            map<uint256, CBlockIndex*>::const_iterator mi = mapTree.find(hash);
+            if (mi == mapTree.end() || mi->second != (CBlockIndex*)&hash)
+                nMismatch++;
+        }
+        nTreeTotal += GetTimeMicros() - nStart;
+
+        nStart = GetTimeMicros();
+        for (int i = 0; i < nLookups; i++)
+        {
+            const uint256& hash = vHash[(i * 17) % nBlocks];
+            BlockMap::const_iterator mi = mapHashed.find(hash);
+            if (mi == mapHashed.end() || mi->second != (CBlockIndex*)&hash)
+                nMismatch++;
+        }
+        nHashedTotal += GetTimeMicros() - nStart;
+
+        if (nMismatch != 0)
+            return error("RunBlockIndexBench() : %d lookups found the wrong block", nMismatch);
+    }
+
+    results.push_back(BenchResult("blockmaptreefind", nRuns, (uint64_t)nRuns * nLookups, nTreeTotal));
+    results.push_back(BenchResult("blockmaphashedfind", nRuns, (uint64_t)nRuns * nLookups, nHashedTotal));
+    return true;
+}
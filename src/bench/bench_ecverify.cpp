@@ -0,0 +1,64 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <boost/algorithm/string/case_conv.hpp>
+
+#include "bench/bench.h"
+#include "ecverify.h"
+#include "key.h"
+#include "util.h"
+
+using namespace std;
+using namespace json_spirit;
+
+bool RunECVerifyBench(int nRuns, Array& results)
+{
+    const int nSigs = 1000;
+    vector<uint256> vHash;
+    vector<vector<unsigned char> > vSig, vPubKey;
+    for (int i = 0; i < nSigs; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2);
+        vHash.push_back(GetRandHash());
+        vSig.push_back(vector<unsigned char>());
+        if (!key.Sign(vHash.back(), vSig.back()))
+            return error("RunECVerifyBench() : Sign failed");
+        vPubKey.push_back(key.GetPubKey().Raw());
+    }
+
+    vector<CSignatureVerifier*> vVerifiers;
+    vVerifiers.push_back(&GetOpenSSLVerifier());
+    if (&GetSignatureVerifier() != vVerifiers[0])
+        vVerifiers.push_back(&GetSignatureVerifier());
+
+    int64_t nKeyTotal = 0;
+    vector<int64_t> vVerifierTotal(vVerifiers.size(), 0);
+    for (int nRun = 0; nRun < nRuns; nRun++)
+    {
+        int64_t nStart = GetTimeMicros();
+        for (int i = 0; i < nSigs; i++)
+        {
+            CKey key;
+            if (!key.SetPubKey(CPubKey(vPubKey[i])) || !key.Verify(vHash[i], vSig[i]))
+                return error("RunECVerifyBench() : CKey rejected signature %d", i);
+        }
+        nKeyTotal += GetTimeMicros() - nStart;
+
+        for (unsigned int n = 0; n < vVerifiers.size(); n++)
+        {
+            nStart = GetTimeMicros();
+            for (int i = 0; i < nSigs; i++)
+                if (!vVerifiers[n]->Verify(vPubKey[i], vHash[i], vSig[i]))
+                    return error("RunECVerifyBench() : %s rejected signature %d", vVerifiers[n]->GetName(), i);
+            vVerifierTotal[n] += GetTimeMicros() - nStart;
+        }
+    }
+
+    results.push_back(BenchResult("ecverifyckey", nRuns, (uint64_t)nRuns * nSigs, nKeyTotal));
+    for (unsigned int n = 0; n < vVerifiers.size(); n++)
+        results.push_back(BenchResult("ecverify" + boost::algorithm::to_lower_copy(string(vVerifiers[n]->GetName())),
+                                      nRuns, (uint64_t)nRuns * nSigs, vVerifierTotal[n]));
+    return true;
+}
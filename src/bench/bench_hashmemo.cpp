@@ -0,0 +1,90 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <set>
+
+#include <boost/foreach.hpp>
+
+#include "bench/bench.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+using namespace json_spirit;
+
+static CBlock MakeBlock(int nTx)
+{
+    CBlock block;
+    block.nTime = GetAdjustedTime();
+    block.nBits = 0x1e0fffff;
+    for (int i = 0; i < nTx; i++)
+    {
+        CTransaction tx;
+        tx.nTime = block.nTime;
+        for (int j = 0; j < 2; j++)
+            tx.vin.push_back(CTxIn(COutPoint(GetRandHash(), j), CScript() << vector<unsigned char>(72, 0x30)));
+        for (int j = 0; j < 2; j++)
+            tx.vout.push_back(CTxOut(COIN, CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, 0x5a) << OP_EQUALVERIFY << OP_CHECKSIG));
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+// Takes the hashes of a block as often as connecting a new best block does:
+// the header once each in ProcessMessage, ProcessBlock, AcceptBlock,
+// AddToBlockIndex and SetBestChain, and every transaction once each for the
+// duplicate and merkle root checks of CheckBlock, which ConnectBlock runs
+// again, in ConnectBlock itself and when it leaves the memory pool
+static int HashLikeConnect(const CBlock& block)
+{
+    int nSeen = 0;
+    for (int i = 0; i < 5; i++)
+        nSeen += (block.GetHash() != 0);
+    for (int i = 0; i < 2; i++)
+    {
+        set<uint256> uniqueTx;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            uniqueTx.insert(tx.GetHash());
+        nSeen += uniqueTx.size();
+        nSeen += (block.BuildMerkleTree() == block.hashMerkleRoot);
+    }
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        nSeen += (tx.GetHash() != 0);
+        nSeen += (tx.GetHash() != 0);
+    }
+    return nSeen;
+}
+
+bool RunHashMemoBench(int nRuns, Array& results)
+{
+    static const int sizes[] = { 10, 100, 1000 };
+    BOOST_FOREACH(int nTx, sizes)
+    {
+        const CBlock blockTemplate = MakeBlock(nTx);
+        int64_t nPlainTotal = 0, nMemoTotal = 0;
+        for (int nRun = 0; nRun < nRuns; nRun++)
+        {
+            // Copies start out without memoized hashes
+            CBlock block(blockTemplate);
+
+            int64_t nStart = GetTimeMicros();
+            int nSeenPlain = HashLikeConnect(block);
+            nPlainTotal += GetTimeMicros() - nStart;
+
+            nStart = GetTimeMicros();
+            block.MemoizeHashes();
+            int nSeenMemo = HashLikeConnect(block);
+            nMemoTotal += GetTimeMicros() - nStart;
+
+            if (nSeenPlain != nSeenMemo)
+                return error("RunHashMemoBench() : %d hashes seen memoized, %d without", nSeenMemo, nSeenPlain);
+        }
+
+        results.push_back(BenchResult(strprintf("hashmemo%dplain", nTx), nRuns, (uint64_t)nRuns * nTx, nPlainTotal));
+        results.push_back(BenchResult(strprintf("hashmemo%dmemoized", nTx), nRuns, (uint64_t)nRuns * nTx, nMemoTotal));
+    }
+    return true;
+}
@@ -0,0 +1,88 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <boost/foreach.hpp>
+
+#include "bench/bench.h"
+#include "hash.h"
+#include "kernelhash.h"
+#include "serialize.h"
+#include "util.h"
+
+using namespace std;
+using namespace json_spirit;
+
+// The kernel as ScanForStakeKernelHash used to hash it
+static uint256 StreamKernelHash(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset, unsigned int nTimeTxPrev, unsigned int nPrevout, unsigned int nTimeTx)
+{
+    CDataStream ss(SER_GETHASH, 0);
+    ss << nStakeModifier;
+    ss << nTimeBlockFrom << nTxPrevOffset << nTimeTxPrev << nPrevout << nTimeTx;
+    return Hash(ss.begin(), ss.end());
+}
+
+struct CBenchKernelCoin
+{
+    uint64_t nStakeModifier;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTxPrevOffset;
+    unsigned int nTimeTxPrev;
+    unsigned int nPrevout;
+};
+
+bool RunKernelHashBench(int nRuns, Array& results)
+{
+    const unsigned int nSearchInterval = 60;
+    const int nCoins = 10000;
+    const unsigned int nTimeStart = 1420000000;
+
+    vector<CBenchKernelCoin> vCoins(nCoins);
+    BOOST_FOREACH(CBenchKernelCoin& coin, vCoins)
+    {
+        coin.nStakeModifier = (uint64_t)insecure_rand() << 32 | insecure_rand();
+        coin.nTimeBlockFrom = 1400000000 + insecure_rand() % 10000000;
+        coin.nTxPrevOffset = 81 + insecure_rand() % 100000;
+        coin.nTimeTxPrev = coin.nTimeBlockFrom - insecure_rand() % 600;
+        coin.nPrevout = insecure_rand() % 8;
+    }
+
+    int64_t nStreamTotal = 0, nBatchedTotal = 0;
+    for (int nRun = 0; nRun < nRuns; nRun++)
+    {
+        // Fold the hashes so neither loop can be optimized away
+        uint256 hashStream = 0;
+        int64_t nStart = GetTimeMicros();
+        BOOST_FOREACH(const CBenchKernelCoin& coin, vCoins)
+            for (unsigned int n = 0; n < nSearchInterval; n++)
+                hashStream ^= StreamKernelHash(coin.nStakeModifier, coin.nTimeBlockFrom, coin.nTxPrevOffset, coin.nTimeTxPrev, coin.nPrevout, nTimeStart - n);
+        nStreamTotal += GetTimeMicros() - nStart;
+
+        uint256 hashBatched = 0;
+        nStart = GetTimeMicros();
+        BOOST_FOREACH(const CBenchKernelCoin& coin, vCoins)
+        {
+            CKernelHasher hasher(coin.nStakeModifier, coin.nTimeBlockFrom, coin.nTxPrevOffset, coin.nTimeTxPrev, coin.nPrevout);
+            for (unsigned int n = 0; n < nSearchInterval; n += KERNEL_HASH_LANES)
+            {
+                unsigned int pnTimeTx[KERNEL_HASH_LANES];
+                uint256 phash[KERNEL_HASH_LANES];
+                unsigned int nBatch = min(nSearchInterval - n, (unsigned int)KERNEL_HASH_LANES);
+                for (unsigned int i = 0; i < nBatch; i++)
+                    pnTimeTx[i] = nTimeStart - (n + i);
+                hasher.GetHashes(pnTimeTx, nBatch, phash);
+                for (unsigned int i = 0; i < nBatch; i++)
+                    hashBatched ^= phash[i];
+            }
+        }
+        nBatchedTotal += GetTimeMicros() - nStart;
+
+        if (hashStream != hashBatched)
+            return error("RunKernelHashBench() : batched kernel hashes differ from the streamed ones");
+    }
+
+    uint64_t nHashes = (uint64_t)nRuns * nCoins * nSearchInterval;
+    results.push_back(BenchResult("kernelhashstream", nRuns, nHashes, nStreamTotal));
+    results.push_back(BenchResult("kernelhashbatched", nRuns, nHashes, nBatchedTotal));
+    return true;
+}
@@ -0,0 +1,50 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+#include "bignum.h"
+#include "kernel.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+using namespace json_spirit;
+
+bool RunKernelTargetBench(int nRuns, Array& results)
+{
+    const int nChecks = 200000;
+    const unsigned int nBits = 0x1d00ffff;
+    uint256 hashProofOfStake = ~uint256(0) >> 2;
+
+    vector<bool> vMeets(nChecks);
+    int64_t nBigNumTotal = 0, nArithTotal = 0;
+    for (int nRun = 0; nRun < nRuns; nRun++)
+    {
+        int64_t nStart = GetTimeMicros();
+        for (int i = 0; i < nChecks; i++)
+        {
+            CBigNum bnTargetPerCoinDay;
+            bnTargetPerCoinDay.SetCompact(nBits);
+            CBigNum bnCoinDayWeight = CBigNum((int64_t)(i + 1) * COIN) * (int64_t)(i % nStakeMaxAge) / COIN / (24 * 60 * 60);
+            vMeets[i] = bnCoinDayWeight * bnTargetPerCoinDay >= CBigNum(hashProofOfStake);
+        }
+        nBigNumTotal += GetTimeMicros() - nStart;
+
+        int nMismatch = 0;
+        nStart = GetTimeMicros();
+        for (int i = 0; i < nChecks; i++)
+        {
+            if (KernelHashMeetsTarget(nBits, (int64_t)(i + 1) * COIN, i % nStakeMaxAge, hashProofOfStake, NULL) != vMeets[i])
+                nMismatch++;
+        }
+        nArithTotal += GetTimeMicros() - nStart;
+
+        if (nMismatch != 0)
+            return error("RunKernelTargetBench() : %d of %d target checks differ from CBigNum", nMismatch, nChecks);
+    }
+
+    results.push_back(BenchResult("kerneltargetbignum", nRuns, (uint64_t)nRuns * nChecks, nBigNumTotal));
+    results.push_back(BenchResult("kerneltargetarith", nRuns, (uint64_t)nRuns * nChecks, nArithTotal));
+    return true;
+}
@@ -0,0 +1,75 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <boost/foreach.hpp>
+
+#include "bench/bench.h"
+#include "main.h"
+#include "script.h"
+#include "util.h"
+
+using namespace std;
+using namespace json_spirit;
+
+extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+
+// A transaction spending nInputs pay-to-pubkey-hash outputs to two outputs
+static CTransaction SpendTransaction(int nInputs)
+{
+    CTransaction tx;
+    tx.nTime = GetAdjustedTime();
+    for (int i = 0; i < nInputs; i++)
+    {
+        CScript scriptSig;
+        scriptSig << vector<unsigned char>(72, 0x30) << vector<unsigned char>(33, 0x02);
+        tx.vin.push_back(CTxIn(COutPoint(GetRandHash(), i % 2), scriptSig));
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        CScript scriptPubKey;
+        scriptPubKey << OP_DUP << OP_HASH160 << vector<unsigned char>(20, 0x5a + i) << OP_EQUALVERIFY << OP_CHECKSIG;
+        tx.vout.push_back(CTxOut(COIN, scriptPubKey));
+    }
+    return tx;
+}
+
+bool RunSigHashBench(int nRuns, Array& results)
+{
+    static const int sizes[] = { 10, 100, 1000 };
+    CScript scriptCode;
+    scriptCode << OP_DUP << OP_HASH160 << vector<unsigned char>(20, 0x5a) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+    BOOST_FOREACH(int nInputs, sizes)
+    {
+        CTransaction tx = SpendTransaction(nInputs);
+        vector<uint256> vHash(nInputs);
+        int64_t nPlainTotal = 0, nCachedTotal = 0;
+        for (int nRun = 0; nRun < nRuns; nRun++)
+        {
+            int64_t nStart = GetTimeMicros();
+            for (int i = 0; i < nInputs; i++)
+                vHash[i] = SignatureHash(scriptCode, tx, i, SIGHASH_ALL);
+            nPlainTotal += GetTimeMicros() - nStart;
+
+            // The cache is built per transaction, so its construction is timed too
+            int nMismatch = 0;
+            nStart = GetTimeMicros();
+            CSignatureHashCache cache(tx);
+            for (int i = 0; i < nInputs; i++)
+            {
+                uint256 hash;
+                if (!cache.GetHash(scriptCode, i, SIGHASH_ALL, hash) || hash != vHash[i])
+                    nMismatch++;
+            }
+            nCachedTotal += GetTimeMicros() - nStart;
+
+            if (nMismatch != 0)
+                return error("RunSigHashBench() : %d of %d cached hashes differ from SignatureHash", nMismatch, nInputs);
+        }
+
+        results.push_back(BenchResult(strprintf("sighash%dplain", nInputs), nRuns, (uint64_t)nRuns * nInputs, nPlainTotal));
+        results.push_back(BenchResult(strprintf("sighash%dcached", nInputs), nRuns, (uint64_t)nRuns * nInputs, nCachedTotal));
+    }
+    return true;
+}
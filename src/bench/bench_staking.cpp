@@ -0,0 +1,400 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Staking benchmark: builds a synthetic chain and wallet in a scratch data
+// directory, times each step the stake miner takes and the database work of
+// connecting blocks (bench_txdb.cpp), and prints the results as JSON on
+// stdout.
+//
+//   bench_hobonickels [-coins=<n>] [-coinblocks=<n>] [-runs=<n>]
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+#include "json/json_spirit_writer_template.h"
+
+#include "bench/bench.h"
+#include "checkqueue.h"
+#include "db.h"
+#include "kernel.h"
+#include "main.h"
+#include "miner.h"
+#include "txdb.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "wallet.h"
+
+using namespace std;
+using namespace json_spirit;
+
+// What init.cpp provides to the rest of the code
+CWalletManager* pWalletManager;
+CWallet* pwalletMain;
+CClientUIInterface uiInterface;
+
+extern void noui_connect();
+
+void Shutdown(void* parg)
+{
+    exit(0);
+}
+
+void StartShutdown()
+{
+    exit(0);
+}
+
+// A target no kernel hash meets, so the scan looks at every coin, and one
+// nearly every kernel hash meets
+static const unsigned int BENCH_BITS_HARD = 0x01010000;
+static const unsigned int BENCH_BITS_EASY = 0x1f00ffff;
+
+Object BenchResult(const string& strName, int nRuns, uint64_t nItems, int64_t nTotalMicros)
+{
+    Object result;
+    result.push_back(Pair("name",        strName));
+    result.push_back(Pair("runs",        nRuns));
+    result.push_back(Pair("items",       nItems));
+    result.push_back(Pair("totalus",     nTotalMicros));
+    result.push_back(Pair("meanus",      (double)nTotalMicros / nRuns));
+    result.push_back(Pair("itemspersec", (double)nItems * 1000000 / max(nTotalMicros, (int64_t)1)));
+    return result;
+}
+
+// Write a block of vtx on top of the best chain, index its transactions
+// and make it the best block, the way AcceptBlock and SetBestChain would
+// without checking it. Every block generates a stake modifier.
+static CBlockIndex* ConnectBenchBlock(CBlock& block, const vector<CTransaction>& vtx, unsigned int nTime)
+{
+    block.SetNull();
+    block.nVersion = CBlock::CURRENT_VERSION;
+    block.hashPrevBlock = hashBestChain;
+    block.nTime = nTime;
+    block.nBits = pindexBest->nBits;
+    block.vtx = vtx;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    unsigned int nFile, nBlockPos;
+    if (!block.WriteToDisk(nFile, nBlockPos))
+        throw runtime_error("ConnectBenchBlock() : WriteToDisk failed");
+
+    CTxDB txdb;
+    if (!txdb.TxnBegin())
+        throw runtime_error("ConnectBenchBlock() : TxnBegin failed");
+    unsigned int nTxPos = nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(block.vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        txdb.AddTxIndex(tx, CDiskTxPos(nFile, nBlockPos, nTxPos), pindexBest->nHeight + 1);
+        nTxPos += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+    }
+    if (!txdb.TxnCommit())
+        throw runtime_error("ConnectBenchBlock() : TxnCommit failed");
+
+    uint256 hash = block.GetHash();
+    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, block);
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+    pindexNew->pprev = pindexBest;
+    pindexNew->nHeight = pindexBest->nHeight + 1;
+    pindexNew->SetStakeModifier(hash.Get64(), true);
+    pindexBest->pnext = pindexNew;
+
+    pindexBest = pindexNew;
+    hashBestChain = hash;
+    nBestHeight = pindexNew->nHeight;
+    UpdateActiveChain(pindexNew);
+    return pindexNew;
+}
+
+static CTransaction BenchCoinBase(unsigned int nTime, int nHeight)
+{
+    CTransaction tx;
+    tx.nTime = nTime;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.SetNull();
+    tx.vin[0].scriptSig << nHeight << OP_0;
+    tx.vout.resize(1);
+    tx.vout[0].SetEmpty();
+    return tx;
+}
+
+// nCoins wallet outputs of one transaction each, spread over nCoinBlocks
+// blocks a minute apart, followed by an hour apart blocks up to now. The
+// coins are old enough to stake and have their stake modifiers.
+static void BuildBenchChain(CWallet& wallet, int nCoins, int nCoinBlocks)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    if (!wallet.AddKey(key))
+        throw runtime_error("BuildBenchChain() : AddKey failed");
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(key.GetPubKey().GetID());
+
+    LOCK2(cs_main, wallet.cs_wallet);
+    unsigned int nNow = GetAdjustedTime();
+    unsigned int nTime = nNow - (GetStakeMinAge() + 64 * GetModiferInterval() + 24 * 60 * 60);
+    int nCoin = 0;
+    for (int nBlock = 0; nBlock < nCoinBlocks; nBlock++, nTime += 60)
+    {
+        vector<CTransaction> vtx;
+        vtx.push_back(BenchCoinBase(nTime, nBestHeight + 1));
+        int nBlockCoins = nCoins / nCoinBlocks + (nBlock < nCoins % nCoinBlocks ? 1 : 0);
+        for (int i = 0; i < nBlockCoins; i++, nCoin++)
+        {
+            CTransaction tx;
+            tx.nTime = nTime - 60;
+            tx.vin.push_back(CTxIn(COutPoint(Hash(BEGIN(nCoin), END(nCoin)), 0)));
+            tx.vout.push_back(CTxOut((1 + insecure_rand() % 100) * COIN, scriptPubKey));
+            vtx.push_back(tx);
+        }
+
+        CBlock block;
+        ConnectBenchBlock(block, vtx, nTime);
+
+        // Added the way the wallet file is loaded
+        for (unsigned int i = 1; i < block.vtx.size(); i++)
+        {
+            CWalletTx& wtx = wallet.mapWallet[block.vtx[i].GetHash()];
+            wtx = CWalletTx(&wallet, block.vtx[i]);
+            wtx.hashBlock = hashBestChain;
+            wtx.nIndex = i;
+            wtx.vMerkleBranch = block.GetMerkleBranch(i);
+            wtx.nTimeReceived = nTime;
+        }
+    }
+
+    while (nTime + 60 * 60 < nNow)
+    {
+        nTime += 60 * 60;
+        vector<CTransaction> vtx(1, BenchCoinBase(nTime, nBestHeight + 1));
+        CBlock block;
+        ConnectBenchBlock(block, vtx, nTime);
+    }
+}
+
+static bool RunBench(CWallet& wallet, int nCoins, int nRuns, Array& results)
+{
+    unsigned int nSpendTime = GetAdjustedTime();
+    int64_t nBalance = wallet.GetBalance();
+
+    // Picking the staking coins out of the wallet
+    int64_t nTotal = 0;
+    uint64_t nItems = 0;
+    for (int nRun = 0; nRun < nRuns; nRun++)
+    {
+        CoinsSet setCoins;
+        int64_t nValueIn = 0;
+        int64_t nStart = GetTimeMicros();
+        wallet.SelectCoinsForStaking(nBalance, nSpendTime, setCoins, nValueIn);
+        nTotal += GetTimeMicros() - nStart;
+        nItems += setCoins.size();
+    }
+    results.push_back(BenchResult("selectcoinsforstaking", nRuns, nItems, nTotal));
+
+    // Reading the kernel data of every staking coin, which CreateCoinStake
+    // used to build its coin map from
+    nTotal = 0;
+    nItems = 0;
+    for (int nRun = 0; nRun < nRuns; nRun++)
+    {
+        wallet.InvalidateStakeCandidates();
+        int64_t nStart = GetTimeMicros();
+        if (!wallet.PrepareStakeCandidates())
+            return error("RunBench() : PrepareStakeCandidates failed");
+        nTotal += GetTimeMicros() - nStart;
+        nItems += wallet.GetStakeCandidateCount();
+    }
+    results.push_back(BenchResult("loadstakecandidates", nRuns, nItems, nTotal));
+    if (wallet.GetStakeCandidateCount() != (unsigned int)nCoins)
+        return error("RunBench() : %u staking candidates for %d coins", wallet.GetStakeCandidateCount(), nCoins);
+
+    // Bringing the candidates up to date after one wallet transaction changed
+    nTotal = 0;
+    nItems = 0;
+    map<uint256, CWalletTx>::const_iterator it = wallet.mapWallet.begin();
+    for (int nRun = 0; nRun < nRuns; nRun++, ++it)
+    {
+        if (it == wallet.mapWallet.end())
+            it = wallet.mapWallet.begin();
+        wallet.MarkStakeCandidatesDirty(it->first);
+        int64_t nStart = GetTimeMicros();
+        if (!wallet.PrepareStakeCandidates())
+            return error("RunBench() : PrepareStakeCandidates failed");
+        nTotal += GetTimeMicros() - nStart;
+        nItems++;
+    }
+    results.push_back(BenchResult("updatestakecandidates", nRuns, nItems, nTotal));
+
+    // A full 60 second kernel search over every coin
+    nTotal = 0;
+    nItems = 0;
+    for (int nRun = 0; nRun < nRuns; nRun++)
+    {
+        KernelSearchSettings settings;
+        settings.nBits = BENCH_BITS_HARD;
+        settings.nTime = nSpendTime;
+        settings.nOffset = 0;
+        settings.nLimit = wallet.GetStakeCandidateCount();
+        settings.nSearchInterval = 60;
+
+        CoinsSet::value_type kernelcoin;
+        unsigned int nTimeTx, nBlockTime;
+        uint64_t nKernelsChecked = 0;
+        int64_t nStart = GetTimeMicros();
+        if (wallet.ScanStakeCandidates(settings, kernelcoin, nTimeTx, nBlockTime, &nKernelsChecked))
+            return error("RunBench() : kernel found with an unreachable target");
+        nTotal += GetTimeMicros() - nStart;
+        nItems += nKernelsChecked;
+    }
+    results.push_back(BenchResult("scanforstakekernelhash", nRuns, nItems, nTotal));
+
+    // The same search in chunks on the stake miner's search queue, from one
+    // thread up to one per core
+    StakeCandidatesPtr pcandidates = wallet.GetStakeCandidates();
+    int nMaxThreads = max((int)boost::thread::hardware_concurrency(), 1);
+    for (int nThreads = 1; ; nThreads = min(nThreads * 2, nMaxThreads))
+    {
+        CCheckQueue<CStakeKernelSearch> queue(1);
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads - 1; i++)
+            threadGroup.create_thread(boost::bind(&ThreadStakeSearch, &queue));
+
+        nTotal = 0;
+        nItems = 0;
+        for (int nRun = 0; nRun < nRuns; nRun++)
+        {
+            CStakeSearchResult result;
+            result.pindexPrev = pindexBest;
+            vector<CStakeKernelSearch> vSearch;
+            unsigned int nChunk = 0;
+            for (unsigned int nOffset = 0; nOffset < pcandidates->size(); nOffset += STAKE_SEARCH_CHUNK)
+            {
+                KernelSearchSettings settings;
+                settings.nBits = BENCH_BITS_HARD;
+                settings.nTime = nSpendTime;
+                settings.nOffset = nOffset;
+                settings.nLimit = min(STAKE_SEARCH_CHUNK, (unsigned int)pcandidates->size() - nOffset);
+                settings.nSearchInterval = 60;
+                vSearch.push_back(CStakeKernelSearch(&wallet, pcandidates, settings, nChunk++, &result));
+            }
+            reverse(vSearch.begin(), vSearch.end());
+
+            int64_t nStart = GetTimeMicros();
+            {
+                CCheckQueueControl<CStakeKernelSearch> control(&queue);
+                control.Add(vSearch);
+                control.Wait();
+            }
+            nTotal += GetTimeMicros() - nStart;
+            if (result.fFound)
+                return error("RunBench() : kernel found with an unreachable target");
+            nItems += result.nKernelsChecked;
+        }
+        queue.Quit();
+        threadGroup.join_all();
+        results.push_back(BenchResult(strprintf("stakekernelsearch%dthreads", nThreads), nRuns, nItems, nTotal));
+        if (nThreads == nMaxThreads)
+            break;
+    }
+
+    // Building and signing a coinstake, then checking it the way a received
+    // block is checked. Each run stakes another coin, so no signature is
+    // checked twice.
+    int64_t nSignTotal = 0, nCheckTotal = 0;
+    int nStakeRuns = min(nRuns, nCoins);
+    for (int nRun = 0; nRun < nStakeRuns; nRun++)
+    {
+        KernelSearchSettings settings;
+        settings.nBits = BENCH_BITS_EASY;
+        settings.nTime = nSpendTime;
+        settings.nOffset = nRun;
+        settings.nLimit = 1;
+        settings.nSearchInterval = 60;
+
+        CoinsSet::value_type kernelcoin;
+        unsigned int nTimeTx, nBlockTime;
+        if (!wallet.ScanStakeCandidates(settings, kernelcoin, nTimeTx, nBlockTime))
+            return error("RunBench() : no kernel found for coin %d", nRun);
+
+        CTransaction txCoinStake;
+        CKey key;
+        int64_t nStart = GetTimeMicros();
+        if (!wallet.CreateCoinStakeFromKernel(wallet, BENCH_BITS_EASY, kernelcoin, nTimeTx, nBlockTime, txCoinStake, key))
+            return error("RunBench() : CreateCoinStakeFromKernel failed");
+        nSignTotal += GetTimeMicros() - nStart;
+
+        uint256 hashProofOfStake, targetProofOfStake;
+        nStart = GetTimeMicros();
+        if (!CheckProofOfStake(txCoinStake, BENCH_BITS_EASY, hashProofOfStake, targetProofOfStake))
+            return error("RunBench() : CheckProofOfStake failed");
+        nCheckTotal += GetTimeMicros() - nStart;
+    }
+    results.push_back(BenchResult("createcoinstake", nStakeRuns, nStakeRuns, nSignTotal));
+    results.push_back(BenchResult("checkproofofstake", nStakeRuns, nStakeRuns, nCheckTotal));
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    int nCoins = max((int)GetArg("-coins", 10000), 1);
+    int nCoinBlocks = max((int)GetArg("-coinblocks", 100), 1);
+    int nRuns = max((int)GetArg("-runs", 10), 1);
+
+    // The chain and the log go to a scratch data directory
+    boost::filesystem::path pathData = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("hobonickels-bench-%%%%-%%%%");
+    boost::filesystem::create_directories(pathData);
+    mapArgs["-datadir"] = pathData.string();
+
+    noui_connect();
+    bitdb.MakeMock();
+    bool fOk = false;
+    Object obj;
+    {
+        CWallet wallet;
+        try
+        {
+            if (!LoadBlockIndex(true))
+                throw runtime_error("LoadBlockIndex failed");
+            seed_insecure_rand(true);
+            int64_t nStart = GetTimeMicros();
+            BuildBenchChain(wallet, nCoins, nCoinBlocks);
+            obj.push_back(Pair("coins",   nCoins));
+            obj.push_back(Pair("blocks",  nBestHeight));
+            obj.push_back(Pair("setupus", GetTimeMicros() - nStart));
+
+            Array results;
+            fOk = RunBench(wallet, nCoins, nRuns, results) &&
+                  RunTxDBBench(nRuns, results) &&
+                  RunKernelHashBench(nRuns, results) &&
+                  RunBlockIndexBench(nRuns, results) &&
+                  RunKernelTargetBench(nRuns, results) &&
+                  RunECVerifyBench(nRuns, results) &&
+                  RunSigHashBench(nRuns, results) &&
+                  RunHashMemoBench(nRuns, results);
+            obj.push_back(Pair("results", results));
+        }
+        catch (std::exception& e)
+        {
+            PrintExceptionContinue(&e, "bench_hobonickels");
+        }
+    }
+
+    if (fOk)
+        printf("%s\n", write_string(Value(obj), true).c_str());
+    else
+        fprintf(stderr, "bench_hobonickels: failed, see %s\n", (pathData / "debug.log").string().c_str());
+
+    if (fOk)
+    {
+        try {
+            boost::filesystem::remove_all(pathData);
+        } catch (boost::filesystem::filesystem_error& e) {
+            // The block files may still be open on some systems
+        }
+    }
+    return fOk ? 0 : 1;
+}
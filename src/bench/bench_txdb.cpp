@@ -0,0 +1,186 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench/bench.h"
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+using namespace std;
+using namespace json_spirit;
+
+#ifdef USE_LEVELDB
+// The way CTxDB found a key in a pending batch before the batch was
+// indexed: walk every operation.
+class CLinearBatchScanner : public leveldb::WriteBatch::Handler
+{
+public:
+    string needle;
+    string value;
+    bool fDeleted;
+    bool fFound;
+
+    CLinearBatchScanner(const string& needleIn) : needle(needleIn), fDeleted(false), fFound(false) {}
+
+    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& valueIn)
+    {
+        if (key.ToString() == needle)
+        {
+            fFound = true;
+            fDeleted = false;
+            value = valueIn.ToString();
+        }
+    }
+
+    virtual void Delete(const leveldb::Slice& key)
+    {
+        if (key.ToString() == needle)
+        {
+            fFound = true;
+            fDeleted = true;
+        }
+    }
+};
+#endif
+
+// Transactions each spending an output of an earlier one
+static vector<CTransaction> ReplayTransactions(int nTx)
+{
+    vector<CTransaction> vtx(nTx);
+    for (int i = 0; i < nTx; i++)
+    {
+        vtx[i].nTime = i;
+        vtx[i].vin.push_back(CTxIn(COutPoint(i > 0 ? vtx[i / 2].GetHash() : 0, i % 2)));
+        vtx[i].vout.resize(2);
+    }
+    return vtx;
+}
+
+// What a reorganization that connects vtx in blocks of nBlockTx
+// transactions does to the database inside one transaction: each
+// transaction reads back and marks the output it spends and adds its
+// transaction index, and each block writes its block index record and moves
+// the best chain. The transaction is aborted, so the chain the staking
+// benchmark built stays as it was.
+static bool ReplayConnect(CTxDB& txdb, const vector<CTransaction>& vtx, unsigned int nBlockTx)
+{
+    if (!txdb.TxnBegin())
+        return error("ReplayConnect() : TxnBegin failed");
+    uint256 hashBlock = 0;
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        CDiskTxPos pos(1, 1000, 1000 + i);
+        if (i > 0)
+        {
+            CTxIndex txindexPrev;
+            if (!txdb.ReadTxIndex(vtx[i / 2].GetHash(), txindexPrev))
+                return error("ReplayConnect() : ReadTxIndex failed");
+            txindexPrev.vSpent[i % 2] = pos;
+            txdb.UpdateTxIndex(vtx[i / 2].GetHash(), txindexPrev);
+        }
+        txdb.AddTxIndex(vtx[i], pos, i / nBlockTx + 1);
+
+        if ((i + 1) % nBlockTx != 0 && i + 1 != vtx.size())
+            continue;
+        CBlockIndex blockindex;
+        blockindex.nHeight = i / nBlockTx + 1;
+        blockindex.nTime = vtx[i].nTime;
+        CDiskBlockIndex diskindex(&blockindex);
+        diskindex.hashPrev = hashBlock;
+        hashBlock = diskindex.GetBlockHash();
+        txdb.WriteBlockIndex(diskindex);
+        txdb.WriteHashBestChain(hashBlock);
+
+        uint256 hashBestChainRead;
+        if (!txdb.ReadHashBestChain(hashBestChainRead) || hashBestChainRead != hashBlock)
+            return error("ReplayConnect() : ReadHashBestChain mismatch");
+    }
+    return txdb.TxnAbort();
+}
+
+#ifdef USE_LEVELDB
+// The pending batch lookups of connecting one block of vtx with every
+// record in a single batch, as CTxDB did before the transaction index
+// cache: through the batch index and by walking the batch.
+static bool ReplayBatchLookups(const vector<CTransaction>& vtx, int64_t& nIndexedTime, int64_t& nLinearTime)
+{
+    CIndexedWriteBatch batch;
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        CTxIndex txindex(CDiskTxPos(1, 1000, 1000 + i), 2);
+        if (i > 0)
+        {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            ssKey << make_pair(string("tx"), vtx[i / 2].GetHash());
+            string value;
+            bool fDeleted = false;
+
+            int64_t nStart = GetTimeMicros();
+            bool fFound = batch.Find(ssKey.str(), &value, &fDeleted);
+            nIndexedTime += GetTimeMicros() - nStart;
+
+            nStart = GetTimeMicros();
+            CLinearBatchScanner scanner(ssKey.str());
+            batch.GetBatch()->Iterate(&scanner);
+            nLinearTime += GetTimeMicros() - nStart;
+
+            if (!fFound || fDeleted != scanner.fDeleted || value != scanner.value)
+                return error("ReplayBatchLookups() : lookup mismatch");
+
+            CTxIndex txindexPrev;
+            CDataStream ssValue(value.data(), value.data() + value.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> txindexPrev;
+            txindexPrev.vSpent[i % 2] = txindex.pos;
+            CDataStream ssPrev(SER_DISK, CLIENT_VERSION);
+            ssPrev << txindexPrev;
+            batch.Put(ssKey.str(), ssPrev.str());
+        }
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << make_pair(string("tx"), vtx[i].GetHash());
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue << txindex;
+        batch.Put(ssKey.str(), ssValue.str());
+    }
+    return true;
+}
+#endif
+
+bool RunTxDBBench(int nRuns, Array& results)
+{
+    const int nBlocks = 2000;
+    const int nBlockTx = 4000;
+    vector<CTransaction> vtx = ReplayTransactions(nBlocks);
+    vector<CTransaction> vtxBlock = ReplayTransactions(nBlockTx);
+
+    CTxDB txdb;
+    int64_t nTotal = 0;
+    for (int nRun = 0; nRun < nRuns; nRun++)
+    {
+        int64_t nStart = GetTimeMicros();
+        if (!ReplayConnect(txdb, vtx, 1))
+            return false;
+        nTotal += GetTimeMicros() - nStart;
+    }
+    results.push_back(BenchResult("txdbconnectreplay", nRuns, (uint64_t)nRuns * nBlocks, nTotal));
+
+    nTotal = 0;
+    for (int nRun = 0; nRun < nRuns; nRun++)
+    {
+        int64_t nStart = GetTimeMicros();
+        if (!ReplayConnect(txdb, vtxBlock, nBlockTx))
+            return false;
+        nTotal += GetTimeMicros() - nStart;
+    }
+    results.push_back(BenchResult("txdbconnectlargeblock", nRuns, (uint64_t)nRuns * nBlockTx, nTotal));
+
+#ifdef USE_LEVELDB
+    int64_t nIndexedTime = 0, nLinearTime = 0;
+    for (int nRun = 0; nRun < nRuns; nRun++)
+        if (!ReplayBatchLookups(vtxBlock, nIndexedTime, nLinearTime))
+            return false;
+    results.push_back(BenchResult("txdbbatchfindindexed", nRuns, (uint64_t)nRuns * (nBlockTx - 1), nIndexedTime));
+    results.push_back(BenchResult("txdbbatchfindlinear", nRuns, (uint64_t)nRuns * (nBlockTx - 1), nLinearTime));
+#endif
+    return true;
+}
@@ -234,9 +234,11 @@ static const CRPCCommand vRPCCommands[] =
     { "addnode",                &addnode,                true,   true,     false },
     { "getaddednodeinfo",       &getaddednodeinfo,       true,   true,     false },
     { "getdifficulty",          &getdifficulty,          true,   false,    false },
+    { "getmemoryinfo",          &getmemoryinfo,          true,   false,    false },
     { "getsubsidy",             &getsubsidy,             true,   false,    false },
     { "getinfo",                &getinfo,                true,   false,    true  },
     { "getmininginfo",          &getmininginfo,          true,   false,    true  },
+    { "getstakinginfo",         &getstakinginfo,         true,   false,    true  },
     { "getnewaddress",          &getnewaddress,          true,   false,    true  },
     { "getaccountaddress",      &getaccountaddress,      true,   false,    true  },
     { "setaccount",             &setaccount,             true,   false,    true  },
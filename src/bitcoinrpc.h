@@ -159,6 +159,7 @@ extern json_spirit::Value sendalert(CWallet* pWallet, const json_spirit::Array&
 extern json_spirit::Value stakeforcharity(CWallet* pWallet, const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value getmininginfo(CWallet* pWallet, const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getstakinginfo(CWallet* pWallet, const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getwork(CWallet* pWallet, const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getworkex(CWallet* pWallet, const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblocktemplate(CWallet* pWallet, const json_spirit::Array& params, bool fHelp);
@@ -228,6 +229,7 @@ extern json_spirit::Value sendrawtransaction(CWallet* pWallet, const json_spirit
 extern json_spirit::Value getbestblockhash(CWallet* pWallet, const json_spirit::Array& params, bool fHelp); // in rpcblockchain.cpp
 extern json_spirit::Value getblockcount(CWallet* pWallet, const json_spirit::Array& params, bool fHelp); // in rpcblockchain.cpp
 extern json_spirit::Value getdifficulty(CWallet* pWallet, const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getmemoryinfo(CWallet* pWallet, const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value settxfee(CWallet* pWallet, const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getrawmempool(CWallet* pWallet, const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockhash(CWallet* pWallet, const json_spirit::Array& params, bool fHelp);
@@ -5,6 +5,7 @@
 #define  BITCOIN_CHECKPOINT_H
 
 #include <map>
+#include <boost/unordered_map.hpp>
 #include "net.h"
 #include "util.h"
 
@@ -18,6 +19,8 @@
 
 class uint256;
 class CBlockIndex;
+struct BlockHasher;
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 class CSyncCheckpoint;
 
 /** Block-chain checkpoints are compiled-in sanity checks.
@@ -44,7 +47,7 @@ namespace Checkpoints
     int GetTotalBlocksEstimate();
 
     // Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex);
+    CBlockIndex* GetLastCheckpoint(const BlockMap& mapBlockIndex);
 
     extern uint256 hashSyncCheckpoint;
     extern CSyncCheckpoint checkpointMessage;
@@ -0,0 +1,312 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <limits.h>
+#include <string.h>
+
+#include <boost/thread/tss.hpp>
+
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+
+#ifdef USE_SECP256K1
+#include <secp256k1.h>
+#endif
+
+#include "ecverify.h"
+#include "key.h"
+
+// Reads a BER tag and length the way OpenSSL's ASN1_get_object does. An
+// indefinite length runs to pend.
+static bool ReadBERHeader(const unsigned char*& p, const unsigned char* pend, unsigned char& nFlags, unsigned int& nTag, size_t& nLen, bool& fIndefinite)
+{
+    if (pend - p < 2)
+        return false;
+    nFlags = *p & 0xe0; // class and constructed bits
+    nTag = *p++ & 0x1f;
+    if (nTag == 0x1f)
+    {
+        // High tag number form, seven bits per byte
+        nTag = 0;
+        while (*p & 0x80)
+        {
+            nTag = (nTag << 7) | (*p++ & 0x7f);
+            if (p == pend || nTag > (INT_MAX >> 7))
+                return false;
+        }
+        nTag = (nTag << 7) | (*p++ & 0x7f);
+        if (p == pend)
+            return false;
+    }
+
+    fIndefinite = (*p == 0x80);
+    if (fIndefinite)
+    {
+        p++;
+        nLen = pend - p;
+        return (nFlags & 0x20) != 0;
+    }
+    unsigned int nBytes = *p & 0x7f;
+    if (*p++ & 0x80)
+    {
+        // OpenSSL wants a byte past the length even if there is no content
+        if ((size_t)(pend - p) < nBytes + 1)
+            return false;
+        while (nBytes > 0 && *p == 0)
+        {
+            p++;
+            nBytes--;
+        }
+        if (nBytes > sizeof(long))
+            return false;
+        unsigned long n = 0;
+        while (nBytes-- > 0)
+            n = (n << 8) | *p++;
+        if (n > LONG_MAX)
+            return false;
+        nLen = n;
+    }
+    else
+        nLen = nBytes;
+    return nLen <= (size_t)(pend - p);
+}
+
+// Reads one INTEGER of the signature into 32 big endian bytes. OpenSSL
+// reads the content as unsigned, whatever its padding.
+static bool ReadInteger(const unsigned char*& p, const unsigned char* pend, unsigned char* pch, bool& fOverflow)
+{
+    unsigned char nFlags;
+    unsigned int nTag;
+    size_t nLen;
+    bool fIndefinite;
+    if (!ReadBERHeader(p, pend, nFlags, nTag, nLen, fIndefinite) || nFlags != 0 || nTag != 2)
+        return false;
+    const unsigned char* pcontent = p;
+    p += nLen;
+    while (nLen > 0 && *pcontent == 0)
+    {
+        pcontent++;
+        nLen--;
+    }
+    memset(pch, 0, 32);
+    if (nLen > 32)
+        fOverflow = true;
+    else if (nLen > 0)
+        memcpy(pch + 32 - nLen, pcontent, nLen);
+    return true;
+}
+
+bool ParseSignatureLax(const std::vector<unsigned char>& vchSig, unsigned char* pchR, unsigned char* pchS)
+{
+    if (vchSig.empty())
+        return false;
+    const unsigned char* p = &vchSig[0];
+    const unsigned char* pend = p + vchSig.size();
+
+    unsigned char nFlags;
+    unsigned int nTag;
+    size_t nLen;
+    bool fIndefinite;
+    if (!ReadBERHeader(p, pend, nFlags, nTag, nLen, fIndefinite) || nFlags != 0x20 || nTag != 16)
+        return false;
+
+    // r and s make up the whole sequence, or are followed by an end of
+    // contents marker if its length is indefinite. Anything after the
+    // sequence is ignored.
+    const unsigned char* pseqend = p + nLen;
+    bool fOverflow = false;
+    if (!ReadInteger(p, pseqend, pchR, fOverflow) || !ReadInteger(p, pseqend, pchS, fOverflow))
+        return false;
+    if (fIndefinite)
+    {
+        if (pseqend - p < 2 || p[0] != 0 || p[1] != 0)
+            return false;
+    }
+    else if (p != pseqend)
+        return false;
+
+    if (fOverflow)
+    {
+        memset(pchR, 0, 32);
+        memset(pchS, 0, 32);
+    }
+    return true;
+}
+
+
+//
+// OpenSSL
+//
+
+// Each thread keeps its own key, on a group with the multiples of the
+// generator computed in advance, so a check neither builds the curve nor
+// allocates a key.
+class CVerifyKey
+{
+public:
+    EC_KEY* pkey;
+
+    CVerifyKey()
+    {
+        EC_GROUP* group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+        if (group == NULL)
+            throw key_error("CVerifyKey() : EC_GROUP_new_by_curve_name failed");
+        EC_GROUP_precompute_mult(group, NULL);
+        pkey = EC_KEY_new();
+        if (pkey == NULL || !EC_KEY_set_group(pkey, group))
+        {
+            EC_GROUP_free(group);
+            throw key_error("CVerifyKey() : EC_KEY_set_group failed");
+        }
+        EC_GROUP_free(group);
+    }
+
+    ~CVerifyKey()
+    {
+        EC_KEY_free(pkey);
+    }
+};
+
+class COpenSSLVerifier : public CSignatureVerifier
+{
+private:
+    mutable boost::thread_specific_ptr<CVerifyKey> verifyKey;
+
+public:
+    const char* GetName() const
+    {
+        return "OpenSSL";
+    }
+
+    bool Verify(const std::vector<unsigned char>& vchPubKey, const uint256& hash, const std::vector<unsigned char>& vchSig) const
+    {
+        if (vchPubKey.empty() || vchSig.empty())
+            return false;
+        if (verifyKey.get() == NULL)
+            verifyKey.reset(new CVerifyKey());
+        EC_KEY* pkey = verifyKey->pkey;
+
+        const unsigned char* pbegin = &vchPubKey[0];
+        if (!o2i_ECPublicKey(&pkey, &pbegin, vchPubKey.size()))
+            return false;
+
+        // The same call as CKey::Verify, so the encodings taken are the
+        // ones CheckSig and CheckBlockSignature take with this OpenSSL
+        return ECDSA_verify(0, (const unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) == 1;
+    }
+};
+
+CSignatureVerifier& GetOpenSSLVerifier()
+{
+    static COpenSSLVerifier verifier;
+    return verifier;
+}
+
+
+//
+// libsecp256k1
+//
+
+#ifdef USE_SECP256K1
+// Appends an INTEGER holding the 32 big endian bytes at pch the way
+// i2d_ECDSA_SIG writes it: no leading zeros, unless one is needed to keep
+// the value positive
+static void AppendIntegerDER(const unsigned char* pch, std::vector<unsigned char>& vch)
+{
+    const unsigned char* pend = pch + 32;
+    while (pch != pend && *pch == 0)
+        pch++;
+    bool fPad = (pch == pend || (*pch & 0x80));
+    vch.push_back(0x02);
+    vch.push_back((pend - pch) + fPad);
+    if (fPad)
+        vch.push_back(0);
+    vch.insert(vch.end(), pch, pend);
+}
+
+// Whether ECDSA_verify of the OpenSSL linked in takes a signature that is
+// not strict DER. Releases since 1.0.0p and 1.0.1k encode the signature
+// again and reject it unless the encodings match.
+static bool OpenSSLAcceptsBER()
+{
+    CKey key;
+    key.MakeNewKey(true);
+    uint256 hash = 1;
+    std::vector<unsigned char> vchSig;
+    if (!key.Sign(hash, vchSig) || vchSig.size() < 2 || vchSig[1] >= 0x80)
+        return false;
+
+    // The same signature with a long form sequence length
+    vchSig.insert(vchSig.begin() + 1, 0x81);
+    return key.Verify(hash, vchSig);
+}
+
+class CSecp256k1Verifier : public CSignatureVerifier
+{
+private:
+    secp256k1_context* ctx;
+    bool fStrictDER;
+
+public:
+    CSecp256k1Verifier()
+    {
+        ctx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
+        fStrictDER = !OpenSSLAcceptsBER();
+    }
+
+    ~CSecp256k1Verifier()
+    {
+        secp256k1_context_destroy(ctx);
+    }
+
+    const char* GetName() const
+    {
+        return "libsecp256k1";
+    }
+
+    bool Verify(const std::vector<unsigned char>& vchPubKey, const uint256& hash, const std::vector<unsigned char>& vchSig) const
+    {
+        secp256k1_pubkey pubkey;
+        if (vchPubKey.empty() || !secp256k1_ec_pubkey_parse(ctx, &pubkey, &vchPubKey[0], vchPubKey.size()))
+            return false;
+
+        unsigned char pchRS[64];
+        if (!ParseSignatureLax(vchSig, pchRS, pchRS + 32))
+            return false;
+        if (fStrictDER)
+        {
+            std::vector<unsigned char> vchDER(2);
+            AppendIntegerDER(pchRS, vchDER);
+            AppendIntegerDER(pchRS + 32, vchDER);
+            vchDER[0] = 0x30;
+            vchDER[1] = vchDER.size() - 2;
+            if (vchDER != vchSig)
+                return false;
+        }
+        secp256k1_ecdsa_signature sig;
+        if (!secp256k1_ecdsa_signature_parse_compact(ctx, &sig, pchRS))
+            return false;
+
+        // OpenSSL takes s as well as its negation, libsecp256k1 only the
+        // lower of the two
+        secp256k1_ecdsa_signature_normalize(ctx, &sig, &sig);
+        return secp256k1_ecdsa_verify(ctx, &sig, (const unsigned char*)&hash, &pubkey) == 1;
+    }
+};
+
+CSignatureVerifier& GetSecp256k1Verifier()
+{
+    static CSecp256k1Verifier verifier;
+    return verifier;
+}
+#endif
+
+CSignatureVerifier& GetSignatureVerifier()
+{
+#ifdef USE_SECP256K1
+    return GetSecp256k1Verifier();
+#else
+    return GetOpenSSLVerifier();
+#endif
+}
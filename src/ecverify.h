@@ -0,0 +1,45 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_ECVERIFY_H
+#define BITCOIN_ECVERIFY_H
+
+#include <vector>
+
+#include "uint256.h"
+
+/** Checks ECDSA signatures over secp256k1 for CheckSig.
+ *
+ * The backend is picked at build time: libsecp256k1 when built with
+ * USE_SECP256K1=1, OpenSSL otherwise. Every backend takes exactly the
+ * signatures CKey::Verify takes, which is what ECDSA_verify of the OpenSSL
+ * linked in accepts: any encoding d2i_ECDSA_SIG reads on older releases,
+ * strict DER only on 1.0.0p, 1.0.1k and later.
+ */
+class CSignatureVerifier
+{
+public:
+    virtual ~CSignatureVerifier() { }
+
+    virtual const char* GetName() const = 0;
+
+    // vchSig is the encoded signature without the hash type byte
+    virtual bool Verify(const std::vector<unsigned char>& vchPubKey, const uint256& hash, const std::vector<unsigned char>& vchSig) const = 0;
+};
+
+CSignatureVerifier& GetOpenSSLVerifier();
+#ifdef USE_SECP256K1
+CSignatureVerifier& GetSecp256k1Verifier();
+#endif
+
+/** The backend selected at build time */
+CSignatureVerifier& GetSignatureVerifier();
+
+/** Parse an encoded signature into big endian r and s, accepting what
+ * OpenSSL's d2i_ECDSA_SIG accepts: BER lengths, padded or negative looking
+ * integers and trailing data. Values longer than 32 bytes can never be
+ * valid and set both r and s to zero.
+ */
+bool ParseSignatureLax(const std::vector<unsigned char>& vchSig, unsigned char* pchR, unsigned char* pchS);
+
+#endif
@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include "init.h"
 #include "main.h"
+#include "miner.h"
 #include "txdb.h"
 #include "walletdb.h"
 #include "bitcoinrpc.h"
@@ -13,6 +14,7 @@
 #include "ui_interface.h"
 #include "timer.h"
 #include "checkpoints.h"
+#include "ecverify.h"
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/convenience.hpp>
@@ -89,6 +91,16 @@ void Shutdown(void* parg)
         bitdb.Flush(false);
         StopNode();
         UnregisterNodeSignals(GetNodeSignals());
+#ifdef USE_LEVELDB
+        // Write back the cached transaction index before exiting
+        if (pindexGenesisBlock)
+        {
+            LOCK(cs_main);
+            CTxDB().FlushTxIndexCache();
+        }
+        if (pindexGenesisBlock && GetArg("-blockindexsnapshot", 60) > 0)
+            CTxDB().WriteBlockIndexSnapshot();
+#endif
         bitdb.Flush(true);
         boost::filesystem::remove(GetPidFile());
         delete pWalletManager;
@@ -238,6 +250,8 @@ std::string HelpMessage()
         strUsage += "  -pid=<file>            " + _("Specify pid file (default: HoboNickelsd.pid)") + "\n";
         strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
         strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n";
+        strUsage += "  -txindexcache=<n>      " + _("Set transaction index write-back cache size in megabytes (default: 100)") + "\n";
+        strUsage += "  -blockindexsnapshot=<n> " + _("Write a block index snapshot for fast startup every <n> minutes and on shutdown (0 to disable, default: 60)") + "\n";
         strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
         strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
         strUsage += "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n";
@@ -318,10 +332,13 @@ std::string HelpMessage()
         strUsage += "  -zapwallettxes         " + _("Clear list of wallet transactions (diagnostic tool; implies -rescan)") + "\n";
         strUsage += "  -splitthreshold=<n>    " + _("Set stake split threshold within range (default 25),(max 2500))") + "\n";
         strUsage += "  -combinethreshold=<n>  " + _("Set stake combine threshold within range (default 50),(max 5000))") + "\n";
+        strUsage += "  -stakethreads=N        " + _("Set the number of threads searching for stake kernels (1-64, 0=one per core, default: 2)") + "\n";
         strUsage += "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n";
         strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n";
         strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
         strUsage += "  -par=N                 " + _("Set the number of script verification threads (1-16, 0=auto, default: 0)") + "\n";
+        strUsage += "  -coinagecache=<n>      " + _("Keep coin age data of up to <n> unspent outputs in memory (default: 100000)") + "\n";
+        strUsage += "  -maxsigcachesize=<n>   " + _("Keep up to <n> valid signatures in memory (default: 50000)") + "\n";
         strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
 
         strUsage += "\n" + _("Block creation options:") + "\n" +
@@ -554,6 +571,17 @@ bool AppInit2()
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    coinAgeCache.SetMaxSize(std::max((int)GetArg("-coinagecache", 100000), 0));
+
+    // -stakethreads=0 means one per core; the stake miner thread is one of them
+    nStakeSearchThreads = GetArg("-stakethreads", DEFAULT_STAKE_SEARCH_THREADS);
+    if (nStakeSearchThreads <= 0)
+       nStakeSearchThreads = boost::thread::hardware_concurrency();
+    if (nStakeSearchThreads < 1)
+       nStakeSearchThreads = 1;
+    else if (nStakeSearchThreads > MAX_STAKE_SEARCH_THREADS)
+       nStakeSearchThreads = MAX_STAKE_SEARCH_THREADS;
+
 
     fDebug = !mapMultiArgs["-debug"].empty();
     // Special-case: if -debug=0/-nodebug is set, turn off debugging messages
@@ -662,10 +690,14 @@ bool AppInit2()
         fprintf(stdout, "HoboNickels server starting\n");
 
     if (nScriptCheckThreads) {
-       LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+       LogPrintf("Using %u threads for script and block verification\n", nScriptCheckThreads);
        for (int i=0; i<nScriptCheckThreads-1; i++)
+       {
           NewThread(ThreadScriptCheck, NULL);
+          NewThread(ThreadBlockCheck, NULL);
+       }
     }
+    LogPrintf("Using %s for signature verification\n", GetSignatureVerifier().GetName());
 
     int64_t nStart;
 
@@ -878,7 +910,7 @@ bool AppInit2()
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -998,6 +1030,10 @@ bool AppInit2()
     if (fServer)
         NewThread(ThreadRPCServer, NULL);
 
+#ifdef USE_LEVELDB
+    NewThread(ThreadBlockIndexSnapshot, NULL);
+#endif
+
     // ********************************************************* Step 12: finished
 
     uiInterface.InitMessage(_("Done loading"));
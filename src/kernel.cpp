@@ -5,6 +5,7 @@
 #include <boost/assign/list_of.hpp>
 
 #include "kernel.h"
+#include "kernelhash.h"
 #include "txdb.h"
 
 using namespace std;
@@ -225,6 +226,67 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     return true;
 }
 
+// Main chain blocks that generated a stake modifier, in chain order, each
+// together with the latest block time seen up to and including it.
+static CCriticalSection cs_stakemodifierindex;
+static vector<pair<const CBlockIndex*, int64_t> > vStakeModifierIndex;
+
+struct StakeModifierIndexHeightCompare
+{
+    bool operator()(int nHeight, const pair<const CBlockIndex*, int64_t>& entry) const
+    {
+        return nHeight < entry.first->nHeight;
+    }
+};
+
+struct StakeModifierIndexTimeCompare
+{
+    bool operator()(const pair<const CBlockIndex*, int64_t>& entry, int64_t nTime) const
+    {
+        return entry.second < nTime;
+    }
+};
+
+void UpdateStakeModifierIndex(const CBlockIndex* pindexNew, int nForkHeight)
+{
+    vector<const CBlockIndex*> vConnect;
+    for (const CBlockIndex* pindex = pindexNew; pindex && pindex->nHeight > nForkHeight; pindex = pindex->pprev)
+        if (pindex->GeneratedStakeModifier())
+            vConnect.push_back(pindex);
+
+    LOCK(cs_stakemodifierindex);
+    while (!vStakeModifierIndex.empty() && vStakeModifierIndex.back().first->nHeight > nForkHeight)
+        vStakeModifierIndex.pop_back();
+    BOOST_REVERSE_FOREACH(const CBlockIndex* pindex, vConnect)
+    {
+        int64_t nMaxTime = pindex->GetBlockTime();
+        if (!vStakeModifierIndex.empty())
+            nMaxTime = max(nMaxTime, vStakeModifierIndex.back().second);
+        vStakeModifierIndex.push_back(make_pair(pindex, nMaxTime));
+    }
+}
+
+// Find the first block after pindexFrom in the main chain that generated a
+// stake modifier at or after nTimeTarget
+static const CBlockIndex* FindStakeModifierBlock(const CBlockIndex* pindexFrom, int64_t nTimeTarget)
+{
+    LOCK(cs_stakemodifierindex);
+    vector<pair<const CBlockIndex*, int64_t> >::iterator it = upper_bound(vStakeModifierIndex.begin(), vStakeModifierIndex.end(), pindexFrom->nHeight, StakeModifierIndexHeightCompare());
+    if (it != vStakeModifierIndex.begin() && (it - 1)->second >= nTimeTarget)
+    {
+        // An earlier block already has a later timestamp, so the running
+        // maximum does not help; look at the blocks one by one
+        for (; it != vStakeModifierIndex.end(); ++it)
+            if (it->first->GetBlockTime() >= nTimeTarget)
+                return it->first;
+        return NULL;
+    }
+    // No block up to here reaches the target, so the first one that does is
+    // where the running maximum does
+    it = lower_bound(it, vStakeModifierIndex.end(), nTimeTarget, StakeModifierIndexTimeCompare());
+    return it != vStakeModifierIndex.end() ? it->first : NULL;
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
 static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
@@ -236,6 +298,22 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifi
     nStakeModifierHeight = pindexFrom->nHeight;
     nStakeModifierTime = pindexFrom->GetBlockTime();
     int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
+
+    // Look the modifier up in the index. Blocks off the main chain and coins
+    // too recent to have their modifier yet take the walk below, which
+    // reports why it fails.
+    if (pindexFrom->pnext)
+    {
+        const CBlockIndex* pindexModifier = FindStakeModifierBlock(pindexFrom, pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval);
+        if (pindexModifier)
+        {
+            nStakeModifierHeight = pindexModifier->nHeight;
+            nStakeModifierTime = pindexModifier->GetBlockTime();
+            nStakeModifier = pindexModifier->nStakeModifier;
+            return true;
+        }
+    }
+
     const CBlockIndex* pindex = pindexFrom;
     // loop to find the stake modifier later by a selection interval
     while (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval)
@@ -290,22 +368,20 @@ bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier)
 //   a proof-of-work situation.
 //
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+{
+    return CheckStakeKernelHash(nBits, blockFrom.GetHash(), blockFrom.GetBlockTime(), nTxPrevOffset, txPrev, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
+}
+
+bool CheckStakeKernelHash(unsigned int nBits, const uint256& hashBlockFrom, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
     if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
 
-    unsigned int nTimeBlockFrom = blockFrom.GetBlockTime();
     if (nTimeBlockFrom + GetStakeMinAge() > nTimeTx) // Min age requirement
         return error("CheckStakeKernelHash() : min age violation");
 
-    CBigNum bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
     int64_t nValueIn = txPrev.vout[prevout.n].nValue;
-
-    uint256 hashBlockFrom = blockFrom.GetHash();
-
-    CBigNum bnCoinDayWeight = CBigNum(nValueIn) * GetWeight((int64_t)txPrev.nTime, (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
-    targetProofOfStake = CBigNum(bnCoinDayWeight * bnTargetPerCoinDay).getuint256();
+    int64_t nTimeWeight = GetWeight((int64_t)txPrev.nTime, (int64_t)nTimeTx);
 
     // Calculate hash
     CDataStream ss(SER_GETHASH, 0);
@@ -325,7 +401,7 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
             nStakeModifier, nStakeModifierHeight,
             DateTimeStrFormat(nStakeModifierTime),
             mapBlockIndex[hashBlockFrom]->nHeight,
-            DateTimeStrFormat(blockFrom.GetBlockTime()));
+            DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : check protocol=%s modifier=0x%016x nTimeBlockFrom=%u nTxPrevOffset=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             "0.3",
             nStakeModifier,
@@ -334,7 +410,7 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     }
 
     // Now check if proof-of-stake hash meets target protocol
-    if (CBigNum(hashProofOfStake) > bnCoinDayWeight * bnTargetPerCoinDay)
+    if (!KernelHashMeetsTarget(nBits, nValueIn, nTimeWeight, hashProofOfStake, &targetProofOfStake))
         return false;
     if (fDebug && !fPrintProofOfStake)
     {
@@ -342,7 +418,7 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
             nStakeModifier, nStakeModifierHeight, 
             DateTimeStrFormat(nStakeModifierTime),
             mapBlockIndex[hashBlockFrom]->nHeight,
-            DateTimeStrFormat(blockFrom.GetBlockTime()));
+            DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : pass protocol=%s modifier=0x%016x nTimeBlockFrom=%u nTxPrevOffset=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             "0.3",
             nStakeModifier,
@@ -352,74 +428,113 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     return true;
 }
 
+// Check whether a kernel hash meets the target of an output of nValueIn
+// weighted by nTimeWeight: coin-day weight times the target per coin day.
+// A product past 256 bits is beyond any hash and passes, with the truncated
+// product as target. Negative inputs keep the CBigNum semantics.
+bool KernelHashMeetsTarget(unsigned int nBits, int64_t nValueIn, int64_t nTimeWeight, const uint256& hashProofOfStake, uint256* ptargetProofOfStake)
+{
+    bool fNegative, fOverflow;
+    uint256 nTargetPerCoinDay;
+    nTargetPerCoinDay.SetCompact(nBits, &fNegative, &fOverflow);
+    if (!fNegative && !fOverflow && nValueIn >= 0 && nTimeWeight >= 0)
+    {
+        uint256 nTarget = uint256((uint64_t)nValueIn) * uint256((uint64_t)nTimeWeight) / uint256((uint64_t)COIN) / uint256((uint64_t)(24 * 60 * 60));
+        bool fFits = nTarget.Multiply(nTargetPerCoinDay);
+        if (ptargetProofOfStake)
+            *ptargetProofOfStake = nTarget;
+        return !fFits || hashProofOfStake <= nTarget;
+    }
+
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    CBigNum bnTarget = CBigNum(nValueIn) * nTimeWeight / COIN / (24 * 60 * 60) * bnTargetPerCoinDay;
+    if (ptargetProofOfStake)
+        *ptargetProofOfStake = bnTarget.getuint256();
+    return CBigNum(hashProofOfStake) <= bnTarget;
+}
+
 // Scan given coins set for kernel solution
-bool ScanForStakeKernelHash(MetaMap &mapMeta, KernelSearchSettings &settings, CoinsSet::value_type &kernelcoin, unsigned int &nTimeTx, unsigned int &nBlockTime, CWallet* pwallet)
+bool ScanForStakeKernelHash(const std::vector<CStakeCandidate> &vCandidates, KernelSearchSettings &settings, CoinsSet::value_type &kernelcoin, unsigned int &nTimeTx, unsigned int &nBlockTime, const volatile bool* pfAbort, uint64_t* pnKernelsChecked)
 {
     uint256 hashProofOfStake = 0;
+    static int nMaxStakeSearchInterval = 60;
+    uint64_t nKernelsChecked = 0;
+
+    // Current timestamp scanning interval
+    unsigned int nCurrentSearchInterval = min((int64_t)settings.nSearchInterval, (int64_t)nMaxStakeSearchInterval);
 
-    // (txid, vout.n) => ((txindex, (tx, vout.n)), (block, modifier))
-    for(MetaMap::const_iterator meta_item = mapMeta.begin(); meta_item != mapMeta.end(); meta_item++)
+    // Scan the nLimit coins from nOffset
+    size_t nEnd = min((size_t)settings.nOffset + settings.nLimit, vCandidates.size());
+    for (size_t nCandidate = settings.nOffset; nCandidate < nEnd; nCandidate++)
     {
-        if (!pwallet->GetCoinsDataActual())
+        if (pfAbort && *pfAbort)
             break;
 
-        CTxIndex txindex = (*meta_item).second.first.first;
-        CBlock block = (*meta_item).second.second.first;
-        uint64_t nStakeModifier = (*meta_item).second.second.second;
-
-        // Get coin
-        CoinsSet::value_type pcoin = meta_item->second.first.second;
-
-        static int nMaxStakeSearchInterval = 60;
+        const CStakeCandidate& candidate = vCandidates[nCandidate];
 
         // only count coins meeting min age requirement
-        if (GetStakeMinAge() + block.nTime > settings.nTime - nMaxStakeSearchInterval)
+        if (GetStakeMinAge() + candidate.nBlockTime > settings.nTime - nMaxStakeSearchInterval)
             continue;
 
-        // Transaction offset inside block
-        unsigned int nTxOffset = txindex.pos.nTxPos - txindex.pos.nBlockPos;
+        nBlockTime = candidate.nBlockTime;
 
-        // Current timestamp scanning interval
-        unsigned int nCurrentSearchInterval = min((int64_t)settings.nSearchInterval, (int64_t)nMaxStakeSearchInterval);
-
-        nBlockTime = block.nTime;
-        CBigNum bnTargetPerCoinDay;
-        bnTargetPerCoinDay.SetCompact(settings.nBits);
-        int64_t nValueIn = pcoin.first->vout[pcoin.second].nValue;
+        // Everything in the kernel but the timestamp is fixed for this coin
+        CKernelHasher hasher(candidate.nStakeModifier, candidate.nBlockTime, candidate.nTxOffset, candidate.nTxTime, candidate.nOut);
 
         // Search backward in time from the given timestamp
         // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-        // Stopping search in case of shutting down or cache invalidation
-        for (unsigned int n=0; n<nCurrentSearchInterval && pwallet->GetCoinsDataActual() && !fShutdown; n++)
+        // Stopping search in case of shutting down or abort
+        for (unsigned int n=0; n<nCurrentSearchInterval && !(pfAbort && *pfAbort) && !fShutdown; n+=KERNEL_HASH_LANES)
         {
-            nTimeTx = settings.nTime - n;
-            CBigNum bnCoinDayWeight = CBigNum(nValueIn) * GetWeight((int64_t)pcoin.first->nTime, (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
-            CBigNum bnTargetProofOfStake = bnCoinDayWeight * bnTargetPerCoinDay;
-
-            // Build kernel
-            CDataStream ss(SER_GETHASH, 0);
-            ss << nStakeModifier;
-            ss << nBlockTime << nTxOffset << pcoin.first->nTime << pcoin.second << nTimeTx;
-
-            // Calculate kernel hash
-            hashProofOfStake = Hash(ss.begin(), ss.end());
-
-            if (bnTargetProofOfStake >= CBigNum(hashProofOfStake))
+            // Hash a batch of timestamps, then check them in search order
+            unsigned int pnTimeTx[KERNEL_HASH_LANES];
+            uint256 phashProofOfStake[KERNEL_HASH_LANES];
+            unsigned int nBatch = min(nCurrentSearchInterval - n, (unsigned int)KERNEL_HASH_LANES);
+            for (unsigned int i = 0; i < nBatch; i++)
+                pnTimeTx[i] = settings.nTime - (n + i);
+            hasher.GetHashes(pnTimeTx, nBatch, phashProofOfStake);
+            nKernelsChecked += nBatch;
+
+            for (unsigned int i = 0; i < nBatch; i++)
             {
-                LogPrint("coinstake", "nStakeModifier=0x%016x, nBlockTime=%u nTxOffset=%u nTxPrevTime=%u nVout=%u nTimeTx=%u hashProofOfStake=%s Success=true\n",
-                    nStakeModifier, nBlockTime, nTxOffset, pcoin.first->nTime, pcoin.second, nTimeTx, hashProofOfStake.GetHex().c_str());
-
-                kernelcoin = pcoin;
-                return true;
+                nTimeTx = pnTimeTx[i];
+                int64_t nTimeWeight = GetWeight((int64_t)candidate.nTxTime, (int64_t)nTimeTx);
+                hashProofOfStake = phashProofOfStake[i];
+
+                if (KernelHashMeetsTarget(settings.nBits, candidate.nValue, nTimeWeight, hashProofOfStake, NULL))
+                {
+                    LogPrint("coinstake", "nStakeModifier=0x%016x, nBlockTime=%u nTxOffset=%u nTxPrevTime=%u nVout=%u nTimeTx=%u hashProofOfStake=%s Success=true\n",
+                        candidate.nStakeModifier, nBlockTime, candidate.nTxOffset, candidate.nTxTime, candidate.nOut, nTimeTx, hashProofOfStake.GetHex().c_str());
+
+                    kernelcoin = candidate.GetCoin();
+                    if (pnKernelsChecked)
+                        *pnKernelsChecked += nKernelsChecked;
+                    return true;
+                }
+                //LogPrint("coinstakedeep", "n=%d,nStakeModifier=0x%016x, nBlockTime=%u nTxOffset=%u nTxPrevTime=%u nVout=%u nTimeTx=%u hashProofOfStake=%s Success=false\n",
+                //    n + i, candidate.nStakeModifier, nBlockTime, candidate.nTxOffset, candidate.nTxTime, candidate.nOut, nTimeTx, hashProofOfStake.GetHex().c_str());
             }
-            //LogPrint("coinstakedeep", "n=%d,nStakeModifier=0x%016x, nBlockTime=%u nTxOffset=%u nTxPrevTime=%u nVout=%u nTimeTx=%u hashProofOfStake=%s wallet=%s Success=false\n",
-            //    n, nStakeModifier, nBlockTime, nTxOffset, pcoin.first->nTime, pcoin.second, nTimeTx, hashProofOfStake.GetHex().c_str(),pwallet->strWalletFile.c_str());
         }
     }
 
+    if (pnKernelsChecked)
+        *pnKernelsChecked += nKernelsChecked;
     return false;
 }
 
+// How the blocks of staked outputs were found by CheckProofOfStake
+static CCriticalSection cs_stakecheckstats;
+static uint64_t nStakeCheckIndexed = 0;
+static uint64_t nStakeCheckHeaderReads = 0;
+
+void GetProofOfStakeCheckStats(uint64_t& nIndexed, uint64_t& nHeaderReads)
+{
+    LOCK(cs_stakecheckstats);
+    nIndexed = nStakeCheckIndexed;
+    nHeaderReads = nStakeCheckHeaderReads;
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake)
 {
@@ -442,12 +557,39 @@ bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hash
     if (!VerifySignature(txPrev, tx, 0, MANDATORY_SCRIPT_VERIFY_FLAGS, 0))
         return tx.DoS(100, error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString()));
 
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-        return fDebug? error("CheckProofOfStake() : read block failed") : false; // unable to read block of previous transaction
+    // The previous transaction is in the best chain, so its block is normally
+    // in the block index and neither needs its header read nor hashed
+    uint256 hashBlockFrom;
+    unsigned int nTimeBlockFrom = 0;
+    bool fIndexed = false;
+    {
+        LOCK(cs_main);
+        const CBlockIndex* pindexFrom = FindBlockByDiskPos(txindex.pos.nFile, txindex.pos.nBlockPos);
+        if (pindexFrom)
+        {
+            hashBlockFrom = pindexFrom->GetBlockHash();
+            nTimeBlockFrom = pindexFrom->nTime;
+            fIndexed = true;
+        }
+    }
+    if (!fIndexed)
+    {
+        // Read block header
+        CBlock block;
+        if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+            return fDebug? error("CheckProofOfStake() : read block failed") : false; // unable to read block of previous transaction
+        hashBlockFrom = block.GetHash();
+        nTimeBlockFrom = block.nTime;
+    }
+    {
+        LOCK(cs_stakecheckstats);
+        if (fIndexed)
+            nStakeCheckIndexed++;
+        else
+            nStakeCheckHeaderReads++;
+    }
 
-    if (!CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, txPrev, txin.prevout, tx.nTime, hashProofOfStake, targetProofOfStake, fDebug))
+    if (!CheckStakeKernelHash(nBits, hashBlockFrom, nTimeBlockFrom, txindex.pos.nTxPos - txindex.pos.nBlockPos, txPrev, txin.prevout, tx.nTime, hashProofOfStake, targetProofOfStake, fDebug))
         return tx.DoS(1, error("CheckProofOfStake() : INFO: check kernel failed on coinstake %s, hashProof=%s", tx.GetHash().ToString(), hashProofOfStake.ToString())); // may occur during initial download or if behind on block chain sync
 
     return true;
@@ -20,33 +20,45 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
 // modifier about a selection interval later than the coin generating the kernel
 bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier);
 
+// Keep the index of modifier generating main chain blocks used by
+// GetKernelStakeModifier in step with a new best chain that forks off the
+// previous one above nForkHeight
+void UpdateStakeModifierIndex(const CBlockIndex* pindexNew, int nForkHeight);
+
+// Check whether a kernel hash meets the target for an output of nValueIn
+// weighted by nTimeWeight; optionally returns the target
+bool KernelHashMeetsTarget(unsigned int nBits, int64_t nValueIn, int64_t nTimeWeight, const uint256& hashProofOfStake, uint256* ptargetProofOfStake);
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
+bool CheckStakeKernelHash(unsigned int nBits, const uint256& hashBlockFrom, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
 
 // Coins scanning options
 typedef struct KernelSearchSettings {
     unsigned int nBits;           // Packed difficulty
     unsigned int nTime;           // Basic time
-    unsigned int nOffset;         // Offset inside CoinsSet (isn't used yet)
-    unsigned int nLimit;          // Coins to scan (isn't used yet)
+    unsigned int nOffset;         // Offset inside CoinsSet
+    unsigned int nLimit;          // Coins to scan
     unsigned int nSearchInterval; // Number of seconds allowed to go into the past
 } KernelSearchSettings;
 
 typedef std::set<std::pair<const CWalletTx*,unsigned int> > CoinsSet;
 
-// Preloaded coins metadata
-// (txid, vout.n) => ((txindex, (tx, vout.n)), (block, modifier))
-typedef std::map<std::pair<uint256, unsigned int>, std::pair<std::pair<CTxIndex, std::pair<const CWalletTx*,unsigned int> >, std::pair<CBlock, uint64_t> > > MetaMap;
-
-// Scan given coins set for kernel solution
-bool ScanForStakeKernelHash(MetaMap &mapMeta, KernelSearchSettings &settings, CoinsSet::value_type &kernelcoin, unsigned int &nTimeTx, unsigned int &nBlockTime, CWallet* pwallet);
+// Scan given coins set for kernel solution, adding the number of kernel
+// hashes checked to *pnKernelsChecked if given. Gives up early once
+// *pfAbort is set, which another thread may do while it runs.
+bool ScanForStakeKernelHash(const std::vector<CStakeCandidate> &vCandidates, KernelSearchSettings &settings, CoinsSet::value_type &kernelcoin, unsigned int &nTimeTx, unsigned int &nBlockTime, const volatile bool* pfAbort = NULL, uint64_t* pnKernelsChecked = NULL);
 
 
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake);
 
+// Number of staked outputs CheckProofOfStake found the block of in the block
+// index, and the number it had to read the block header of from disk for
+void GetProofOfStakeCheckStats(uint64_t& nIndexed, uint64_t& nHeaderReads);
+
 // Check whether the coinstake timestamp meets protocol
 bool CheckCoinStakeTimestamp(int64_t nTimeBlock, int64_t nTimeTx);
 
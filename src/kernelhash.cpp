@@ -0,0 +1,188 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "kernelhash.h"
+#include "util.h"
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t SHA256_IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// The kernel is 28 bytes and nTimeTx is its seventh word
+static const int KERNEL_SIZE = 28;
+static const int KERNEL_TIMETX_WORD = 6;
+
+//
+// Word operations, once for a single uint32_t and once for four SSE2 lanes,
+// so the SHA-256 rounds below are written only once
+//
+
+static inline uint32_t Add(uint32_t a, uint32_t b) { return a + b; }
+static inline uint32_t Xor(uint32_t a, uint32_t b) { return a ^ b; }
+static inline uint32_t And(uint32_t a, uint32_t b) { return a & b; }
+static inline uint32_t Or(uint32_t a, uint32_t b) { return a | b; }
+template<int n> static inline uint32_t Shr(uint32_t x) { return x >> n; }
+template<int n> static inline uint32_t Ror(uint32_t x) { return (x >> n) | (x << (32 - n)); }
+static inline void Set(uint32_t& v, uint32_t x) { v = x; }
+
+#if defined(__SSE2__)
+static inline __m128i Add(__m128i a, __m128i b) { return _mm_add_epi32(a, b); }
+static inline __m128i Xor(__m128i a, __m128i b) { return _mm_xor_si128(a, b); }
+static inline __m128i And(__m128i a, __m128i b) { return _mm_and_si128(a, b); }
+static inline __m128i Or(__m128i a, __m128i b) { return _mm_or_si128(a, b); }
+template<int n> static inline __m128i Shr(__m128i x) { return _mm_srli_epi32(x, n); }
+template<int n> static inline __m128i Ror(__m128i x) { return _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n)); }
+static inline void Set(__m128i& v, uint32_t x) { v = _mm_set1_epi32((int)x); }
+#endif
+
+template<typename V> static inline V Sigma0(V x) { return Xor(Xor(Ror<2>(x), Ror<13>(x)), Ror<22>(x)); }
+template<typename V> static inline V Sigma1(V x) { return Xor(Xor(Ror<6>(x), Ror<11>(x)), Ror<25>(x)); }
+template<typename V> static inline V sigma0(V x) { return Xor(Xor(Ror<7>(x), Ror<18>(x)), Shr<3>(x)); }
+template<typename V> static inline V sigma1(V x) { return Xor(Xor(Ror<17>(x), Ror<19>(x)), Shr<10>(x)); }
+template<typename V> static inline V Ch(V e, V f, V g) { return Xor(g, And(e, Xor(f, g))); }
+template<typename V> static inline V Maj(V a, V b, V c) { return Or(And(a, b), And(c, Or(a, b))); }
+
+// Extends the 16 words of a message block to the 64-word schedule
+template<typename V> static void Expand(V* w)
+{
+    for (int i = 16; i < 64; i++)
+        w[i] = Add(Add(sigma1(w[i-2]), w[i-7]), Add(sigma0(w[i-15]), w[i-16]));
+}
+
+// Runs compression rounds nBegin up to nEnd on the working state s
+template<typename V> static void Rounds(V* s, const V* w, int nBegin, int nEnd)
+{
+    V a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = nBegin; i < nEnd; i++)
+    {
+        V k;
+        Set(k, SHA256_K[i]);
+        V t1 = Add(Add(Add(h, Sigma1(e)), Add(Ch(e, f, g), k)), w[i]);
+        V t2 = Add(Sigma0(a), Maj(a, b, c));
+        h = g;
+        g = f;
+        f = e;
+        e = Add(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = Add(t1, t2);
+    }
+    s[0] = a; s[1] = b; s[2] = c; s[3] = d; s[4] = e; s[5] = f; s[6] = g; s[7] = h;
+}
+
+// Double SHA-256 of the kernel block w, continuing from the midstate.
+// Writes the digest words of the second hash to pOut.
+template<typename V> static void KernelDoubleHash(const uint32_t* pnMidstate, V* w, V* pOut)
+{
+    V s[8], iv[8];
+    for (int i = 0; i < 8; i++)
+    {
+        Set(s[i], pnMidstate[i]);
+        Set(iv[i], SHA256_IV[i]);
+    }
+    Expand(w);
+    Rounds(s, w, KERNEL_TIMETX_WORD, 64);
+
+    // The second hash is over the 32-byte digest of the first
+    V w2[64];
+    for (int i = 0; i < 8; i++)
+    {
+        w2[i] = Add(s[i], iv[i]);
+        s[i] = iv[i];
+    }
+    Set(w2[8], 0x80000000);
+    for (int i = 9; i < 15; i++)
+        Set(w2[i], 0);
+    Set(w2[15], 256);
+    Expand(w2);
+    Rounds(s, w2, 0, 64);
+
+    for (int i = 0; i < 8; i++)
+        pOut[i] = Add(s[i], iv[i]);
+}
+
+// Lays out digest words the way Hash() returns them
+static inline void WriteDigest(uint256& hash, const uint32_t* pnDigest, unsigned int nStride)
+{
+    unsigned char* p = hash.begin();
+    for (int i = 0; i < 8; i++)
+    {
+        uint32_t n = ByteReverse(pnDigest[i * nStride]);
+        memcpy(p + 4 * i, &n, 4);
+    }
+}
+
+CKernelHasher::CKernelHasher(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset, unsigned int nTimeTxPrev, unsigned int nPrevout)
+{
+    // Serialized little-endian fields read as big-endian SHA-256 words
+    pnWord[0] = ByteReverse((uint32_t)nStakeModifier);
+    pnWord[1] = ByteReverse((uint32_t)(nStakeModifier >> 32));
+    pnWord[2] = ByteReverse(nTimeBlockFrom);
+    pnWord[3] = ByteReverse(nTxPrevOffset);
+    pnWord[4] = ByteReverse(nTimeTxPrev);
+    pnWord[5] = ByteReverse(nPrevout);
+    pnWord[KERNEL_TIMETX_WORD] = 0;
+    pnWord[7] = 0x80000000;
+    for (int i = 8; i < 15; i++)
+        pnWord[i] = 0;
+    pnWord[15] = KERNEL_SIZE * 8;
+
+    for (int i = 0; i < 8; i++)
+        pnMidstate[i] = SHA256_IV[i];
+    Rounds(pnMidstate, pnWord, 0, KERNEL_TIMETX_WORD);
+}
+
+uint256 CKernelHasher::GetHash(unsigned int nTimeTx) const
+{
+    uint32_t w[64], pnDigest[8];
+    memcpy(w, pnWord, sizeof(pnWord));
+    w[KERNEL_TIMETX_WORD] = ByteReverse(nTimeTx);
+    KernelDoubleHash(pnMidstate, w, pnDigest);
+
+    uint256 hash;
+    WriteDigest(hash, pnDigest, 1);
+    return hash;
+}
+
+void CKernelHasher::GetHashes(const unsigned int* pnTimeTx, unsigned int nCount, uint256* phashProofOfStake) const
+{
+    unsigned int i = 0;
+#if defined(__SSE2__)
+    for (; i + KERNEL_HASH_LANES <= nCount; i += KERNEL_HASH_LANES)
+    {
+        __m128i w[64], pDigest[8];
+        for (int j = 0; j < 16; j++)
+            Set(w[j], pnWord[j]);
+        w[KERNEL_TIMETX_WORD] = _mm_set_epi32((int)ByteReverse(pnTimeTx[i+3]), (int)ByteReverse(pnTimeTx[i+2]),
+                                              (int)ByteReverse(pnTimeTx[i+1]), (int)ByteReverse(pnTimeTx[i]));
+        KernelDoubleHash(pnMidstate, w, pDigest);
+
+        uint32_t pnDigest[8][KERNEL_HASH_LANES];
+        for (int j = 0; j < 8; j++)
+            _mm_storeu_si128((__m128i*)pnDigest[j], pDigest[j]);
+        for (unsigned int nLane = 0; nLane < KERNEL_HASH_LANES; nLane++)
+            WriteDigest(phashProofOfStake[i + nLane], &pnDigest[0][nLane], KERNEL_HASH_LANES);
+    }
+#endif
+    for (; i < nCount; i++)
+        phashProofOfStake[i] = GetHash(pnTimeTx[i]);
+}
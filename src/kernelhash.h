@@ -0,0 +1,36 @@
+#ifndef KERNELHASH_H
+#define KERNELHASH_H
+
+#include <stdint.h>
+
+#include "uint256.h"
+
+// Number of timestamps hashed side by side by CKernelHasher::GetHashes
+static const unsigned int KERNEL_HASH_LANES = 4;
+
+/** Kernel hash search state for one staking output.
+ *
+ * The kernel hashed by CheckStakeKernelHash is nStakeModifier,
+ * nTimeBlockFrom, nTxPrevOffset, nTimeTxPrev, nPrevout and nTimeTx: 28
+ * bytes that fit a single SHA-256 block, of which only the last word
+ * changes while searching timestamps. The rounds that only see the constant
+ * words are done once here, and GetHashes runs the rest for several
+ * timestamps at once on SSE2 lanes where the compiler targets them.
+ */
+class CKernelHasher
+{
+public:
+    CKernelHasher(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset, unsigned int nTimeTxPrev, unsigned int nPrevout);
+
+    // Same as Hash() of the serialized kernel
+    uint256 GetHash(unsigned int nTimeTx) const;
+
+    // Fills phashProofOfStake[i] with the kernel hash for pnTimeTx[i]
+    void GetHashes(const unsigned int* pnTimeTx, unsigned int nCount, uint256* phashProofOfStake) const;
+
+private:
+    uint32_t pnWord[16];    // first message block, big-endian words
+    uint32_t pnMidstate[8]; // state after the rounds on constant words
+};
+
+#endif // KERNELHASH_H
@@ -12,9 +12,12 @@
 #include "ui_interface.h"
 #include "checkqueue.h"
 #include "kernel.h"
+#include "miner.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/alignment_of.hpp>
 
 using namespace std;
 using namespace boost;
@@ -29,18 +32,23 @@ set<CWallet*> setpwalletRegistered;
 CCriticalSection cs_main;
 
 CTxMemPool mempool;
+CCoinAgeCache coinAgeCache;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 uint256 hashGenesisBlock = hashGenesisBlockOfficial;
 static CBigNum bnProofOfWorkLimit(~uint256(0) >> 20);
 static CBigNum bnProofOfStakeLimit(~uint256(0) >> 24);
-static CBigNum bnProofOfStakeHardLimit(~uint256(0) >> 30);
 
 static CBigNum bnProofOfWorkLimitTestNet(~uint256(0) >> 16);
 static CBigNum bnProofOfStakeLimitTestNet(~uint256(0) >> 20);
 
+// The same limits as plain 256-bit integers for the retarget and trust code
+static uint256 nProofOfWorkLimit(~uint256(0) >> 20);
+static uint256 nProofOfStakeLimit(~uint256(0) >> 24);
+static uint256 nProofOfStakeHardLimit(~uint256(0) >> 30);
+
 unsigned int nStakeMaxAge = 60 * 60 * 24 * 30; // stake age of full weight - 30 days
 
 int64_t nChainStartTime = 1371910049;
@@ -639,7 +647,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     vMerkleBranch = pblock->GetMerkleBranch(nIndex);
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -878,6 +886,7 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
     LOCK(cs);
     {
         mapTx[hash] = tx;
+        mapTx[hash].MemoizeHash();
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
         nTransactionsUpdated++;
@@ -922,6 +931,89 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 }
 
 
+void CCoinAgeCache::SetMaxSize(unsigned int nMaxSizeIn)
+{
+    LOCK(cs);
+    nMaxSize = nMaxSizeIn;
+    if (nMaxSize == 0)
+    {
+        mapEntries.clear();
+        queueAdded.clear();
+    }
+}
+
+bool CCoinAgeCache::Get(const COutPoint& outpoint, CCoinAgeEntry& entry)
+{
+    LOCK(cs);
+    map<COutPoint, CCoinAgeEntry>::const_iterator mi = mapEntries.find(outpoint);
+    if (mi == mapEntries.end())
+    {
+        nMisses++;
+        return false;
+    }
+    nHits++;
+    entry = mi->second;
+    return true;
+}
+
+// Called once the block is committed as the new best block
+void CCoinAgeCache::ConnectBlock(const CBlock& block)
+{
+    LOCK(cs);
+    if (nMaxSize == 0)
+        return;
+
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        if (!tx.IsCoinBase())
+        {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                mapEntries.erase(txin.prevout);
+        }
+
+        uint256 hash = tx.GetHash();
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            // Coinstake markers and other empty outputs never stake
+            if (tx.vout[i].IsEmpty())
+                continue;
+            COutPoint outpoint(hash, i);
+            mapEntries[outpoint] = CCoinAgeEntry(tx.vout[i].nValue, tx.nTime, block.GetBlockTime());
+            queueAdded.push_back(outpoint);
+        }
+    }
+
+    // Drop the oldest outputs, and the spent ones still queued once they
+    // outnumber the cached ones
+    while (mapEntries.size() > nMaxSize && !queueAdded.empty())
+    {
+        mapEntries.erase(queueAdded.front());
+        queueAdded.pop_front();
+    }
+    if (queueAdded.size() > 2 * mapEntries.size() + 1000)
+    {
+        deque<COutPoint> queueCached;
+        BOOST_FOREACH(const COutPoint& outpoint, queueAdded)
+            if (mapEntries.count(outpoint))
+                queueCached.push_back(outpoint);
+        queueAdded.swap(queueCached);
+    }
+}
+
+// Called as the block is disconnected, before that is committed. Outputs
+// the block spent are left to be read from disk again.
+void CCoinAgeCache::DisconnectBlock(const CBlock& block)
+{
+    LOCK(cs);
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        uint256 hash = tx.GetHash();
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+            mapEntries.erase(COutPoint(hash, i));
+    }
+}
+
+
 
 
 int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
@@ -931,7 +1023,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1005,7 +1097,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1048,22 +1140,129 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
-CBlockIndex* FindBlockByHeight(int nHeight)
+static const size_t BLOCKINDEX_SLAB_ENTRIES = 4096;
+static const size_t BLOCKINDEX_SLAB_ALIGN = 64;
+// Slots are packed with no padding beyond what CBlockIndex itself needs
+static const size_t BLOCKINDEX_SLOT_ALIGN = boost::alignment_of<CBlockIndex>::value;
+static const size_t BLOCKINDEX_SLOT_SIZE = (sizeof(CBlockIndex) + BLOCKINDEX_SLOT_ALIGN - 1) / BLOCKINDEX_SLOT_ALIGN * BLOCKINDEX_SLOT_ALIGN;
+BOOST_STATIC_ASSERT(BLOCKINDEX_SLAB_ALIGN % BLOCKINDEX_SLOT_ALIGN == 0 && BLOCKINDEX_SLOT_SIZE >= sizeof(void*));
+
+static boost::mutex mutexBlockIndexArena;
+static std::vector<char*> vBlockIndexSlab;
+static char* pBlockIndexSlabNext = NULL;
+static char* pBlockIndexSlabEnd = NULL;
+static void* pBlockIndexFreeList = NULL;
+static size_t nBlockIndexEntries = 0;
+
+void* CBlockIndexArena::Allocate(size_t nSize)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
+    // Derived classes are not arena allocated
+    if (nSize != sizeof(CBlockIndex))
+        return ::operator new(nSize);
+
+    boost::mutex::scoped_lock lock(mutexBlockIndexArena);
+    void* p;
+    if (pBlockIndexFreeList)
+    {
+        p = pBlockIndexFreeList;
+        pBlockIndexFreeList = *(void**)p;
+    }
     else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    {
+        if (pBlockIndexSlabNext == pBlockIndexSlabEnd)
+        {
+            char* pslab = (char*)malloc(BLOCKINDEX_SLAB_ENTRIES * BLOCKINDEX_SLOT_SIZE + BLOCKINDEX_SLAB_ALIGN);
+            if (!pslab)
+                throw std::bad_alloc();
+            vBlockIndexSlab.push_back(pslab);
+            pBlockIndexSlabNext = pslab + (BLOCKINDEX_SLAB_ALIGN - (size_t)pslab % BLOCKINDEX_SLAB_ALIGN);
+            pBlockIndexSlabEnd = pBlockIndexSlabNext + BLOCKINDEX_SLAB_ENTRIES * BLOCKINDEX_SLOT_SIZE;
+        }
+        p = pBlockIndexSlabNext;
+        pBlockIndexSlabNext += BLOCKINDEX_SLOT_SIZE;
+    }
+    assert((size_t)p % BLOCKINDEX_SLOT_ALIGN == 0);
+    nBlockIndexEntries++;
+    return p;
+}
+
+void CBlockIndexArena::Free(void* p, size_t nSize)
+{
+    if (p == NULL)
+        return;
+    if (nSize != sizeof(CBlockIndex))
+    {
+        ::operator delete(p);
+        return;
+    }
+
+    boost::mutex::scoped_lock lock(mutexBlockIndexArena);
+    *(void**)p = pBlockIndexFreeList;
+    pBlockIndexFreeList = p;
+    nBlockIndexEntries--;
+}
+
+void CBlockIndexArena::GetStats(size_t& nEntries, size_t& nSlots, size_t& nSlabBytes)
+{
+    boost::mutex::scoped_lock lock(mutexBlockIndexArena);
+    nEntries = nBlockIndexEntries;
+    nSlots = vBlockIndexSlab.size() * BLOCKINDEX_SLAB_ENTRIES;
+    nSlabBytes = vBlockIndexSlab.size() * (BLOCKINDEX_SLAB_ENTRIES * BLOCKINDEX_SLOT_SIZE + BLOCKINDEX_SLAB_ALIGN);
+}
+
+BlockHasher::BlockHasher()
+{
+    // One salt per process, so that every copy of the hasher agrees
+    static const uint64_t nSalt[2] = { GetRand(std::numeric_limits<uint64_t>::max()), GetRand(std::numeric_limits<uint64_t>::max()) };
+    nSalt0 = nSalt[0];
+    nSalt1 = nSalt[1];
+}
+
+// The blocks of the best chain indexed by height
+static std::vector<CBlockIndex*> vActiveChain;
+
+void UpdateActiveChain(CBlockIndex* pindexNew)
+{
+    if (pindexNew == NULL)
+    {
+        vActiveChain.clear();
+        UpdateStakeModifierIndex(NULL, -1);
+        return;
+    }
+    // Only the part above the fork with the previous best chain changes
+    vActiveChain.resize(pindexNew->nHeight + 1);
+    CBlockIndex* pindexFork = pindexNew;
+    while (pindexFork && vActiveChain[pindexFork->nHeight] != pindexFork)
+    {
+        vActiveChain[pindexFork->nHeight] = pindexFork;
+        pindexFork = pindexFork->pprev;
+    }
+    UpdateStakeModifierIndex(pindexNew, pindexFork ? pindexFork->nHeight : -1);
+}
+
+CBlockIndex* FindBlockByHeight(int nHeight)
+{
+    if (nHeight < 0 || nHeight >= (int)vActiveChain.size())
+        return NULL;
+    return vActiveChain[nHeight];
+}
+
+struct BlockDiskPosCompare
+{
+    bool operator()(const CBlockIndex* pindex, const std::pair<unsigned int, unsigned int>& pos) const
+    {
+        return std::make_pair(pindex->nFile, pindex->nBlockPos) < pos;
+    }
+};
+
+// A block is only written to disk after its parent, so along the best chain
+// the disk positions grow with the height
+CBlockIndex* FindBlockByDiskPos(unsigned int nFile, unsigned int nBlockPos)
+{
+    std::vector<CBlockIndex*>::const_iterator it = std::lower_bound(vActiveChain.begin(), vActiveChain.end(), std::make_pair(nFile, nBlockPos), BlockDiskPosCompare());
+    if (it == vActiveChain.end() || (*it)->nFile != nFile || (*it)->nBlockPos != nBlockPos)
+        return NULL;
+    return *it;
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -1075,6 +1274,7 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
     }
     if (!ReadFromDisk(pindex->nFile, pindex->nBlockPos, fReadTransactions))
         return false;
+    MemoizeHash();
     if (GetHash() != pindex->GetBlockHash())
         return error("CBlock::ReadFromDisk() : GetHash() doesn't match index");
     return true;
@@ -1364,67 +1564,89 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
         return GetNextTargetRequiredV1(pindexLast, fProofOfStake);
 }
 
+// Scales the compact target nBits by nMultiplier / nDivisor and caps it at
+// nTargetLimit. Targets of a valid chain stay well inside 256 bits, so this
+// is done with plain 256-bit integers; negative or overflowing values keep
+// the CBigNum semantics the retarget rules were written against.
+static unsigned int ScaleTarget(unsigned int nBits, int64_t nMultiplier, int64_t nDivisor, const uint256& nTargetLimit)
+{
+    bool fNegative, fOverflow;
+    uint256 nNew;
+    nNew.SetCompact(nBits, &fNegative, &fOverflow);
+    if (!fNegative && !fOverflow && nMultiplier >= 0 && nDivisor > 0 &&
+        nNew.Multiply(uint256((uint64_t)nMultiplier)))
+    {
+        nNew /= uint256((uint64_t)nDivisor);
+        if (nNew > nTargetLimit)
+            nNew = nTargetLimit;
+        return nNew.GetCompact();
+    }
+
+    CBigNum bnNew;
+    bnNew.SetCompact(nBits);
+    bnNew *= nMultiplier;
+    bnNew /= nDivisor;
+    if (bnNew > CBigNum(nTargetLimit))
+        bnNew = CBigNum(nTargetLimit);
+    return bnNew.GetCompact();
+}
+
 unsigned int GetNextTargetRequiredV1(const CBlockIndex* pindexLast, bool fProofOfStake)
 {
-  CBigNum bnTargetLimit = !fProofOfStake ? bnProofOfWorkLimit : bnProofOfStakeLimit;
+  uint256 nTargetLimit = !fProofOfStake ? nProofOfWorkLimit : nProofOfStakeLimit;
   int64_t nTargetSpacingWorkMax = 12 * GetTargetSpacing(); // 2-hour
 
     if(fProofOfStake)
     {
         // Proof-of-Stake blocks has own target limit since nVersion=3 supermajority on mainNet and always on testNet
         if(fTestNet)
-            bnTargetLimit = bnProofOfStakeLimit;
+            nTargetLimit = nProofOfStakeLimit;
         else
         {
             if(pindexLast->nHeight + 1 > 15000)
-                bnTargetLimit = bnProofOfStakeLimit;
+                nTargetLimit = nProofOfStakeLimit;
             else if(pindexLast->nHeight + 1 > 14060)
-                bnTargetLimit = bnProofOfStakeHardLimit;
+                nTargetLimit = nProofOfStakeHardLimit;
         }
     }
 
     if (pindexLast == NULL)
-        return bnTargetLimit.GetCompact(); // genesis block
+        return nTargetLimit.GetCompact(); // genesis block
 
     const CBlockIndex* pindexPrev = GetLastBlockIndex(pindexLast, fProofOfStake);
     if (pindexPrev->pprev == NULL)
-        return bnTargetLimit.GetCompact(); // first block
+        return nTargetLimit.GetCompact(); // first block
     const CBlockIndex* pindexPrevPrev = GetLastBlockIndex(pindexPrev->pprev, fProofOfStake);
     if (pindexPrevPrev->pprev == NULL)
-        return bnTargetLimit.GetCompact(); // second block
+        return nTargetLimit.GetCompact(); // second block
 
     int64_t nActualSpacing = pindexPrev->GetBlockTime() - pindexPrevPrev->GetBlockTime();
 
     // ppcoin: target change every block
     // ppcoin: retarget with exponential moving toward target spacing
-    CBigNum bnNew;
-    bnNew.SetCompact(pindexPrev->nBits);
     unsigned int nTargetStakeSpacing = GetTargetSpacing();
     int64_t nTargetSpacing = fProofOfStake ? nTargetStakeSpacing : min(nTargetSpacingWorkMax, (int64_t) nTargetStakeSpacing * (1 + pindexLast->nHeight - pindexPrev->nHeight));
     int64_t nInterval = nTargetTimespan / nTargetSpacing;
-    bnNew *= ((nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing);
-    bnNew /= ((nInterval + 1) * nTargetSpacing);
-
-    if (bnNew > bnTargetLimit)
-        bnNew = bnTargetLimit;
-
-    return bnNew.GetCompact();
+    return ScaleTarget(pindexPrev->nBits,
+                       (nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing,
+                       (nInterval + 1) * nTargetSpacing,
+                       nTargetLimit);
 }
 
 unsigned int GetNextTargetRequiredV2(const CBlockIndex* pindexLast, bool fProofOfStake)
 {
-    CBigNum bnTargetLimit = !fProofOfStake ? bnProofOfWorkLimit : bnProofOfStakeLimit;
+    uint256 nTargetLimit = !fProofOfStake ? nProofOfWorkLimit : nProofOfStakeLimit;
     int64_t nTargetSpacingWorkMax = 12 * GetTargetSpacing(); // 2-hour
 
     if (pindexLast == NULL)
-        return bnTargetLimit.GetCompact(); // genesis block
+        return nTargetLimit.GetCompact(); // genesis block
 
     const CBlockIndex* pindexPrev = GetLastBlockIndex(pindexLast, fProofOfStake);
     if (pindexPrev->pprev == NULL)
-        return bnTargetLimit.GetCompact(); // first block
+        return nTargetLimit.GetCompact(); // first block
     const CBlockIndex* pindexPrevPrev = GetLastBlockIndex(pindexPrev->pprev, fProofOfStake);
     if (pindexPrevPrev->pprev == NULL)
-        return bnTargetLimit.GetCompact(); // second block
+        return nTargetLimit.GetCompact(); // second block
 
     unsigned int nTargetStakeSpacing = GetTargetSpacing();
     int64_t nActualSpacing = pindexPrev->GetBlockTime() - pindexPrevPrev->GetBlockTime();
@@ -1433,17 +1655,11 @@ unsigned int GetNextTargetRequiredV2(const CBlockIndex* pindexLast, bool fProofO
     if (nActualSpacing < 0)
         nActualSpacing = nTargetSpacing;
 
-    CBigNum bnNew;
-    bnNew.SetCompact(pindexPrev->nBits);
-
     int64_t nInterval = nTargetTimespan / nTargetSpacing;
-    bnNew *= ((nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing);
-    bnNew /= ((nInterval + 1) * nTargetSpacing);
-
-    if (bnNew > bnTargetLimit)
-        bnNew = bnTargetLimit;
-
-    return bnNew.GetCompact();
+    return ScaleTarget(pindexPrev->nBits,
+                       (nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing,
+                       (nInterval + 1) * nTargetSpacing,
+                       nTargetLimit);
 }
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
@@ -1679,7 +1895,7 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
 
 bool CScriptCheck::operator()() const {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, psighashcache.get()))
         return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().substr(0,10).c_str());
     return true;
 }
@@ -1731,6 +1947,12 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
         if (pvChecks)
            pvChecks->reserve(vin.size());
 
+        // Inputs signed with SIGHASH_ALL hash most of the transaction alike,
+        // so that part is worked out once for all of them
+        boost::shared_ptr<const CSignatureHashCache> psighashcache;
+        if (fScriptChecks && vin.size() > 1)
+            psighashcache.reset(new CSignatureHashCache(*this));
+
         // The first loop above does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
@@ -1756,7 +1978,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             if (fScriptChecks)
             {
                 // Verify signature
-                CScriptCheck check(txPrev, *this, i, flags, 0);
+                CScriptCheck check(txPrev, *this, i, flags, 0, psighashcache);
                 if (pvChecks)
                 {
                     pvChecks->push_back(CScriptCheck());
@@ -1767,7 +1989,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
                     if (flags & STRICT_FLAGS)
                     {
                         // Don't trigger DoS code in case of STRICT_FLAGS caused failure.
-                        CScriptCheck check(txPrev, *this, i, flags & ~STRICT_FLAGS, 0);
+                        CScriptCheck check(txPrev, *this, i, flags & ~STRICT_FLAGS, 0, psighashcache);
                         if (check())
                            return error("ConnectInputs() : %s strict VerifySignature failed", GetHash().ToString().substr(0,10).c_str());
                     }
@@ -1837,6 +2059,9 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
             return error("DisconnectBlock() : WriteBlockIndex failed");
     }
 
+    // Outputs of the block are out of the main chain from here on
+    coinAgeCache.DisconnectBlock(*this);
+
     // ppcoin: clean up wallet after disconnecting coinstake
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this, false, false);
@@ -1857,6 +2082,129 @@ void ThreadScriptCheckQuit() {
     scriptcheckqueue.Quit();
 }
 
+static CCriticalSection cs_blockcheckstats;
+static uint64_t nBlockCheckCount = 0;
+
+uint64_t GetBlockCheckCount()
+{
+    LOCK(cs_blockcheckstats);
+    return nBlockCheckCount;
+}
+
+// The context free checks of a block waiting to be connected. The outcome
+// is left in the block, so one bad block does not hold up the others.
+static void CheckBlockAhead(const CBlock& block)
+{
+    block.MemoizeHashes();
+    if (block.CheckBlock())
+        block.fChecked = true;
+    else
+    {
+        // Scored when ProcessBlock checks it again, which adds the score
+        // of a bad transaction to the block's once more
+        block.nDoS = 0;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            tx.nDoS = 0;
+    }
+
+    LOCK(cs_blockcheckstats);
+    nBlockCheckCount++;
+}
+
+// Blocks waiting for a block check thread, oldest first. A block whose
+// checks were taken up by the thread connecting it is skipped.
+static boost::mutex mutexBlockCheck;
+static boost::condition_variable condBlockCheckQueued;
+static boost::condition_variable condBlockCheckDone;
+static std::deque<boost::shared_ptr<CBlockPrecheck> > queueBlockCheck;
+static int nBlockCheckThreads = 0;
+static bool fBlockCheckQuit = false;
+
+void QueueBlockChecks(const std::vector<boost::shared_ptr<CBlockPrecheck> >& vChecks)
+{
+    boost::unique_lock<boost::mutex> lock(mutexBlockCheck);
+    // Without threads FinishBlockCheck runs every check itself
+    if (nBlockCheckThreads == 0)
+        return;
+    BOOST_FOREACH(const boost::shared_ptr<CBlockPrecheck>& pcheck, vChecks)
+        queueBlockCheck.push_back(pcheck);
+    condBlockCheckQueued.notify_all();
+}
+
+void FinishBlockCheck(CBlockPrecheck& check)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexBlockCheck);
+        while (check.nState == CBlockPrecheck::RUNNING)
+            condBlockCheckDone.wait(lock);
+        if (check.nState == CBlockPrecheck::DONE)
+            return;
+        check.nState = CBlockPrecheck::RUNNING;
+    }
+    CheckBlockAhead(check.block);
+
+    boost::unique_lock<boost::mutex> lock(mutexBlockCheck);
+    check.nState = CBlockPrecheck::DONE;
+    condBlockCheckDone.notify_all();
+}
+
+// Leave a block to be checked by ProcessBlock alone, if its checks have
+// not been started yet
+static void DropBlockCheck(CBlockPrecheck& check)
+{
+    boost::unique_lock<boost::mutex> lock(mutexBlockCheck);
+    if (check.nState == CBlockPrecheck::QUEUED)
+        check.nState = CBlockPrecheck::DONE;
+}
+
+void ThreadBlockCheck(void*) {
+    vnThreadsRunning[THREAD_BLOCKCHECK]++;
+    RenameThread("hobocoin-blockch");
+    {
+        boost::unique_lock<boost::mutex> lock(mutexBlockCheck);
+        nBlockCheckThreads++;
+        while (true)
+        {
+            while (queueBlockCheck.empty() && !fBlockCheckQuit)
+                condBlockCheckQueued.wait(lock);
+            if (fBlockCheckQuit)
+                break;
+
+            boost::shared_ptr<CBlockPrecheck> pcheck = queueBlockCheck.front();
+            queueBlockCheck.pop_front();
+            if (pcheck->nState != CBlockPrecheck::QUEUED)
+                continue;
+            pcheck->nState = CBlockPrecheck::RUNNING;
+
+            lock.unlock();
+            CheckBlockAhead(pcheck->block);
+            lock.lock();
+
+            pcheck->nState = CBlockPrecheck::DONE;
+            condBlockCheckDone.notify_all();
+        }
+        // Checks still queued are run by whoever connects their blocks
+        if (--nBlockCheckThreads == 0)
+        {
+            queueBlockCheck.clear();
+            fBlockCheckQuit = false;
+        }
+        condBlockCheckDone.notify_all();
+    }
+    vnThreadsRunning[THREAD_BLOCKCHECK]--;
+}
+
+// Returns once every block check thread has exited
+void ThreadBlockCheckQuit() {
+    boost::unique_lock<boost::mutex> lock(mutexBlockCheck);
+    if (nBlockCheckThreads == 0)
+        return;
+    fBlockCheckQuit = true;
+    condBlockCheckQueued.notify_all();
+    while (nBlockCheckThreads > 0)
+        condBlockCheckDone.wait(lock);
+}
+
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
     // Check it again in case a previous version let a bad block in, but skip BlockSig checking
@@ -2026,6 +2374,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         CBlock block;
         if (!block.ReadFromDisk(pindex))
             return error("Reorganize() : ReadFromDisk for disconnect failed");
+        block.MemoizeHashes();
         if (!block.DisconnectBlock(txdb, pindex))
             return error("Reorganize() : DisconnectBlock %s failed", pindex->GetBlockHash().ToString().substr(0,20));
 
@@ -2045,6 +2394,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         CBlock block;
         if (!block.ReadFromDisk(pindex))
             return error("Reorganize() : ReadFromDisk for connect failed");
+        block.MemoizeHashes();
         if (!block.ConnectBlock(txdb, pindex))
         {
             // Invalid block
@@ -2103,6 +2453,7 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
+    coinAgeCache.ConnectBlock(*this);
 
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
@@ -2187,12 +2538,16 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    UpdateActiveChain(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
 
+    // Stake on the new best block without waiting for the next second
+    if (!fIsInitialDownload)
+        WakeStakeMiner();
+
     uint256 nBestBlockTrust = pindexBest->nHeight != 0 ? (pindexBest->nChainTrust - pindexBest->pprev->nChainTrust) : pindexBest->nChainTrust;
     LogPrintf("SetBestChain: new best=%s height=%d trust=%s blocktrust=%d date=%s\n",
         hashBestChain.ToString().substr(0,20),
@@ -2238,7 +2593,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 // age (trust score) of competing branches.
 bool CTransaction::GetCoinAge(CTxDB& txdb, uint64_t& nCoinAge) const
 {
-    CBigNum bnCentSecond = 0;  // coin age in the unit of cent-seconds
+    uint256 bnCentSecond = 0;  // coin age in the unit of cent-seconds
     nCoinAge = 0;
 
     if (IsCoinBase())
@@ -2246,30 +2601,39 @@ bool CTransaction::GetCoinAge(CTxDB& txdb, uint64_t& nCoinAge) const
 
     BOOST_FOREACH(const CTxIn& txin, vin)
     {
-        // First try finding the previous transaction in database
-        CTransaction txPrev;
-        CTxIndex txindex;
-        if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-            continue;  // previous transaction not in main chain
-        if (nTime < txPrev.nTime)
-            return false;  // Transaction timestamp violation
+        // Outputs of the best chain are usually in the coin age cache
+        CCoinAgeEntry entry;
+        if (!coinAgeCache.Get(txin.prevout, entry))
+        {
+            // First try finding the previous transaction in database
+            CTransaction txPrev;
+            CTxIndex txindex;
+            if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+                continue;  // previous transaction not in main chain
+            if (nTime < txPrev.nTime)
+                return false;  // Transaction timestamp violation
 
-        // Read block header
-        CBlock block;
-        if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-            return false; // unable to read block of previous transaction
-        if (block.GetBlockTime() + GetStakeMinAge() > nTime)
+            // Read block header
+            CBlock block;
+            if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+                return false; // unable to read block of previous transaction
+            entry = CCoinAgeEntry(txPrev.vout[txin.prevout.n].nValue, txPrev.nTime, block.GetBlockTime());
+        }
+        if (nTime < entry.nTxTime)
+            return false;  // Transaction timestamp violation
+        if ((int64_t)entry.nBlockTime + GetStakeMinAge() > nTime)
             continue; // only count coins meeting min age requirement
 
-        int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-        bnCentSecond += CBigNum(nValueIn) * (nTime-txPrev.nTime) / CENT;
+        // Output values are never negative and nTime is not before entry.nTxTime
+        int64_t nValueIn = entry.nValue;
+        bnCentSecond += uint256((uint64_t)nValueIn) * uint256((uint64_t)(nTime - entry.nTxTime)) / uint256((uint64_t)CENT);
 
-        LogPrint("coinage", "coin age nValueIn=%d nTimeDiff=%d bnCentSecond=%s\n", nValueIn, nTime - txPrev.nTime, bnCentSecond.ToString());
+        LogPrint("coinage", "coin age nValueIn=%d nTimeDiff=%d bnCentSecond=%s\n", nValueIn, nTime - entry.nTxTime, bnCentSecond.ToString());
     }
 
-    CBigNum bnCoinDay = bnCentSecond * CENT / COIN / (24 * 60 * 60);
+    uint256 bnCoinDay = bnCentSecond * uint256((uint64_t)CENT) / uint256((uint64_t)COIN) / uint256((uint64_t)(24 * 60 * 60));
     LogPrint("coinage", "coin age bnCoinDay=%s\n", bnCoinDay.ToString());
-    nCoinAge = bnCoinDay.getuint64();
+    nCoinAge = bnCoinDay.Get64();
     return true;
 }
 
@@ -2306,7 +2670,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     if (!pindexNew)
         return error("AddToBlockIndex() : new CBlockIndex failed");
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -2334,7 +2698,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=0x%016x", pindexNew->nHeight, nStakeModifier);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
@@ -2375,6 +2739,15 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
     // These are checks that are independent of context
     // that can be verified before saving an orphan block.
 
+    // Already passed on a block check thread; only the clock may have moved
+    // since
+    if (fChecked)
+    {
+        if (GetBlockTime() > FutureDrift(GetAdjustedTime()))
+            return error("CheckBlock() : block timestamp too far in the future");
+        return true;
+    }
+
     // Size limits
     if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
         return DoS(100, error("CheckBlock() : size limits failed"));
@@ -2485,7 +2858,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2605,20 +2978,29 @@ void Misbehaving(NodeId pnode, int howmuch)
 
 uint256 CBlockIndex::GetBlockTrust() const
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
-    if (bnTarget <= 0)
+    bool fNegative, fOverflow;
+    uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+    if (fNegative)
+        return 0;
+
+    // A target past 256 bits is larger than any numerator below
+    if (fOverflow)
+        return IsProofOfStake() ? 0 : 1;
+
+    if (bnTarget == 0)
         return 0;
 
     if (IsProofOfStake())
     {
-        // Return trust score as usual
-        return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+        // Return trust score as usual: 2**256 / (bnTarget+1), which is
+        // ~bnTarget / (bnTarget+1) + 1 without leaving 256 bits
+        return (~bnTarget / (bnTarget + 1)) + 1;
     }
     else
     {
         // Calculate work amount for block
-        uint256 nPoWTrust = (CBigNum(bnProofOfWorkLimit) / (bnTarget+1)).getuint256();
+        uint256 nPoWTrust = nProofOfWorkLimit / (bnTarget + 1);
         return nPoWTrust > 1 ? nPoWTrust : 1;
     }
 }
@@ -2759,25 +3141,8 @@ bool CBlock::SignPoSBlock(CWallet& wallet)
     {
         if (wallet.CreateCoinStake(wallet, nBits, nSearchTime-nLastCoinStakeSearchTime, txCoinStake, key))
         {
-            if (txCoinStake.nTime >= max(pindexBest->GetPastTimeLimit()+1, PastDrift(pindexBest->GetBlockTime())))
-            {
-                // make sure coinstake would meet timestamp protocol
-                // as it would be the same as the block timestamp
-                vtx[0].nTime = nTime = txCoinStake.nTime;
-                nTime = max(pindexBest->GetPastTimeLimit()+1, GetMaxTransactionTime());
-                nTime = max(GetBlockTime(), PastDrift(pindexBest->GetBlockTime()));
-
-                // we have to make sure that we have no future timestamps in
-                // our transactions set
-                for (vector<CTransaction>::iterator it = vtx.begin(); it != vtx.end();)
-                    if (it->nTime > nTime) { it = vtx.erase(it); } else { ++it; }
-
-                vtx.insert(vtx.begin() + 1, txCoinStake);
-                hashMerkleRoot = BuildMerkleTree();
-
-                // append a signature to our block
-                return key.Sign(GetHash(), vchBlockSig);
-            }
+            if (SignPoSBlock(txCoinStake, key))
+                return true;
         }
         nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
         nLastCoinStakeSearchTime = nSearchTime;
@@ -2786,6 +3151,35 @@ bool CBlock::SignPoSBlock(CWallet& wallet)
     return false;
 }
 
+// Add a coinstake found for this template and sign the block with its key
+bool CBlock::SignPoSBlock(const CTransaction& txCoinStake, CKey& key)
+{
+    if (!vtx[0].vout[0].IsEmpty() || IsProofOfStake())
+        return false;
+
+    if (txCoinStake.nTime >= max(pindexBest->GetPastTimeLimit()+1, PastDrift(pindexBest->GetBlockTime())))
+    {
+        // make sure coinstake would meet timestamp protocol
+        // as it would be the same as the block timestamp
+        vtx[0].nTime = nTime = txCoinStake.nTime;
+        nTime = max(pindexBest->GetPastTimeLimit()+1, GetMaxTransactionTime());
+        nTime = max(GetBlockTime(), PastDrift(pindexBest->GetBlockTime()));
+
+        // we have to make sure that we have no future timestamps in
+        // our transactions set
+        for (vector<CTransaction>::iterator it = vtx.begin(); it != vtx.end();)
+            if (it->nTime > nTime) { it = vtx.erase(it); } else { ++it; }
+
+        vtx.insert(vtx.begin() + 1, txCoinStake);
+        hashMerkleRoot = BuildMerkleTree();
+
+        // append a signature to our block
+        return key.Sign(GetHash(), vchBlockSig);
+    }
+
+    return false;
+}
+
 // hbn: sign block for PoW
 bool CBlock::SignBlock(const CKeyStore& keystore)
 {
@@ -2954,6 +3348,8 @@ bool LoadBlockIndex(bool fAllowNew)
 
         bnProofOfStakeLimit = bnProofOfStakeLimitTestNet; // 0x00000fff PoS base target is fixed in testnet
         bnProofOfWorkLimit = bnProofOfWorkLimitTestNet; // 0x0000ffff PoW base target is fixed in testnet
+        nProofOfStakeLimit = bnProofOfStakeLimit.getuint256();
+        nProofOfWorkLimit = bnProofOfWorkLimit.getuint256();
         nCoinbaseMaturity = 10; // test maturity is 10 blocks
     }
 
@@ -3071,7 +3467,7 @@ void PrintBlockTree()
     AssertLockHeld(cs_main);
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3137,6 +3533,90 @@ void PrintBlockTree()
             vStack.push_back(make_pair(nCol+i, vNext[i]));
     }
 }
+// A block read from an external block file
+struct CExternalBlock
+{
+    unsigned int nPos;  // just past its message start
+    unsigned int nSize; // 0 until the block has been read
+    boost::shared_ptr<CBlockPrecheck> pcheck;
+
+    CExternalBlock() : nPos(0), nSize(0), pcheck(new CBlockPrecheck()) { }
+};
+
+// Blocks read ahead of the ones being connected
+static const unsigned int MAX_BLOCKS_AHEAD = 64;
+
+// Reads up to MAX_BLOCKS_AHEAD blocks from nPos on, as if each of them is
+// going to be accepted. Returns false once nothing more can be read.
+static bool ReadExternalBlocks(CAutoFile& blkdat, unsigned int& nPos, std::list<CExternalBlock>& listBlocks)
+{
+    try {
+        unsigned int nBytes = 0;
+        while (nPos != (unsigned int)-1 && blkdat.good() && !fRequestShutdown)
+        {
+            if (listBlocks.size() >= MAX_BLOCKS_AHEAD || nBytes >= 8 * MAX_BLOCK_SIZE)
+                return true;
+
+            unsigned char pchData[65536];
+            do {
+                fseek(blkdat, nPos, SEEK_SET);
+                int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
+                if (nRead <= 8)
+                {
+                    nPos = (unsigned int)-1;
+                    break;
+                }
+                void* nFind = memchr(pchData, pchMessageStart[0], nRead+1-sizeof(pchMessageStart));
+                if (nFind)
+                {
+                    if (memcmp(nFind, pchMessageStart, sizeof(pchMessageStart))==0)
+                    {
+                        nPos += ((unsigned char*)nFind - pchData) + sizeof(pchMessageStart);
+                        break;
+                    }
+                    nPos += ((unsigned char*)nFind - pchData) + 1;
+                }
+                else
+                    nPos += sizeof(pchData) - sizeof(pchMessageStart) + 1;
+            } while(!fRequestShutdown);
+            if (nPos == (unsigned int)-1)
+                break;
+            fseek(blkdat, nPos, SEEK_SET);
+            unsigned int nSize;
+            blkdat >> nSize;
+            if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+            {
+                listBlocks.push_back(CExternalBlock());
+                blkdat >> listBlocks.back().pcheck->block;
+                listBlocks.back().nPos = nPos;
+                listBlocks.back().nSize = nSize;
+                nPos += 4 + nSize;
+                nBytes += nSize;
+            }
+        }
+    }
+    catch (std::exception &e) {
+        LogPrintf("%s() : Deserialize or I/O error caught during load\n",
+               __PRETTY_FUNCTION__);
+        if (!listBlocks.empty() && listBlocks.back().nSize == 0)
+            listBlocks.pop_back();
+    }
+    return false;
+}
+
+// Whether a message start begins within the block read at ext. Scanning
+// from inside the block would stop there instead of at the block after it.
+static bool ExternalBlockHidesMessageStart(CAutoFile& blkdat, const CExternalBlock& ext)
+{
+    std::vector<unsigned char> vch(4 + ext.nSize + sizeof(pchMessageStart) - 1);
+    fseek(blkdat, ext.nPos, SEEK_SET);
+    size_t nRead = fread(&vch[0], 1, vch.size(), blkdat);
+    for (size_t i = 0; i + sizeof(pchMessageStart) <= nRead; i++)
+        if (memcmp(&vch[i], pchMessageStart, sizeof(pchMessageStart)) == 0)
+            return true;
+    return false;
+}
+
 bool LoadExternalBlockFile(FILE* fileIn)
 {
     int64_t nStart = GetTimeMillis();
@@ -3147,46 +3627,58 @@ bool LoadExternalBlockFile(FILE* fileIn)
         try {
             CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
             unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good() && !fRequestShutdown)
+
+            // Each batch is checked on the block check threads while the
+            // batch read before it is connected, block by block as their
+            // checks finish
+            std::list<CExternalBlock> listConnect;
+            bool fMore = true;
+            do
             {
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat, nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
-                    {
-                        nPos = (unsigned int)-1;
+                std::list<CExternalBlock> listCheck;
+                bool fMoreCheck = fMore && ReadExternalBlocks(blkdat, nPos, listCheck);
+
+                std::vector<boost::shared_ptr<CBlockPrecheck> > vChecks;
+                BOOST_FOREACH(const CExternalBlock& ext, listCheck)
+                    vChecks.push_back(ext.pcheck);
+                QueueBlockChecks(vChecks);
+
+                bool fRescan = false;
+                BOOST_FOREACH(CExternalBlock& ext, listConnect)
+                {
+                    if (fRequestShutdown)
                         break;
-                    }
-                    void* nFind = memchr(pchData, pchMessageStart[0], nRead+1-sizeof(pchMessageStart));
-                    if (nFind)
+                    FinishBlockCheck(*ext.pcheck);
+                    if (ProcessBlock(NULL, &ext.pcheck->block))
                     {
-                        if (memcmp(nFind, pchMessageStart, sizeof(pchMessageStart))==0)
-                        {
-                            nPos += ((unsigned char*)nFind - pchData) + sizeof(pchMessageStart);
-                            break;
-                        }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
+                        nLoaded++;
+                        continue;
                     }
-                    else
-                        nPos += sizeof(pchData) - sizeof(pchMessageStart) + 1;
-                } while(!fRequestShutdown);
-                if (nPos == (unsigned int)-1)
-                    break;
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
-                {
-                    CBlock block;
-                    blkdat >> block;
-                    if (ProcessBlock(NULL,&block))
+
+                    // Scanning carries on from inside a block that is not
+                    // accepted. That finds the block read after it, unless
+                    // another message start hides in its bytes; only then
+                    // is everything read after it dropped.
+                    if (ExternalBlockHidesMessageStart(blkdat, ext))
                     {
-                        nLoaded++;
-                        nPos += 4 + nSize;
+                        nPos = ext.nPos;
+                        fRescan = true;
+                        break;
                     }
                 }
-            }
+                BOOST_FOREACH(CExternalBlock& ext, listConnect)
+                    DropBlockCheck(*ext.pcheck);
+
+                if (fRescan)
+                {
+                    BOOST_FOREACH(CExternalBlock& ext, listCheck)
+                        DropBlockCheck(*ext.pcheck);
+                    listCheck.clear();
+                    fMoreCheck = true;
+                }
+                listConnect.swap(listCheck);
+                fMore = fMoreCheck;
+            } while ((fMore || !listConnect.empty()) && !fRequestShutdown);
         }
         catch (std::exception &e) {
             LogPrintf("%s() : Deserialize or I/O error caught during load\n",
@@ -3317,7 +3809,7 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 // a large 4-byte int at any alignment.
 unsigned char pchMessageStart[4] = { 0xe4, 0xe8, 0xe9, 0xe5 };
 
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived, CBlock* pblockChecked)
 {
     static map<CService, CPubKey> mapReuseKey;
     RandAddSeedPerfmon();
@@ -3601,7 +4093,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (inv.type == MSG_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 pfrom->nBlocksRequested++;
                 if (mi != mapBlockIndex.end())
                 {
@@ -3712,7 +4204,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3744,6 +4236,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
+        tx.MemoizeHash();
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
@@ -3804,8 +4297,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == "block")
     {
-        CBlock block;
-        vRecv >> block;
+        // Unless ProcessMessages read and checked it already
+        CBlock blockRecv;
+        CBlock& block = pblockChecked ? *pblockChecked : blockRecv;
+        if (!pblockChecked)
+        {
+            vRecv >> block;
+            block.MemoizeHashes();
+        }
         uint256 hashBlock = block.GetHash();
 
         LogPrint("net", "received block %s sent from %s\n", hashBlock.ToString().substr(0,20), pfrom->addr.ToString());
@@ -4017,7 +4516,44 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     return true;
 }
 
-// requires LOCK(cs_vRecvMsg)
+// Reads the block messages that have come in complete since the last call
+// and queues their context free checks, which then run alongside the
+// connection of the blocks received before them. Each node's cs_vRecvMsg
+// is only held to copy out its messages.
+void CheckBlockMessages(const std::vector<CNode*>& vNodes)
+{
+    std::list<std::pair<boost::shared_ptr<CBlockPrecheck>, CDataStream> > listRead;
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if (pnode->fDisconnect)
+            continue;
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (!lockRecv)
+            continue;
+        for (std::deque<CNetMessage>::iterator it = pnode->vRecvMsg.begin(); it != pnode->vRecvMsg.end() && it->complete(); it++)
+        {
+            if (it->pprecheck || it->hdr.GetCommand() != "block")
+                continue;
+            it->pprecheck.reset(new CBlockPrecheck());
+            listRead.push_back(make_pair(it->pprecheck, it->vRecv));
+        }
+    }
+
+    std::vector<boost::shared_ptr<CBlockPrecheck> > vChecks;
+    for (std::list<std::pair<boost::shared_ptr<CBlockPrecheck>, CDataStream> >::iterator it = listRead.begin(); it != listRead.end(); it++)
+    {
+        // A message that cannot be read is left to ProcessMessage to report
+        try {
+            it->second >> it->first->block;
+            vChecks.push_back(it->first);
+        }
+        catch (std::exception& e) {
+            it->first->block.SetNull();
+        }
+    }
+    QueueBlockChecks(vChecks);
+}
+
 bool ProcessMessages(CNode* pfrom)
 {
     // if (fDebug)
@@ -4092,9 +4628,15 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
+            CBlock* pblockChecked = NULL;
+            if (msg.pprecheck && !msg.pprecheck->block.IsNull())
+            {
+                FinishBlockCheck(*msg.pprecheck);
+                pblockChecked = &msg.pprecheck->block;
+            }
             {
                 LOCK(cs_main);
-                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime, pblockChecked);
             }
             if (fShutdown)
                 break;
@@ -12,9 +12,14 @@
 #include "scrypt.h"
 
 #include <list>
+#include <deque>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 
 class CWallet;
 class CBlock;
+class CBlockPrecheck;
 class CBlockIndex;
 class CKeyItem;
 class CReserveKey;
@@ -111,8 +116,27 @@ inline int64_t FutureDrift(int64_t nTime)
 extern CScript COINBASE_FLAGS;
 
 
+/** Hash function for the block index. Block hashes are uniformly distributed
+ * already, so mixing their low bits with a per-process random salt gives a
+ * good bucket index while keeping peers from aiming blocks at one bucket.
+ */
+struct BlockHasher
+{
+    uint64_t nSalt0;
+    uint64_t nSalt1;
+
+    BlockHasher();
+
+    size_t operator()(const uint256& hash) const
+    {
+        return (size_t)(((hash.Get64(0) ^ nSalt0) * 0x9E3779B97F4A7C15ULL) ^ hash.Get64(1) ^ nSalt1);
+    }
+};
+
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern uint256 hashGenesisBlock;
 extern CBlockIndex* pindexGenesisBlock;
@@ -177,14 +201,30 @@ FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
+CBlockIndex* FindBlockByDiskPos(unsigned int nFile, unsigned int nBlockPos);
+void UpdateActiveChain(CBlockIndex* pindexNew);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 bool LoadExternalBlockFile(FILE* fileIn);
+// Read the block messages complete in the queues of vNodes and queue their
+// context free checks for the block checking threads
+void CheckBlockMessages(const std::vector<CNode*>& vNodes);
 
 // Run an instance of the script checking thread
 void ThreadScriptCheck(void* parg);
 // Stop the script checking threads
 void ThreadScriptCheckQuit();
+// Run an instance of the block checking thread
+void ThreadBlockCheck(void* parg);
+// Stop the block checking threads
+void ThreadBlockCheckQuit();
+// Number of blocks that have been through their context free checks
+uint64_t GetBlockCheckCount();
+// Hand blocks to the block checking threads, first come first checked
+void QueueBlockChecks(const std::vector<boost::shared_ptr<CBlockPrecheck> >& vChecks);
+// Wait for the checks of a block to finish, running them here if no thread
+// has started on them yet
+void FinishBlockCheck(CBlockPrecheck& check);
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -205,7 +245,6 @@ std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
 uint256 WantedByOrphan(const CBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
-void StakeMiner(CWallet *pwallet);
 void ResendWalletTransactions(bool fForce = false);
 /** Get statistics from node state */
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
@@ -480,6 +519,32 @@ enum GetMinFee_mode
 
 typedef std::map<uint256, std::pair<CTxIndex, CTransaction> > MapPrevTx;
 
+/** The hash of an object that is not going to change any more, so it does
+ * not have to be worked out again. Copies start out empty, as a copy is
+ * often made to be changed.
+ */
+class CHashMemo
+{
+private:
+    uint256 hash;
+    bool fSet;
+
+public:
+    CHashMemo() : fSet(false) { }
+    CHashMemo(const CHashMemo&) : fSet(false) { }
+    CHashMemo& operator=(const CHashMemo&) { fSet = false; return *this; }
+
+    bool IsSet() const { return fSet; }
+    bool Get(uint256& hashRet) const
+    {
+        if (fSet)
+            hashRet = hash;
+        return fSet;
+    }
+    void Set(const uint256& hashIn) { hash = hashIn; fSet = true; }
+    void Clear() { fSet = false; }
+};
+
 /** The basic transaction that is broadcasted on the network and contained in
  * blocks.  A transaction can contain multiple inputs and outputs.
  */
@@ -493,6 +558,9 @@ public:
     std::vector<CTxOut> vout;
     unsigned int nLockTime;
 
+    // memory only, see MemoizeHash
+    mutable CHashMemo hashMemo;
+
     // Denial-of-service detection:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
@@ -510,6 +578,8 @@ public:
         READWRITE(vin);
         READWRITE(vout);
         READWRITE(nLockTime);
+        if (fRead)
+            hashMemo.Clear();
     )
 
     void SetNull()
@@ -520,6 +590,7 @@ public:
         vout.clear();
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
+        hashMemo.Clear();
     }
 
     bool IsNull() const
@@ -529,7 +600,19 @@ public:
 
     uint256 GetHash() const
     {
-        return SerializeHash(*this);
+        uint256 hash;
+        if (!hashMemo.Get(hash))
+            hash = SerializeHash(*this);
+        return hash;
+    }
+
+    // Remember the hash from here on. Only for a transaction that is not
+    // changed again, such as one just read from the network or disk;
+    // reading it again or SetNull forget the hash.
+    void MemoizeHash() const
+    {
+        if (!hashMemo.IsSet())
+            hashMemo.Set(SerializeHash(*this));
     }
 
     bool IsCoinBase() const
@@ -710,12 +793,15 @@ private:
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
+    // Shared by the checks of one transaction's inputs, may be null
+    boost::shared_ptr<const CSignatureHashCache> psighashcache;
 
 public:
     CScriptCheck() {}
-    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSignatureHashCache>& psighashcacheIn = boost::shared_ptr<const CSignatureHashCache>()) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), psighashcache(psighashcacheIn) { }
 
     bool operator()() const;
 
@@ -725,6 +811,7 @@ public:
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(nHashType, check.nHashType);
+        psighashcache.swap(check.psighashcache);
     }
 };
 
@@ -882,6 +969,9 @@ public:
 
     // memory only
     mutable std::vector<uint256> vMerkleTree;
+    mutable CHashMemo hashMemo;
+    // Passed CheckBlock in full on a block check thread
+    mutable bool fChecked;
 
     // Denial-of-service detection:
     mutable int nDoS;
@@ -913,6 +1003,11 @@ public:
             const_cast<CBlock*>(this)->vtx.clear();
             const_cast<CBlock*>(this)->vchBlockSig.clear();
         }
+        if (fRead)
+        {
+            hashMemo.Clear();
+            fChecked = false;
+        }
     )
 
     void SetNull()
@@ -926,6 +1021,8 @@ public:
         vtx.clear();
         vchBlockSig.clear();
         vMerkleTree.clear();
+        hashMemo.Clear();
+        fChecked = false;
         nDoS = 0;
     }
 
@@ -936,7 +1033,26 @@ public:
 
     uint256 GetHash() const
     {
-        return scrypt_blockhash(CVOIDBEGIN(nVersion));
+        uint256 hash;
+        if (!hashMemo.Get(hash))
+            hash = scrypt_blockhash(CVOIDBEGIN(nVersion));
+        return hash;
+    }
+
+    // Remember the hash of the header from here on, the same way as
+    // CTransaction::MemoizeHash
+    void MemoizeHash() const
+    {
+        if (!hashMemo.IsSet())
+            hashMemo.Set(scrypt_blockhash(CVOIDBEGIN(nVersion)));
+    }
+
+    // Remember the hashes of the header and of every transaction
+    void MemoizeHashes() const
+    {
+        MemoizeHash();
+        BOOST_FOREACH(const CTransaction& tx, vtx)
+            tx.MemoizeHash();
     }
 
     int64_t GetBlockTime() const
@@ -1129,6 +1245,7 @@ public:
     bool GetCoinAge(uint64_t& nCoinAge) const; // ppcoin: calculate total coin age spent in block
     bool SignBlock(const CKeyStore& keystore);
     bool SignPoSBlock(CWallet& wallet);
+    bool SignPoSBlock(const CTransaction& txCoinStake, CKey& key);
     bool CheckBlockSignature(bool fProofOfStake) const;
 
 private:
@@ -1137,9 +1254,39 @@ private:
 
 
 
+/** A block whose context free checks are run ahead of its connection. They
+ * leave fChecked set in the block when it passes; a block that fails is
+ * checked again, and scored, when ProcessBlock gets to it.
+ */
+class CBlockPrecheck
+{
+public:
+    enum { QUEUED, RUNNING, DONE };
+
+    CBlock block;
+    int nState; // guarded by the block check queue
+
+    CBlockPrecheck() : nState(QUEUED) { }
+};
+
+
 
 
 
+
+/** Slab allocator for CBlockIndex. Block index entries live until shutdown,
+ * so instead of one heap allocation each they are packed back to back into
+ * large slabs, which keeps entries created together, such as a chain loaded
+ * at startup, close in memory.
+ */
+class CBlockIndexArena
+{
+public:
+    static void* Allocate(size_t nSize);
+    static void Free(void* p, size_t nSize);
+    static void GetStats(size_t& nEntries, size_t& nSlots, size_t& nSlabBytes);
+};
+
 /** The block chain is a tree shaped structure starting with the
  * genesis block at the root, with each block potentially having multiple
  * candidates to be the next block.  pprev and pnext link a path through the
@@ -1150,17 +1297,14 @@ private:
 class CBlockIndex
 {
 public:
-    const uint256* phashBlock;
+    // Fields read while walking the chain come first so that they sit
+    // together at the front of the entry; the rest is only needed once a
+    // block has been found.
     CBlockIndex* pprev;
     CBlockIndex* pnext;
-    unsigned int nFile;
-    unsigned int nBlockPos;
-    uint256 nChainTrust; // ppcoin: trust score of block chain
+    const uint256* phashBlock;
+    uint64_t nStakeModifier; // hash modifier for proof-of-stake
     int nHeight;
-
-    int64_t nMint;
-    int64_t nMoneySupply;
-
     unsigned int nFlags;  // ppcoin: block index flags
     enum  
     {
@@ -1168,22 +1312,30 @@ public:
         BLOCK_STAKE_ENTROPY  = (1 << 1), // entropy bit for stake modifier
         BLOCK_STAKE_MODIFIER = (1 << 2), // regenerated stake modifier
     };
-
-    uint64_t nStakeModifier; // hash modifier for proof-of-stake
+    unsigned int nTime;
+    unsigned int nBits;
+    int nVersion;
+    unsigned int nFile;
+    unsigned int nBlockPos;
     unsigned int nStakeModifierChecksum; // checksum of index; in-memeory only
 
+    uint256 nChainTrust; // ppcoin: trust score of block chain
+    int64_t nMint;
+    int64_t nMoneySupply;
+
     // proof-of-stake specific fields
     COutPoint prevoutStake;
     unsigned int nStakeTime;
     uint256 hashProofOfStake;
 
     // block header
-    int nVersion;
     uint256 hashMerkleRoot;
-    unsigned int nTime;
-    unsigned int nBits;
     unsigned int nNonce;
 
+    // Entries are carved out of CBlockIndexArena slabs
+    static void* operator new(size_t nSize) { return CBlockIndexArena::Allocate(nSize); }
+    static void operator delete(void* p, size_t nSize) { CBlockIndexArena::Free(p, nSize); }
+
     CBlockIndex()
     {
         phashBlock = NULL;
@@ -1479,7 +1631,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1530,7 +1682,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1549,7 +1701,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1565,7 +1717,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1628,4 +1780,58 @@ public:
 
 extern CTxMemPool mempool;
 
+
+/** What GetCoinAge needs of a transaction output */
+class CCoinAgeEntry
+{
+public:
+    int64_t nValue;
+    unsigned int nTxTime;
+    unsigned int nBlockTime;    // time of the block holding the transaction
+
+    CCoinAgeEntry() : nValue(0), nTxTime(0), nBlockTime(0) { }
+    CCoinAgeEntry(int64_t nValueIn, unsigned int nTxTimeIn, unsigned int nBlockTimeIn) :
+        nValue(nValueIn), nTxTime(nTxTimeIn), nBlockTime(nBlockTimeIn) { }
+};
+
+/** Unspent outputs of the main chain with their coin age data, so
+ * GetCoinAge need not read the previous transaction and its block header.
+ * Outputs are added once their block is committed to the best chain and
+ * removed when spent or disconnected; past nMaxSize the oldest go first.
+ * A missing output is simply read from disk.
+ */
+class CCoinAgeCache
+{
+private:
+    mutable CCriticalSection cs;
+    std::map<COutPoint, CCoinAgeEntry> mapEntries;
+    std::deque<COutPoint> queueAdded;   // in the order added; may hold removed outputs
+    unsigned int nMaxSize;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+public:
+    CCoinAgeCache() : nMaxSize(100000), nHits(0), nMisses(0) { }
+
+    void SetMaxSize(unsigned int nMaxSizeIn);
+    bool Get(const COutPoint& outpoint, CCoinAgeEntry& entry);
+    void ConnectBlock(const CBlock& block);
+    void DisconnectBlock(const CBlock& block);
+
+    unsigned int size() const
+    {
+        LOCK(cs);
+        return mapEntries.size();
+    }
+
+    void GetStats(uint64_t& nHitsRet, uint64_t& nMissesRet) const
+    {
+        LOCK(cs);
+        nHitsRet = nHits;
+        nMissesRet = nMisses;
+    }
+};
+
+extern CCoinAgeCache coinAgeCache;
+
 #endif
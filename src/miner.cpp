@@ -9,6 +9,7 @@
 #include "txdb.h"
 #include "miner.h"
 #include "kernel.h"
+#include "checkqueue.h"
 #include <boost/algorithm/string/replace.hpp>
 
 using namespace std;
@@ -78,6 +79,7 @@ public:
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
+int nStakeSearchThreads = 1;
 
 // We want to sort transactions by priority and fee, so:
 typedef boost::tuple<double, double, CTransaction*> TxPriority;
@@ -511,72 +513,297 @@ bool CheckStake(CBlock* pblock, CWallet& wallet)
     return true;
 }
 
-void StakeMiner(CWallet *pwallet)
+bool CStakeKernelSearch::operator()()
+{
+    // Leave the chunks not started yet once the chain moved on or another
+    // chunk found a kernel
+    if (pindexBest != presult->pindexPrev)
+        presult->fAbort = true;
+    if (presult->fAbort)
+        return false;
+
+    CoinsSet::value_type kernelcoin;
+    unsigned int nTimeTx, nBlockTime;
+    uint64_t nKernelsChecked = 0;
+    bool fFound = ScanForStakeKernelHash(*pcandidates, settings, kernelcoin, nTimeTx, nBlockTime, &presult->fAbort, &nKernelsChecked);
+
+    LOCK(presult->cs);
+    presult->nKernelsChecked += nKernelsChecked;
+    if (!fFound)
+        return true;
+
+    // Chunks running side by side may both find one; keep the first queued
+    if (!presult->fFound || nChunk < presult->nChunk)
+    {
+        presult->fFound = true;
+        presult->nChunk = nChunk;
+        presult->pwallet = pwallet;
+        presult->kernelcoin = kernelcoin;
+        presult->nTimeTx = nTimeTx;
+        presult->nBlockTime = nBlockTime;
+    }
+    presult->fAbort = true;
+    return false;
+}
+
+void ThreadStakeSearch(CCheckQueue<CStakeKernelSearch>* pqueue)
+{
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    RenameThread("hobocoin-stakesearch");
+    pqueue->Thread();
+}
+
+static CCriticalSection cs_StakeMinerStats;
+static CStakeMinerStats stakeMinerStats;
+
+CStakeMinerStats GetStakeMinerStats()
+{
+    LOCK(cs_StakeMinerStats);
+    return stakeMinerStats;
+}
+
+// Set by WakeStakeMiner until the stake miner wakes up
+static boost::mutex csStakeEvent;
+static boost::condition_variable condStakeEvent;
+static bool fStakeEvent = false;
+
+void WakeStakeMiner()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(csStakeEvent);
+        fStakeEvent = true;
+    }
+    condStakeEvent.notify_one();
+}
+
+// Waits until the next second starts, when the kernel has a new timestamp
+// to try, or until WakeStakeMiner is called. Returns whether it was woken.
+static bool WaitForStakeTick()
+{
+    boost::system_time timeTick = boost::get_system_time() + boost::posix_time::milliseconds(1000 - GetTimeMillis() % 1000);
+    boost::unique_lock<boost::mutex> lock(csStakeEvent);
+    while (!fStakeEvent)
+        if (!condStakeEvent.timed_wait(lock, timeTick))
+            break;
+    bool fWoken = fStakeEvent;
+    fStakeEvent = false;
+    return fWoken;
+}
+
+// Single stake miner for every loaded wallet. Each second it takes the
+// unlocked wallets, searches all their staking coins for a kernel on one
+// block template shared by the whole tick, and signs the block with the
+// wallet owning the kernel. A new best block, wallet transaction or
+// unlocked wallet wakes it up early to search the current second again.
+void CWalletManager::StakeMiner()
 {
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
 
     // Make this thread recognisable as the mining thread
     RenameThread("hobocoin-stakeminer");
 
-    bool fTryToSync = true;
+    // The scheduler thread joins the workers while it waits for a search
+    CCheckQueue<CStakeKernelSearch> queue(1);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nStakeSearchThreads - 1; i++)
+        threadGroup.create_thread(boost::bind(&ThreadStakeSearch, &queue));
+    LogPrintf("StakeMiner started with %d search threads\n", nStakeSearchThreads);
 
-    // Each thread has its own counter
+    bool fTryToSync = true;
+    bool fWoken = false;
     unsigned int nExtraNonce = 0;
+    int64_t nLastCoinStakeSearchTime = GetAdjustedTime(); // startup timestamp
 
-    while (!fStopStaking)
-    {
-        if (fShutdown)
-            return;
+    auto_ptr<CBlock> pblockTemplate;
+    CBlockIndex* pindexTemplate = NULL;
+    unsigned int nTransactionsUpdatedTemplate = 0;
+    int64_t nTemplateTime = 0;
 
-        while (pwallet->IsLocked())
+    try
+    {
+        while (true)
         {
-            MilliSleep(1000);
-            if (fShutdown)
-                return;
-        }
+            // Exit under cs_StakeMiner so StartStakeMiner knows whether a
+            // restart finds this thread still running
+            if (fShutdown || fStopStaking)
+            {
+                LOCK(cs_StakeMiner);
+                if (fShutdown || fStopStaking)
+                {
+                    fStakeMinerRunning = false;
+                    break;
+                }
+            }
 
-        while (vNodes.empty() || IsInitialBlockDownload())
-        {
-            fTryToSync = true;
-            MilliSleep(1000);
-            if (fShutdown)
-                return;
-        }
+            if (vNodes.empty() || IsInitialBlockDownload())
+            {
+                fTryToSync = true;
+                MilliSleep(1000);
+                continue;
+            }
 
-        if (fTryToSync)
-        {
-            fTryToSync = false;
+            if (fTryToSync)
+            {
+                fTryToSync = false;
 
-            while (vNodes.size() < (fTestNet ? 0 : 3) || nBestHeight  < GetNumBlocksOfPeers()-5)
+                while (vNodes.size() < (fTestNet ? 0 : 3) || nBestHeight  < GetNumBlocksOfPeers()-5)
+                {
+                    LogPrintf("stake-miner sleeping while we get connectd.\n");
+                    MilliSleep(60000);
+                    if (fShutdown || fStopStaking)
+                        break;
+                }
+                continue;
+            }
+
+            // Take the unlocked wallets; the shared pointers keep a wallet
+            // alive until the tick is over if it gets unloaded meanwhile
+            vector<boost::shared_ptr<CWallet> > vpwallets;
             {
-                LogPrintf("stake-miner sleeping while we get connectd.\n");
-                MilliSleep(60000);
+                TRY_LOCK(cs_WalletManager, lockWallets);
+                if (!lockWallets)
+                {
+                    MilliSleep(nMinerSleep);
+                    continue;
+                }
+                BOOST_FOREACH(const wallet_map::value_type& item, wallets)
+                    if (!item.second->IsLocked())
+                        vpwallets.push_back(item.second);
+            }
+            if (vpwallets.empty())
+            {
+                fWoken = WaitForStakeTick();
+                continue;
             }
-            continue;
-        }
 
-        //
-        // Create new block
-        //
-        CBlockIndex* pindexPrev = pindexBest;
+            //
+            // One block template per tip, refreshed for new transactions
+            // at most once a minute
+            //
+            if (!pblockTemplate.get() || pindexTemplate != pindexBest ||
+                (nTransactionsUpdatedTemplate != nTransactionsUpdated && GetTime() - nTemplateTime > 60))
+            {
+                pindexTemplate = pindexBest;
+                nTransactionsUpdatedTemplate = nTransactionsUpdated;
+                nTemplateTime = GetTime();
+                pblockTemplate.reset(CreateNewBlock(NULL, true));
+                if (!pblockTemplate.get())
+                {
+                    LOCK(cs_StakeMiner);
+                    fStakeMinerRunning = false;
+                    break;
+                }
+            }
+
+            // Search the seconds since the last search, or the last one
+            // again if something changed since
+            int64_t nSearchTime = GetAdjustedTime();
+            int64_t nSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
+            if (nSearchInterval == 0 && fWoken)
+                nSearchInterval = 1;
+            fWoken = false;
+            if (nSearchInterval <= 0)
+            {
+                fWoken = WaitForStakeTick();
+                continue;
+            }
+
+            //
+            // Search the staking coins of all wallets at once
+            //
+            CStakeSearchResult result;
+            result.pindexPrev = pindexTemplate;
+            unsigned int nCoins = 0;
+            int64_t nSearchStart;
+            {
+                vector<CStakeKernelSearch> vSearch;
+                unsigned int nChunk = 0;
+                BOOST_FOREACH(const boost::shared_ptr<CWallet>& pwallet, vpwallets)
+                {
+                    if (!pwallet->PrepareStakeCandidates())
+                        continue;
+
+                    StakeCandidatesPtr pcandidates = pwallet->GetStakeCandidates();
+                    unsigned int nCandidates = pcandidates->size();
+                    nCoins += nCandidates;
+                    for (unsigned int nOffset = 0; nOffset < nCandidates; nOffset += STAKE_SEARCH_CHUNK)
+                    {
+                        KernelSearchSettings settings;
+                        settings.nBits = pblockTemplate->nBits;
+                        settings.nTime = nSearchTime;
+                        settings.nOffset = nOffset;
+                        settings.nLimit = min((unsigned int)STAKE_SEARCH_CHUNK, nCandidates - nOffset);
+                        settings.nSearchInterval = nSearchInterval;
+                        vSearch.push_back(CStakeKernelSearch(pwallet.get(), pcandidates, settings, nChunk++, &result));
+                    }
+                }
 
-        auto_ptr<CBlock> pblock(CreateNewBlock(pwallet, true));
-        if (!pblock.get())
-            return;
-        IncrementExtraNonce(pblock.get(), pindexPrev, nExtraNonce);
+                // The queue is a stack, so queue the first chunks last
+                reverse(vSearch.begin(), vSearch.end());
+                nSearchStart = GetTimeMicros();
+                CCheckQueueControl<CStakeKernelSearch> control(&queue);
+                control.Add(vSearch);
+                control.Wait();
+            }
+            nLastCoinStakeSearchInterval = nSearchInterval;
+            nLastCoinStakeSearchTime = nSearchTime;
+
+            {
+                LOCK(cs_StakeMinerStats);
+                int64_t nElapsed = GetTimeMicros() - nSearchStart;
+                stakeMinerStats.nSearches++;
+                stakeMinerStats.nKernelsChecked += result.nKernelsChecked;
+                stakeMinerStats.nSearchTime += nElapsed;
+                stakeMinerStats.nLastCoins = nCoins;
+                stakeMinerStats.nLastKernelsChecked = result.nKernelsChecked;
+                stakeMinerStats.nLastSearchTime = nElapsed;
+                if (result.fFound)
+                    stakeMinerStats.nKernelsFound++;
+            }
+
+            //
+            // Sign with the wallet owning the kernel
+            //
+            if (result.fFound)
+            {
+                CWallet* pwallet = result.pwallet;
+                LogPrint("coinstake", "StakeMiner : kernel found for wallet %s\n", pwallet->strWalletFile);
+
+                auto_ptr<CBlock> pblock(new CBlock(*pblockTemplate));
+                IncrementExtraNonce(pblock.get(), pindexTemplate, nExtraNonce);
+
+                CKey key;
+                CTransaction txCoinStake;
+                if (pwallet->CreateCoinStakeFromKernel(*pwallet, pblock->nBits, result.kernelcoin, result.nTimeTx, result.nBlockTime, txCoinStake, key) &&
+                    pblock->SignPoSBlock(txCoinStake, key))
+                {
+                    SetThreadPriority(THREAD_PRIORITY_NORMAL);
+                    if (CheckStake(pblock.get(), *pwallet))
+                    {
+                        LOCK(cs_StakeMinerStats);
+                        stakeMinerStats.nBlocksAccepted++;
+                    }
+                    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                }
+            }
+
+            BOOST_FOREACH(const boost::shared_ptr<CWallet>& pwallet, vpwallets)
+                pwallet->WriteStakeCache();
 
-        // Trying to sign a block
-        if (pblock->SignPoSBlock(*pwallet))
+            fWoken = WaitForStakeTick();
+        }
+    }
+    catch (...)
+    {
         {
-            SetThreadPriority(THREAD_PRIORITY_NORMAL);
-            CheckStake(pblock.get(), *pwallet);
-            SetThreadPriority(THREAD_PRIORITY_LOWEST);
-            MilliSleep(30000);
+            LOCK(cs_StakeMiner);
+            fStakeMinerRunning = false;
         }
-        else
-            MilliSleep(nMinerSleep);
+        queue.Quit();
+        threadGroup.join_all();
+        throw;
     }
-}
-
-
 
+    queue.Quit();
+    threadGroup.join_all();
+}
@@ -8,9 +8,17 @@
 #ifndef MINER_H
 #define MINER_H
 
+#include "kernel.h"
 #include "main.h"
 #include "wallet.h"
 
+template<typename T> class CCheckQueue;
+
+// Threads searching for a stake kernel, the stake miner thread included
+extern int nStakeSearchThreads;
+static const int DEFAULT_STAKE_SEARCH_THREADS = 2;
+static const int MAX_STAKE_SEARCH_THREADS = 64;
+
 /** Generate a new block, without valid proof-of-work */
 CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake=false);
 
@@ -26,6 +34,90 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 /** Check mined proof-of-stake block */
 bool CheckStake(CBlock* pblock, CWallet& wallet);
 
+/** Have the stake miner search again without waiting for the next second */
+void WakeStakeMiner();
+
+/** Counters of the stake miner since startup */
+struct CStakeMinerStats
+{
+    uint64_t nSearches;             // kernel searches over all wallets
+    uint64_t nKernelsChecked;       // kernel hashes checked by them
+    int64_t nSearchTime;            // microseconds they took
+    unsigned int nLastCoins;        // staking coins in the last search
+    uint64_t nLastKernelsChecked;   // kernel hashes checked by the last search
+    int64_t nLastSearchTime;        // microseconds the last search took
+    uint64_t nKernelsFound;
+    uint64_t nBlocksAccepted;       // staked blocks CheckStake accepted
+
+    CStakeMinerStats() : nSearches(0), nKernelsChecked(0), nSearchTime(0), nLastCoins(0),
+        nLastKernelsChecked(0), nLastSearchTime(0), nKernelsFound(0), nBlocksAccepted(0) { }
+};
+
+CStakeMinerStats GetStakeMinerStats();
+
+/** Where the merged kernel search found a kernel */
+struct CStakeSearchResult
+{
+    CCriticalSection cs;
+    bool fFound;
+    unsigned int nChunk;
+    CWallet* pwallet;
+    CoinsSet::value_type kernelcoin;
+    unsigned int nTimeTx;
+    unsigned int nBlockTime;
+
+    uint64_t nKernelsChecked;
+
+    // The search is for a block on pindexPrev. fAbort is read by every
+    // chunk without a lock and set once a kernel is found or the best
+    // chain moved on.
+    const CBlockIndex* pindexPrev;
+    volatile bool fAbort;
+
+    CStakeSearchResult() : fFound(false), nChunk(0), pwallet(NULL), nTimeTx(0), nBlockTime(0), nKernelsChecked(0),
+        pindexPrev(NULL), fAbort(false) { }
+};
+
+/** One chunk of a wallet's staking coins, scanned on the stake search queue.
+ * Every chunk of a wallet scans the same snapshot of its candidates, so the
+ * wallet can publish new ones while the search runs. Returns false once it
+ * finds a kernel, which makes the queue skip every chunk not yet started
+ * and the chunks running stop early.
+ */
+class CStakeKernelSearch
+{
+private:
+    CWallet* pwallet;
+    StakeCandidatesPtr pcandidates;
+    KernelSearchSettings settings;
+    unsigned int nChunk;
+    CStakeSearchResult* presult;
+
+public:
+    CStakeKernelSearch() : pwallet(NULL), nChunk(0), presult(NULL) { memset(&settings, 0, sizeof(settings)); }
+    CStakeKernelSearch(CWallet* pwalletIn, const StakeCandidatesPtr& pcandidatesIn, const KernelSearchSettings& settingsIn, unsigned int nChunkIn, CStakeSearchResult* presultIn) :
+        pwallet(pwalletIn), pcandidates(pcandidatesIn), settings(settingsIn), nChunk(nChunkIn), presult(presultIn) { }
+
+    bool operator()();
+
+    void swap(CStakeKernelSearch& check)
+    {
+        std::swap(pwallet, check.pwallet);
+        pcandidates.swap(check.pcandidates);
+        std::swap(settings, check.settings);
+        std::swap(nChunk, check.nChunk);
+        std::swap(presult, check.presult);
+    }
+};
+
+/** Staking coins handed to a search queue worker at a time */
+static const unsigned int STAKE_SEARCH_CHUNK = 256;
+
+/** Worker of the stake search queue. Workers take chunks off the shared
+ * queue as they finish their own, so a slow chunk never holds up the rest.
+ */
+void ThreadStakeSearch(CCheckQueue<CStakeKernelSearch>* pqueue);
+
 /** Base sha256 mining transform */
 void SHA256Transform(void* pstate, void* pinput, const void* pinit);
 
@@ -1423,12 +1423,11 @@ void static ProcessOneShot()
 
 void ThreadStakeMinter(void* parg)
 {
-    CWallet* pwallet = (CWallet*)parg;
-    LogPrintf("ThreadStakeMinter started for wallet: %s\n", pwallet->strWalletFile );
+    LogPrintf("ThreadStakeMinter started\n");
     try
     {
         vnThreadsRunning[THREAD_MINTER]++;
-        StakeMiner(pwallet);
+        pWalletManager->StakeMiner();
         vnThreadsRunning[THREAD_MINTER]--;
     }
     catch (std::exception& e) {
@@ -1774,6 +1773,10 @@ void ThreadMessageHandler2(void* parg)
         if (!fHaveSyncNode)
             StartSync(vNodesCopy);
 
+        // Get the checks of newly received blocks going before any of
+        // them is connected
+        CheckBlockMessages(vNodesCopy);
+
         // Poll the connected nodes for messages
         CNode* pnodeTrickle = NULL;
         if (!vNodesCopy.empty())
@@ -2042,14 +2045,14 @@ void StartNode(void* parg)
         LogPrintf("Error; NewThread(ThreadDumpAddress) failed\n");
 
     // ppcoin: mint proof-of-stake blocks in the background
-    // hbn: each wallet gets its own thread.
+    // hbn: one thread stakes for all wallets.
     // staking argument applies to all wallets
 
     bool fStaking = GetBoolArg("-staking",true);
 
     if (fStaking) {
        fStopStaking = false;
-       pWalletManager->RestartStakeMiner();
+       pWalletManager->StartStakeMiner();
     }
     else {
        fStopStaking = true;
@@ -2066,6 +2069,7 @@ bool StopNode()
     {
        LOCK(cs_main);
        ThreadScriptCheckQuit();
+       ThreadBlockCheckQuit();
     }
     if (semOutbound)
         for (int i=0; i<MAX_OUTBOUND_CONNECTIONS; i++)
@@ -2094,7 +2098,10 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) LogPrintf("ThreadDumpAddresses still running\n");
     if (vnThreadsRunning[THREAD_MINTER] > 0) LogPrintf("ThreadStakeMinter still running\n");
     if (vnThreadsRunning[THREAD_SCRIPTCHECK] > 0) LogPrintf("ThreadScriptCheck still running\n");
-    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0 || vnThreadsRunning[THREAD_SCRIPTCHECK] > 0)
+    if (vnThreadsRunning[THREAD_BLOCKCHECK] > 0) LogPrintf("ThreadBlockCheck still running\n");
+    if (vnThreadsRunning[THREAD_BLOCKINDEXSNAPSHOT] > 0) LogPrintf("ThreadBlockIndexSnapshot still running\n");
+    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0 || vnThreadsRunning[THREAD_SCRIPTCHECK] > 0 || vnThreadsRunning[THREAD_BLOCKCHECK] > 0 ||
+           vnThreadsRunning[THREAD_BLOCKINDEXSNAPSHOT] > 0)
         MilliSleep(20);
     MilliSleep(50);
     DumpAddresses();
@@ -8,6 +8,7 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 #include <openssl/rand.h>
 
@@ -25,6 +26,7 @@
 class CRequestTracker;
 class CNode;
 class CBlockIndex;
+class CBlockPrecheck;
 
 
 /** Time between pings automatically sent out for latency probing and keepalive (in seconds). */
@@ -129,6 +131,8 @@ enum threadId
     THREAD_RPCHANDLER,
     THREAD_MINTER,
     THREAD_SCRIPTCHECK,
+    THREAD_BLOCKCHECK,
+    THREAD_BLOCKINDEXSNAPSHOT,
 
     THREAD_MAX
 };
@@ -191,6 +195,8 @@ public:
 
     int64_t nTime; // time (in microseconds) of message receipt.
 
+    boost::shared_ptr<CBlockPrecheck> pprecheck; // block read ahead of processing
+
     CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
         in_data = false;
@@ -28,9 +28,10 @@ std::string getBlockHash(qint64 Height)
     if (desiredheight < 0 || desiredheight > nBestHeight)
         return 0;
 
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > desiredheight)
-        pblockindex = pblockindex->pprev;
+    LOCK(cs_main);
+    CBlockIndex* pblockindex = FindBlockByHeight(desiredheight);
+    if (pblockindex == NULL)
+        return "";
     return  pblockindex->GetBlockHash().GetHex(); // pblockindex->phashBlock->GetHex();
 }
 
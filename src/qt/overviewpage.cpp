@@ -178,6 +178,13 @@ void OverviewPage::setNumTransactions(int count)
 {
     ui->labelNumTransactions->setText(QLocale::system().toString(count));
 }
+void OverviewPage::setStakingInfo(int coins, qint64 kernelsPerSecond, int expectedTime)
+{
+    ui->labelStakingCoins->setText(QLocale::system().toString(coins));
+    ui->labelKernelSearch->setText(tr("%1 hashes/s").arg(QLocale::system().toString(kernelsPerSecond)));
+    ui->labelExpectedStake->setText(expectedTime < 0 ? tr("not staking") : GUIUtil::formatDurationStr(expectedTime));
+}
+
 void OverviewPage::setClientModel(ClientModel *model)
 {
     this->clientModel = model;
@@ -212,6 +219,8 @@ void OverviewPage::setWalletModel(WalletModel *model)
         setNumTransactions(model->getNumTransactions());
         connect(model, SIGNAL(numTransactionsChanged(int)), this, SLOT(setNumTransactions(int)));
 
+        connect(model, SIGNAL(stakingInfoChanged(int, qint64, int)), this, SLOT(setStakingInfo(int, qint64, int)));
+
         connect(model->getOptionsModel(), SIGNAL(displayUnitChanged(int)), this, SLOT(updateDisplayUnit()));
     }
 
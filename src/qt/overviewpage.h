@@ -32,6 +32,7 @@ public slots:
     void setBalance(qint64 balance, qint64 watchOnly, qint64 stake, qint64 unconfirmedBalance, qint64 immatureBalance);
     void setTotBalance(qint64 totBalance);
     void setNumTransactions(int count);
+    void setStakingInfo(int coins, qint64 kernelsPerSecond, int expectedTime);
 
 signals:
     void transactionClicked(const QModelIndex &index);
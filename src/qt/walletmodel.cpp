@@ -8,6 +8,8 @@
 #include "wallet.h"
 #include "walletdb.h" // for BackupWallet
 #include "base58.h"
+#include "bitcoinrpc.h"
+#include "miner.h"
 
 #include <QSet>
 #include <QTimer>
@@ -20,7 +22,8 @@ WalletModel::WalletModel(CWallet *wallet, OptionsModel *optionsModel, QObject *p
     cachedBalance(0), cachedWatchOnlyBalance(0), cachedStake(0), cachedUnconfirmedBalance(0), cachedImmatureBalance(0),
     cachedNumTransactions(0),
     cachedEncryptionStatus(Unencrypted),
-    cachedNumBlocks(0)
+    cachedNumBlocks(0),
+    cachedStakingCoins(-1), cachedKernelsPerSecond(-1), cachedExpectedStakeTime(-1)
 {
     addressTableModel = new AddressTableModel(wallet, this);
     transactionTableModel = new TransactionTableModel(wallet, this);
@@ -113,7 +116,8 @@ void WalletModel::pollBalanceChanged()
     if(!lockWallet)
         return;
 
-    if(nBestHeight != cachedNumBlocks)
+    bool fNewBlock = nBestHeight != cachedNumBlocks;
+    if(fNewBlock)
     {
          // Balance and number of transactions might have changed
          cachedNumBlocks = nBestHeight;
@@ -121,6 +125,34 @@ void WalletModel::pollBalanceChanged()
          if(transactionTableModel)
              transactionTableModel->updateConfirmations();
     }
+    checkStakingInfoChanged(fNewBlock);
+}
+
+void WalletModel::checkStakingInfoChanged(bool fNewBlock)
+{
+    int newStakingCoins = wallet->GetStakeCandidateCount();
+
+    CStakeMinerStats stats = GetStakeMinerStats();
+    qint64 newKernelsPerSecond = stats.nLastSearchTime ? stats.nLastKernelsChecked * 1000000 / stats.nLastSearchTime : 0;
+
+    // The weights only change with the chain
+    int newExpectedStakeTime = cachedExpectedStakeTime;
+    if(fNewBlock)
+    {
+        uint64_t nMinWeight = 0, nMaxWeight = 0, nWeight = 0;
+        wallet->GetStakeWeight(*wallet, nMinWeight, nMaxWeight, nWeight);
+        uint64_t nNetworkWeight = GetPoSKernelPS();
+        newExpectedStakeTime = (nLastCoinStakeSearchInterval && nWeight) ? (int)(GetTargetSpacing() * nNetworkWeight / nWeight) : -1;
+    }
+
+    if(cachedStakingCoins != newStakingCoins || cachedKernelsPerSecond != newKernelsPerSecond
+       || cachedExpectedStakeTime != newExpectedStakeTime)
+    {
+        cachedStakingCoins = newStakingCoins;
+        cachedKernelsPerSecond = newKernelsPerSecond;
+        cachedExpectedStakeTime = newExpectedStakeTime;
+        emit stakingInfoChanged(newStakingCoins, newKernelsPerSecond, newExpectedStakeTime);
+    }
 }
 
 void WalletModel::checkBalanceChanged()
@@ -346,8 +378,8 @@ bool WalletModel::setWalletLocked(bool locked, const SecureString &passPhrase, b
         rc = wallet->Unlock(passPhrase);
         if (rc && formint)
         {
-            if (!NewThread(ThreadStakeMinter, wallet))
-                qDebug() << "setWalletLocked Error: NewThread(ThreadStakeMinter) failed\n";
+            if (!pWalletManager->StartStakeMiner())
+                qDebug() << "setWalletLocked Error: could not start the stake miner";
             else
                 wallet->fWalletUnlockMintOnly=true;
         }
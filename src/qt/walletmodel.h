@@ -182,12 +182,16 @@ private:
     qint64 cachedNumTransactions;
     EncryptionStatus cachedEncryptionStatus;
     int cachedNumBlocks;
+    int cachedStakingCoins;
+    qint64 cachedKernelsPerSecond;
+    int cachedExpectedStakeTime;
 
     QTimer *pollTimer;
 
     void subscribeToCoreSignals();
     void unsubscribeFromCoreSignals();
     void checkBalanceChanged();
+    void checkStakingInfoChanged(bool fNewBlock);
 
 
 public slots:
@@ -208,6 +212,10 @@ signals:
     // Number of transactions in wallet changed
     void numTransactionsChanged(int count);
 
+    // Staking coins, kernel search speed or expected time to stake changed;
+    // expectedTime is -1 when not staking
+    void stakingInfoChanged(int coins, qint64 kernelsPerSecond, int expectedTime);
+
     // Encryption status of wallet changed
     void encryptionStatusChanged(int status);
 
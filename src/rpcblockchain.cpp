@@ -174,6 +174,54 @@ Value getblockcount(CWallet* pWallet, const Array& params, bool fHelp)
     return nBestHeight;
 }
 
+Value getmemoryinfo(CWallet* pWallet, const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmemoryinfo\n"
+            "Returns an object containing information about memory usage of the block index,\n"
+            "the coin age cache and the signature cache.");
+
+    size_t nEntries, nSlots, nSlabBytes;
+    CBlockIndexArena::GetStats(nEntries, nSlots, nSlabBytes);
+
+    // What the same entries would take as individual heap allocations, each
+    // with a size word in front and rounded up to 16 bytes
+    size_t nHeapEntry = (sizeof(CBlockIndex) + sizeof(size_t) + 15) & ~(size_t)15;
+
+    Object blockindex;
+    blockindex.push_back(Pair("entries",      (boost::uint64_t)nEntries));
+    blockindex.push_back(Pair("entrysize",    (int)sizeof(CBlockIndex)));
+    blockindex.push_back(Pair("slots",        (boost::uint64_t)nSlots));
+    blockindex.push_back(Pair("arenabytes",   (boost::uint64_t)nSlabBytes));
+    blockindex.push_back(Pair("heapbytes",    (boost::uint64_t)(nEntries * nHeapEntry)));
+    blockindex.push_back(Pair("saved",        (boost::int64_t)(nEntries * nHeapEntry) - (boost::int64_t)nSlabBytes));
+
+    uint64_t nHits, nMisses;
+    coinAgeCache.GetStats(nHits, nMisses);
+
+    Object coinage;
+    coinage.push_back(Pair("entries",       (int)coinAgeCache.size()));
+    coinage.push_back(Pair("hits",          (boost::uint64_t)nHits));
+    coinage.push_back(Pair("misses",        (boost::uint64_t)nMisses));
+
+    unsigned int nSigEntries, nSigCapacity;
+    uint64_t nSigHits, nSigMisses;
+    GetSignatureCacheStats(nSigEntries, nSigCapacity, nSigHits, nSigMisses);
+
+    Object sigcache;
+    sigcache.push_back(Pair("entries",      (int)nSigEntries));
+    sigcache.push_back(Pair("capacity",     (int)nSigCapacity));
+    sigcache.push_back(Pair("hits",         (boost::uint64_t)nSigHits));
+    sigcache.push_back(Pair("misses",       (boost::uint64_t)nSigMisses));
+
+    Object obj;
+    obj.push_back(Pair("blockindex", blockindex));
+    obj.push_back(Pair("coinagecache", coinage));
+    obj.push_back(Pair("sigcache", sigcache));
+    return obj;
+}
+
 Value getdifficulty(CWallet* pWallet, const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -269,13 +317,7 @@ Value getblockbynumber(CWallet* pWallet, const Array& params, bool fHelp)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    uint256 hash = *pblockindex->phashBlock;
-
-    pblockindex = mapBlockIndex[hash];
+    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
@@ -9,6 +9,7 @@
 #include "init.h"
 #include "bitcoinrpc.h"
 #include "miner.h"
+#include "kernel.h"
 
 using namespace json_spirit;
 using namespace std;
@@ -33,7 +34,7 @@ Value getmininginfo(CWallet* pWallet, const Array& params, bool fHelp)
     uint64_t nMinWeight = 0, nMaxWeight = 0, nWeight = 0;
     pWallet->GetStakeWeight(*pWallet, nMinWeight, nMaxWeight, nWeight);
 
-    Object obj, diff, weight;
+    Object obj, diff, weight, stakecheck;
     obj.push_back(Pair("blocks",        (int)nBestHeight));
     obj.push_back(Pair("currentblocksize",(uint64_t)nLastBlockSize));
     obj.push_back(Pair("currentblocktx",(uint64_t)nLastBlockTx));
@@ -53,12 +54,67 @@ Value getmininginfo(CWallet* pWallet, const Array& params, bool fHelp)
     obj.push_back(Pair("stakeweight", weight));
     obj.push_back(Pair("stakeinterest",    (uint64_t)GetProofOfStakeReward(0, GetLastBlockIndex(pindexBest, true)->nBits, GetLastBlockIndex(pindexBest, true)->nTime, true)));
 
+    // Proof-of-stake checks that did without reading a block header
+    uint64_t nIndexed = 0, nHeaderReads = 0;
+    GetProofOfStakeCheckStats(nIndexed, nHeaderReads);
+    stakecheck.push_back(Pair("indexed",     nIndexed));
+    stakecheck.push_back(Pair("headerreads", nHeaderReads));
+    obj.push_back(Pair("stakecheck", stakecheck));
 
     obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
     obj.push_back(Pair("testnet",       fTestNet));
     return obj;
 }
 
+Value getstakinginfo(CWallet* pWallet, const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getstakinginfo\n"
+            "Returns an object containing staking-related information and the\n"
+            "counters of the stake miner. Times are in milliseconds.");
+
+    uint64_t nMinWeight = 0, nMaxWeight = 0, nWeight = 0;
+    pWallet->GetStakeWeight(*pWallet, nMinWeight, nMaxWeight, nWeight);
+
+    uint64_t nNetworkWeight = GetPoSKernelPS();
+    bool fStaking = nLastCoinStakeSearchInterval && nWeight;
+    int nExpectedTime = fStaking ? (GetTargetSpacing() * nNetworkWeight / nWeight) : -1;
+
+    Object obj, wallet, miner;
+    obj.push_back(Pair("enabled",       !fStopStaking));
+    obj.push_back(Pair("staking",       fStaking));
+    obj.push_back(Pair("errors",        GetWarnings("statusbar")));
+    obj.push_back(Pair("difficulty",    GetDifficulty(GetLastBlockIndex(pindexBest, true))));
+    obj.push_back(Pair("search-interval", (int)nLastCoinStakeSearchInterval));
+    obj.push_back(Pair("weight",        (uint64_t)nWeight));
+    obj.push_back(Pair("netstakeweight", (uint64_t)nNetworkWeight));
+    obj.push_back(Pair("expectedtime",  nExpectedTime));
+
+    {
+        LOCK(pWallet->cs_wallet);
+        wallet.push_back(Pair("stakingcoins",   (int)pWallet->GetStakeCandidateCount()));
+        wallet.push_back(Pair("memoryusage",    (uint64_t)pWallet->GetStakeCandidateMemoryUsage()));
+        wallet.push_back(Pair("loadtime",       pWallet->GetStakeCandidateLoadTime() / 1000.0));
+        wallet.push_back(Pair("updatetime",     pWallet->GetStakeCandidateUpdateTime() / 1000.0));
+    }
+    obj.push_back(Pair("wallet", wallet));
+
+    CStakeMinerStats stats = GetStakeMinerStats();
+    miner.push_back(Pair("threads",         nStakeSearchThreads));
+    miner.push_back(Pair("searches",        stats.nSearches));
+    miner.push_back(Pair("kernelschecked",  stats.nKernelsChecked));
+    miner.push_back(Pair("searchtime",      stats.nSearchTime / 1000.0));
+    miner.push_back(Pair("kernelspersecond", stats.nSearchTime ? stats.nKernelsChecked * 1000000.0 / stats.nSearchTime : 0.0));
+    miner.push_back(Pair("lastsearchcoins", (int)stats.nLastCoins));
+    miner.push_back(Pair("lastsearchtime",  stats.nLastSearchTime / 1000.0));
+    miner.push_back(Pair("lastkernelspersecond", stats.nLastSearchTime ? stats.nLastKernelsChecked * 1000000.0 / stats.nLastSearchTime : 0.0));
+    miner.push_back(Pair("kernelsfound",    stats.nKernelsFound));
+    miner.push_back(Pair("blocksaccepted",  stats.nBlocksAccepted));
+    obj.push_back(Pair("stakeminer", miner));
+    return obj;
+}
+
 Value getworkex(CWallet* pWallet, const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 2)
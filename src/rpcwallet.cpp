@@ -1516,7 +1516,7 @@ Value gettransaction(CWallet* pWallet, const Array& params, bool fHelp)
             else
             {
                 entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+                BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
                 if (mi != mapBlockIndex.end() && (*mi).second)
                 {
                     CBlockIndex* pindex = (*mi).second;
@@ -1667,8 +1667,7 @@ Value walletpassphrase(CWallet* pWallet, const Array& params, bool fHelp)
 
     pWallet->TimedLock(nUnlockTime);
 
-    if (!NewThread(ThreadStakeMinter, pWallet))
-       LogPrintf("Error: NewThread(ThreadStakeMinter) failed\n");
+    pWalletManager->StartStakeMiner();
 
     return Value::null;
 }
@@ -2217,12 +2216,7 @@ Value loadwallet(CWallet* pWallet, const Array& params, bool fHelp)
     pWallet = spWallet.get();
 
     if ( !pWallet->IsCrypted() )
-    {
-       if (!NewThread(ThreadStakeMinter, pWallet))
-          LogPrintf("Error: NewThread(ThreadStakeMinter) failed\n");
-    }
-    else
-      LogPrintf("Skipped ThreadStakeMinter for wallet: %s due to encryption\n", pWallet->strWalletFile);
+       pWalletManager->StartStakeMiner();
 
     return string("Wallet ") + strWalletName + " loaded.";
 }
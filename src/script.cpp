@@ -3,8 +3,6 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 using namespace std;
 using namespace boost;
@@ -12,12 +10,13 @@ using namespace boost;
 #include "script.h"
 #include "keystore.h"
 #include "bignum.h"
+#include "ecverify.h"
 #include "key.h"
 #include "main.h"
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashCache* psighashcache=NULL);
 
 static const valtype vchFalse(0);
 static const valtype vchZero(0);
@@ -328,7 +327,7 @@ bool IsCanonicalSignature(const valtype &vchSig, unsigned int flags) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache* psighashcache)
 {
     CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
@@ -875,7 +874,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     scriptCode.FindAndDelete(CScript(vchSig));
 
                     bool fSuccess = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
-                       CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                       CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighashcache);
 
                     popstack(stack);
                     popstack(stack);
@@ -936,7 +935,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                         // Check signature
                         bool fOk = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
-                           CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                           CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighashcache);
 
                         if (fOk) {
                             isig++;
@@ -1069,72 +1068,160 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
     return Hash(ss.begin(), ss.end());
 }
 
-
-// Valid signature cache, to avoid doing expensive ECDSA signature checking
-// twice for every transaction (once when accepted into memory pool, and
-// again when accepted into the block chain)
-
-class CSignatureCache
+CSignatureHashCache::CSignatureHashCache(const CTransaction& txTo)
 {
-private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey > sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
-
-public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTo.nVersion << txTo.nTime;
+    WriteCompactSize(ss, txTo.vin.size());
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, &ss[0], ss.size());
+
+    CDataStream ssTail(SER_GETHASH, 0);
+    ssTail.reserve(txTo.vin.size() * BLANK_TXIN_SIZE + 1000);
+    vMidstate.reserve(txTo.vin.size());
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        vMidstate.push_back(ctx);
+        unsigned int nPos = ssTail.size();
+        ssTail << txin.prevout << CScript() << txin.nSequence;
+        assert(ssTail.size() - nPos == BLANK_TXIN_SIZE);
+        SHA256_Update(&ctx, &ssTail[nPos], BLANK_TXIN_SIZE);
+    }
+    ssTail << txTo.vout << txTo.nLockTime;
+    vchTail.assign(ssTail.begin(), ssTail.end());
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+bool CSignatureHashCache::GetHash(CScript scriptCode, unsigned int nIn, int nHashType, uint256& hashRet) const
+{
+    if (nIn >= vMidstate.size())
+        return false;
+    if ((nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE || (nHashType & SIGHASH_ANYONECANPAY))
         return false;
-    }
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    // Input nIn with scriptCode in place of its empty script
+    const unsigned char* pin = &vchTail[nIn * BLANK_TXIN_SIZE];
+    CDataStream ss(SER_GETHASH, 0);
+    ss.reserve(scriptCode.size() + 100);
+    ss.write((const char*)pin, 36);
+    ss << scriptCode;
+    ss.write((const char*)pin + 37, 4);
+
+    SHA256_CTX ctx = vMidstate[nIn];
+    SHA256_Update(&ctx, &ss[0], ss.size());
+    SHA256_Update(&ctx, pin + BLANK_TXIN_SIZE, vchTail.size() - (nIn + 1) * BLANK_TXIN_SIZE);
+    ss.clear();
+    ss << nHashType;
+    SHA256_Update(&ctx, &ss[0], ss.size());
+
+    uint256 hash1;
+    SHA256_Final((unsigned char*)&hash1, &ctx);
+    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hashRet);
+    return true;
+}
+
+
+CSignatureCache::CSignatureCache(unsigned int nMaxEntries)
+{
+    nSalt = GetRandHash();
+    nBuckets = (nMaxEntries + SIGCACHE_SHARDS * SIGCACHE_WAYS - 1) / (SIGCACHE_SHARDS * SIGCACHE_WAYS);
+    for (unsigned int i = 0; i < SIGCACHE_SHARDS; i++)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        shards[i].vSlots.resize(nBuckets * SIGCACHE_WAYS);
+        shards[i].nEntries = 0;
+        shards[i].nHits = 0;
+        shards[i].nMisses = 0;
+    }
+}
 
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+uint256 CSignatureCache::GetEntry(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << nSalt << hash << vchSig << pubKey;
+    return ss.GetHash();
+}
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+bool CSignatureCache::Get(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+{
+    uint256 entry = GetEntry(hash, vchSig, pubKey);
+    CShard& shard = shards[entry.Get64(0) % SIGCACHE_SHARDS];
+    boost::mutex::scoped_lock lock(shard.cs);
+    if (nBuckets > 0)
+    {
+        const uint256* pslot = &shard.vSlots[(entry.Get64(1) % nBuckets) * SIGCACHE_WAYS];
+        for (unsigned int i = 0; i < SIGCACHE_WAYS; i++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            if (pslot[i] == entry)
+            {
+                shard.nHits++;
+                return true;
+            }
         }
+    }
+    shard.nMisses++;
+    return false;
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+void CSignatureCache::Set(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+{
+    if (nBuckets == 0)
+        return;
+
+    uint256 entry = GetEntry(hash, vchSig, pubKey);
+    CShard& shard = shards[entry.Get64(0) % SIGCACHE_SHARDS];
+    boost::mutex::scoped_lock lock(shard.cs);
+    uint256* pslot = &shard.vSlots[(entry.Get64(1) % nBuckets) * SIGCACHE_WAYS];
+    for (unsigned int i = 0; i < SIGCACHE_WAYS; i++)
+    {
+        if (pslot[i] == entry)
+            return;
+        if (pslot[i] == 0)
+        {
+            pslot[i] = entry;
+            shard.nEntries++;
+            return;
+        }
     }
-};
+    pslot[entry.Get64(2) % SIGCACHE_WAYS] = entry;
+}
+
+void CSignatureCache::GetStats(unsigned int& nEntries, unsigned int& nCapacity, uint64_t& nHits, uint64_t& nMisses)
+{
+    nEntries = 0;
+    nHits = 0;
+    nMisses = 0;
+    for (unsigned int i = 0; i < SIGCACHE_SHARDS; i++)
+    {
+        boost::mutex::scoped_lock lock(shards[i].cs);
+        nEntries += shards[i].nEntries;
+        nHits += shards[i].nHits;
+        nMisses += shards[i].nMisses;
+    }
+    nCapacity = nBuckets * SIGCACHE_WAYS * SIGCACHE_SHARDS;
+}
+
+// Sized on first use, after the command line was read. Since there are a
+// maximum of 20,000 signature operations per block 50,000 is a reasonable
+// default; each entry takes 32 bytes.
+static CSignatureCache& GetSignatureCache()
+{
+    static CSignatureCache signatureCache(std::max((int)GetArg("-maxsigcachesize", 50000), 0));
+    return signatureCache;
+}
+
+void GetSignatureCacheStats(unsigned int& nEntries, unsigned int& nCapacity, uint64_t& nHits, uint64_t& nMisses)
+{
+    GetSignatureCache().GetStats(nEntries, nCapacity, nHits, nMisses);
+}
 
 bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashCache* psighashcache)
 {
-    static CSignatureCache signatureCache;
+    CSignatureCache& signatureCache = GetSignatureCache();
 
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
-       return false;
-    CPubKey pubkey = key.GetPubKey();
+    CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
        return false;
 
@@ -1147,12 +1234,14 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash;
+    if (psighashcache == NULL || !psighashcache->GetHash(scriptCode, nIn, nHashType, sighash))
+        sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
 
     if (signatureCache.Get(sighash, vchSig, pubkey))
         return true;
 
-    if (!key.Verify(sighash, vchSig))
+    if (!GetSignatureVerifier().Verify(vchPubKey, sighash, vchSig))
         return false;
 
     if (!(flags & SCRIPT_VERIFY_NOCACHE))
@@ -1164,24 +1253,30 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
 //
 // Return public keys or hashes from scriptPubKey, for 'standard' transaction types.
 //
-bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, vector<vector<unsigned char> >& vSolutionsRet)
+static multimap<txnouttype, CScript> SolverTemplates()
 {
-    // Templates
-    static multimap<txnouttype, CScript> mTemplates;
-    if (mTemplates.empty())
-    {
-        // Standard tx, sender provides pubkey, receiver adds signature
-        mTemplates.insert(make_pair(TX_PUBKEY, CScript() << OP_PUBKEY << OP_CHECKSIG));
+    multimap<txnouttype, CScript> mTemplates;
 
-        // Bitcoin address tx, sender provides hash of pubkey, receiver provides signature and pubkey
-        mTemplates.insert(make_pair(TX_PUBKEYHASH, CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG));
+    // Standard tx, sender provides pubkey, receiver adds signature
+    mTemplates.insert(make_pair(TX_PUBKEY, CScript() << OP_PUBKEY << OP_CHECKSIG));
 
-        // Sender provides N pubkeys, receivers provides M signatures
-        mTemplates.insert(make_pair(TX_MULTISIG, CScript() << OP_SMALLINTEGER << OP_PUBKEYS << OP_SMALLINTEGER << OP_CHECKMULTISIG));
+    // Bitcoin address tx, sender provides hash of pubkey, receiver provides signature and pubkey
+    mTemplates.insert(make_pair(TX_PUBKEYHASH, CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG));
 
-        // Empty, provably prunable, data-carrying output
-        mTemplates.insert(make_pair(TX_NULL_DATA, CScript() << OP_RETURN));
-    }
+    // Sender provides N pubkeys, receivers provides M signatures
+    mTemplates.insert(make_pair(TX_MULTISIG, CScript() << OP_SMALLINTEGER << OP_PUBKEYS << OP_SMALLINTEGER << OP_CHECKMULTISIG));
+
+    // Empty, provably prunable, data-carrying output
+    mTemplates.insert(make_pair(TX_NULL_DATA, CScript() << OP_RETURN));
+
+    return mTemplates;
+}
+
+// Built before any thread starts, as the block check threads use Solver too
+static const multimap<txnouttype, CScript> mTemplates = SolverTemplates();
+
+bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, vector<vector<unsigned char> >& vSolutionsRet)
+{
 
     // Shortcut for pay-to-script-hash, which are more constrained than the other types:
     // it is always OP_HASH160 20 [20 byte hash] OP_EQUAL
@@ -1578,16 +1673,16 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+                  unsigned int flags, int nHashType, const CSignatureHashCache* psighashcache)
 {
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, psighashcache))
         return false;
 
     if (flags & SCRIPT_VERIFY_P2SH)
        stackCopy = stack;
 
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, psighashcache))
         return false;
     if (stack.empty())
         return false;
@@ -1610,7 +1705,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, psighashcache))
             return false;
         if (stackCopy.empty())
             return false;
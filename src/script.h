@@ -13,6 +13,8 @@
 
 #include <boost/foreach.hpp>
 
+#include <openssl/sha.h>
+
 #include "keystore.h"
 #include "bignum.h"
 #include "util.h"
@@ -614,8 +616,34 @@ public:
 bool IsCanonicalPubKey(const std::vector<unsigned char> &vchPubKey, unsigned int flags);
 bool IsCanonicalSignature(const std::vector<unsigned char> &vchSig, unsigned int flags);
 
+/** The parts of a transaction's signature hashes shared by its inputs.
+ *
+ * With SIGHASH_ALL the serialization hashed for input i only differs from
+ * the others in the script of that input. The SHA256 state after everything
+ * before input i is kept for each input, and the blanked inputs, outputs and
+ * lock time are serialized once, so an input's hash neither copies nor
+ * serializes the transaction again. Other hash types are left to
+ * SignatureHash.
+ */
+class CSignatureHashCache
+{
+private:
+    // Serialized size of an input with an empty script
+    static const unsigned int BLANK_TXIN_SIZE = 36 + 1 + 4;
+
+    // SHA256 state after the transaction up to input i, other inputs blanked
+    std::vector<SHA256_CTX> vMidstate;
+    // Blanked inputs, outputs and lock time
+    std::vector<unsigned char> vchTail;
+
+public:
+    CSignatureHashCache(const CTransaction& txTo);
+
+    // Returns false if the hash has to come from SignatureHash instead
+    bool GetHash(CScript scriptCode, unsigned int nIn, int nHashType, uint256& hashRet) const;
+};
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache* psighashcache=NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey, txnouttype& whichType);
@@ -626,10 +654,53 @@ bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet)
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache* psighashcache=NULL);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
 CScript CombineSignatures(CScript scriptPubKey, const CTransaction& txTo, unsigned int nIn, const CScript& scriptSig1, const CScript& scriptSig2);
 
+/** Valid signature cache, to avoid doing expensive ECDSA signature checking
+ * twice for every transaction (once when accepted into memory pool, and
+ * again when accepted into the block chain).
+ *
+ * An entry is a salted hash of (signature hash, signature, public key) kept
+ * in a fixed number of slots. The slots are split over shards locked on
+ * their own, each a table of buckets of SIGCACHE_WAYS slots. A full bucket
+ * gives up the slot the salted hash picks, so which signature goes cannot
+ * be foreseen by whoever sends them.
+ */
+class CSignatureCache
+{
+public:
+    static const unsigned int SIGCACHE_SHARDS = 16;
+    static const unsigned int SIGCACHE_WAYS = 4;
+
+private:
+    struct CShard
+    {
+        boost::mutex cs;
+        std::vector<uint256> vSlots;
+        unsigned int nEntries;
+        uint64_t nHits;
+        uint64_t nMisses;
+    };
+
+    CShard shards[SIGCACHE_SHARDS];
+    uint256 nSalt;
+    unsigned int nBuckets;  // per shard
+
+    uint256 GetEntry(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const;
+
+public:
+    CSignatureCache(unsigned int nMaxEntries);
+
+    bool Get(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey);
+    void Set(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey);
+    void GetStats(unsigned int& nEntries, unsigned int& nCapacity, uint64_t& nHits, uint64_t& nMisses);
+};
+
+// Statistics of the signature cache used by CheckSig
+void GetSignatureCacheStats(unsigned int& nEntries, unsigned int& nCapacity, uint64_t& nHits, uint64_t& nMisses);
+
 #endif
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <vector>
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "key.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+// A block CheckBlock turns down: its first transaction is not a coinbase
+static CBlock BadBlock(unsigned int nTime)
+{
+    CBlock block;
+    block.nTime = nTime;
+    block.nBits = 0x1e0fffff;
+    CTransaction tx;
+    tx.nTime = nTime;
+    tx.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+    tx.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+    block.vtx.push_back(tx);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+// A proof-of-stake block on a parent nobody has, signed with key. It
+// passes CheckBlock, so ProcessBlock keeps it as an orphan. vchExtra goes
+// into the coinbase.
+static CBlock OrphanBlock(CKey& key, const vector<unsigned char>& vchExtra = vector<unsigned char>())
+{
+    unsigned int nTime = GetAdjustedTime() - 60;
+    CBlock block;
+    block.hashPrevBlock = GetRandHash();
+    block.nTime = nTime;
+    block.nBits = 0x1c00ffff;
+
+    CTransaction txCoinBase;
+    txCoinBase.nTime = nTime;
+    txCoinBase.vin.push_back(CTxIn());
+    txCoinBase.vin[0].scriptSig << vector<unsigned char>(4, 0x5a) << vchExtra;
+    txCoinBase.vout.push_back(CTxOut());
+    txCoinBase.vout[0].SetEmpty();
+    block.vtx.push_back(txCoinBase);
+
+    CTransaction txCoinStake;
+    txCoinStake.nTime = nTime;
+    txCoinStake.vin.push_back(CTxIn(COutPoint(GetRandHash(), 1)));
+    txCoinStake.vout.push_back(CTxOut());
+    txCoinStake.vout[0].SetEmpty();
+    txCoinStake.vout.push_back(CTxOut(100 * COIN, CScript() << key.GetPubKey() << OP_CHECKSIG));
+    block.vtx.push_back(txCoinStake);
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    key.Sign(block.GetHash(), block.vchBlockSig);
+    return block;
+}
+
+// A proof-of-stake block that CheckBlock turns down for a transaction with
+// an output below the minimum, which CheckTransaction scores 100
+static CBlock BadTxBlock(CKey& key)
+{
+    CBlock block = OrphanBlock(key);
+    CTransaction tx;
+    tx.nTime = block.nTime;
+    tx.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+    tx.vout.push_back(CTxOut(-1, CScript() << OP_TRUE));
+    block.vtx.push_back(tx);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    key.Sign(block.GetHash(), block.vchBlockSig);
+    return block;
+}
+
+// Writes the blocks the way they are laid out in a block file and rewinds
+static FILE* BlockFile(const vector<CBlock>& vBlocks)
+{
+    FILE* file = tmpfile();
+    BOOST_FOREACH(const CBlock& block, vBlocks)
+    {
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << FLATDATA(pchMessageStart) << (unsigned int)::GetSerializeSize(block, SER_DISK, CLIENT_VERSION) << block;
+        fwrite(&ss[0], 1, ss.size(), file);
+    }
+    rewind(file);
+    return file;
+}
+
+// Queues a message in node as if it came off the network, the last nCut
+// bytes still to come
+static void ReceiveMessage(CNode& node, const char* pszCommand, const CDataStream& ssData, unsigned int nCut = 0)
+{
+    CMessageHeader hdr(pszCommand, ssData.size());
+    uint256 hash = Hash(ssData.begin(), ssData.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    vector<char> vchData(ssData.begin(), ssData.end());
+    LOCK(node.cs_vRecvMsg);
+    BOOST_CHECK(node.ReceiveMsgBytes(&ss[0], ss.size()));
+    BOOST_CHECK(node.ReceiveMsgBytes(&vchData[0], vchData.size() - nCut));
+}
+
+static void ReceiveBlock(CNode& node, const CBlock& block, unsigned int nCut = 0)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    ReceiveMessage(node, "block", ss, nCut);
+}
+
+BOOST_AUTO_TEST_SUITE(blockcheck_tests)
+
+BOOST_AUTO_TEST_CASE(blockcheck_checked)
+{
+    CBlock block = BadBlock(GetAdjustedTime());
+    BOOST_CHECK(!block.fChecked);
+    BOOST_CHECK(!block.CheckBlock());
+
+    // A block passed on a block check thread is not checked in full again
+    block.fChecked = true;
+    BOOST_CHECK(block.CheckBlock());
+    BOOST_CHECK(block.CheckBlock(false, false, false));
+
+    // but its time is
+    CBlock blockLate = BadBlock(GetAdjustedTime() + 24 * 60 * 60);
+    blockLate.fChecked = true;
+    BOOST_CHECK(!blockLate.CheckBlock());
+
+    // Reading a block and SetNull clear it
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    ss >> block;
+    BOOST_CHECK(!block.fChecked);
+    block.fChecked = true;
+    block.SetNull();
+    BOOST_CHECK(!block.fChecked);
+}
+
+// A block that is not accepted, for having been read before or for failing
+// its checks, does not make the import read and check the blocks after it
+// again, unless its bytes hold another message start
+BOOST_AUTO_TEST_CASE(blockcheck_import)
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    vector<CBlock> vBlocks;
+    vBlocks.push_back(OrphanBlock(key));
+    vBlocks.push_back(vBlocks.back());
+    vBlocks.push_back(BadBlock(GetAdjustedTime()));
+    vBlocks.push_back(OrphanBlock(key));
+    vBlocks.push_back(OrphanBlock(key));
+
+    size_t nOrphans = mapOrphanBlocks.size();
+    uint64_t nChecks = GetBlockCheckCount();
+    BOOST_CHECK(LoadExternalBlockFile(BlockFile(vBlocks)));
+    BOOST_CHECK_EQUAL(mapOrphanBlocks.size(), nOrphans + 3);
+    BOOST_CHECK_EQUAL(GetBlockCheckCount(), nChecks + vBlocks.size());
+    BOOST_CHECK(mapOrphanBlocks.count(vBlocks[0].GetHash()));
+    BOOST_CHECK(mapOrphanBlocks.count(vBlocks[3].GetHash()));
+    BOOST_CHECK(mapOrphanBlocks.count(vBlocks[4].GetHash()));
+
+    // A message start followed by a size that cannot be read, inside a
+    // block read twice. Scanning from the second copy stops there and
+    // then finds the two blocks after it again.
+    vector<unsigned char> vchHidden(pchMessageStart, pchMessageStart + 4);
+    vchHidden.insert(vchHidden.end(), 4, 0xff);
+    vBlocks.clear();
+    vBlocks.push_back(OrphanBlock(key, vchHidden));
+    vBlocks.push_back(vBlocks.back());
+    vBlocks.push_back(OrphanBlock(key));
+    vBlocks.push_back(OrphanBlock(key));
+
+    nOrphans = mapOrphanBlocks.size();
+    nChecks = GetBlockCheckCount();
+    BOOST_CHECK(LoadExternalBlockFile(BlockFile(vBlocks)));
+    BOOST_CHECK_EQUAL(mapOrphanBlocks.size(), nOrphans + 3);
+    // With no block check threads running, a block is checked when it is
+    // connected, so the two blocks dropped and read again are checked once
+    BOOST_CHECK_EQUAL(GetBlockCheckCount(), nChecks + vBlocks.size());
+
+    // Nothing new in a file read before
+    nOrphans = mapOrphanBlocks.size();
+    BOOST_CHECK(!LoadExternalBlockFile(BlockFile(vBlocks)));
+    BOOST_CHECK_EQUAL(mapOrphanBlocks.size(), nOrphans);
+}
+
+// Complete block messages waiting in the queues of any of the peers are
+// read and queued for checking once; other messages, unreadable blocks and
+// a block still coming in are left alone
+BOOST_AUTO_TEST_CASE(blockcheck_messages)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CBlock blockGood = OrphanBlock(key);
+    CBlock blockBad = BadTxBlock(key);
+    CBlock blockLast = OrphanBlock(key);
+    CBlock blockOther = OrphanBlock(key);
+
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", GetDefaultPort())), "", true);
+    ReceiveBlock(node, blockGood);
+    CDataStream ssPing(SER_NETWORK, PROTOCOL_VERSION);
+    ssPing << (uint64_t)1;
+    ReceiveMessage(node, "ping", ssPing);
+    ReceiveBlock(node, blockBad);
+    CDataStream ssJunk(SER_NETWORK, PROTOCOL_VERSION);
+    ssJunk << (uint64_t)1;
+    ReceiveMessage(node, "block", ssJunk);
+    ReceiveBlock(node, blockLast, 10);
+
+    CNode nodeOther(INVALID_SOCKET, CAddress(CService("127.0.0.2", GetDefaultPort())), "", true);
+    ReceiveBlock(nodeOther, blockOther);
+
+    vector<CNode*> vNodes;
+    vNodes.push_back(&node);
+    vNodes.push_back(&nodeOther);
+    CheckBlockMessages(vNodes);
+    BOOST_REQUIRE(node.vRecvMsg.size() == 5 && nodeOther.vRecvMsg.size() == 1);
+    BOOST_REQUIRE(node.vRecvMsg[0].pprecheck && node.vRecvMsg[2].pprecheck && nodeOther.vRecvMsg[0].pprecheck);
+    BOOST_CHECK(!node.vRecvMsg[1].pprecheck);
+    BOOST_CHECK(!node.vRecvMsg[4].pprecheck);
+    BOOST_REQUIRE(node.vRecvMsg[3].pprecheck);
+    BOOST_CHECK(node.vRecvMsg[3].pprecheck->block.IsNull());
+
+    // Not read again
+    boost::shared_ptr<CBlockPrecheck> pcheckGood = node.vRecvMsg[0].pprecheck;
+    CheckBlockMessages(vNodes);
+    BOOST_CHECK(node.vRecvMsg[0].pprecheck == pcheckGood);
+
+    CBlockPrecheck& checkGood = *node.vRecvMsg[0].pprecheck;
+    CBlockPrecheck& checkBad = *node.vRecvMsg[2].pprecheck;
+    CBlockPrecheck& checkOther = *nodeOther.vRecvMsg[0].pprecheck;
+    uint64_t nChecks = GetBlockCheckCount();
+    FinishBlockCheck(checkGood);
+    FinishBlockCheck(checkBad);
+    FinishBlockCheck(checkOther);
+    BOOST_CHECK_EQUAL(GetBlockCheckCount(), nChecks + 3);
+    FinishBlockCheck(checkGood);
+    BOOST_CHECK_EQUAL(GetBlockCheckCount(), nChecks + 3);
+
+    BOOST_CHECK(checkGood.block.GetHash() == blockGood.GetHash());
+    BOOST_CHECK(checkGood.block.fChecked);
+    BOOST_CHECK(checkOther.block.GetHash() == blockOther.GetHash());
+    BOOST_CHECK(checkOther.block.fChecked);
+    BOOST_CHECK(checkBad.block.GetHash() == blockBad.GetHash());
+    BOOST_CHECK(!checkBad.block.fChecked);
+    BOOST_CHECK_EQUAL(checkBad.block.nDoS, 0);
+    BOOST_CHECK_EQUAL(checkBad.block.vtx[2].nDoS, 0);
+
+    // Checking it again scores it once
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(!ProcessBlock(NULL, &checkBad.block));
+    }
+    BOOST_CHECK_EQUAL(checkBad.block.nDoS, 100);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
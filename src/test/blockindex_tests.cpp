@@ -0,0 +1,92 @@
+#include <set>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockindex_tests)
+
+BOOST_AUTO_TEST_CASE(blockhasher)
+{
+    BlockHasher hasher1, hasher2;
+    uint256 hash = GetRandHash();
+
+    // Every hasher in the process uses the same salt
+    BOOST_CHECK_EQUAL(hasher1(hash), hasher2(hash));
+
+    // Block hashes spread out over the buckets
+    set<size_t> setBucket;
+    for (int i = 0; i < 1000; i++)
+        setBucket.insert(hasher1(Hash(BEGIN(i), END(i))) % 1024);
+    BOOST_CHECK(setBucket.size() > 500);
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_arena_packing)
+{
+    // Entries are packed back to back, with no padding between them, and a
+    // freed slot is handed out again
+    vector<CBlockIndex*> vIndex;
+    for (int i = 0; i < 5000; i++)
+        vIndex.push_back(new CBlockIndex());
+    CBlockIndex* pindexFreed = vIndex[100];
+    delete vIndex[100];
+    vIndex[100] = new CBlockIndex();
+    BOOST_CHECK(vIndex[100] == pindexFreed);
+
+    int nMisaligned = 0;
+    int nPacked = 0;
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        nMisaligned += ((size_t)vIndex[i] % boost::alignment_of<CBlockIndex>::value != 0);
+        if (i > 0)
+            nPacked += ((size_t)vIndex[i] - (size_t)vIndex[i-1] == sizeof(CBlockIndex));
+    }
+    BOOST_CHECK_EQUAL(nMisaligned, 0);
+    // Apart from where a slab ends, each entry follows the one before it
+    BOOST_CHECK(nPacked >= 4000);
+    BOOST_CHECK((size_t)&vIndex[0]->nFlags + sizeof(vIndex[0]->nFlags) - (size_t)vIndex[0] <= 64);
+
+    BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+        delete pindex;
+}
+
+BOOST_AUTO_TEST_CASE(find_block_by_disk_pos)
+{
+    // A best chain spread over two blk files, with the side chain block
+    // written in between
+    vector<CBlockIndex> vIndex(100);
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vIndex[i].nHeight = i;
+        vIndex[i].nFile = i < 60 ? 1 : 2;
+        vIndex[i].nBlockPos = 8 + (i % 60) * 1000;
+    }
+    CBlockIndex indexSide;
+    indexSide.pprev = &vIndex[40];
+    indexSide.nHeight = 41;
+    indexSide.nFile = 1;
+    indexSide.nBlockPos = 41 * 1000 + 500;
+
+    UpdateActiveChain(&vIndex.back());
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+        BOOST_CHECK(FindBlockByDiskPos(vIndex[i].nFile, vIndex[i].nBlockPos) == &vIndex[i]);
+    BOOST_CHECK(FindBlockByDiskPos(indexSide.nFile, indexSide.nBlockPos) == NULL);
+    BOOST_CHECK(FindBlockByDiskPos(1, 9) == NULL);
+    BOOST_CHECK(FindBlockByDiskPos(3, 8) == NULL);
+
+    // Once the side chain is the best chain its block is found instead
+    UpdateActiveChain(&indexSide);
+    BOOST_CHECK(FindBlockByDiskPos(indexSide.nFile, indexSide.nBlockPos) == &indexSide);
+    BOOST_CHECK(FindBlockByDiskPos(vIndex[41].nFile, vIndex[41].nBlockPos) == NULL);
+    BOOST_CHECK(FindBlockByDiskPos(vIndex[40].nFile, vIndex[40].nBlockPos) == &vIndex[40]);
+
+    UpdateActiveChain(NULL);
+    UpdateActiveChain(pindexBest);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
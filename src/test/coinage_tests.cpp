@@ -0,0 +1,99 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "script.h"
+
+using namespace std;
+
+// Block at nTime with a coinbase and one transaction spending prevout into
+// nOutputs outputs
+static CBlock MakeBlock(unsigned int nTime, const COutPoint& prevout, int nOutputs)
+{
+    CBlock block;
+    block.nTime = nTime;
+
+    CTransaction txCoinBase;
+    txCoinBase.nTime = nTime;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vin[0].scriptSig << nTime;
+    txCoinBase.vout.resize(1);
+    txCoinBase.vout[0].nValue = 5 * COIN;
+    txCoinBase.vout[0].scriptPubKey << OP_TRUE;
+    block.vtx.push_back(txCoinBase);
+
+    CTransaction tx;
+    tx.nTime = nTime - 60;
+    tx.vin.push_back(CTxIn(prevout));
+    for (int i = 0; i < nOutputs; i++)
+        tx.vout.push_back(CTxOut((i + 1) * COIN, CScript() << OP_TRUE));
+    block.vtx.push_back(tx);
+    return block;
+}
+
+BOOST_AUTO_TEST_SUITE(coinage_tests)
+
+BOOST_AUTO_TEST_CASE(coinage_cache_connect_disconnect)
+{
+    CCoinAgeCache cache;
+    CCoinAgeEntry entry;
+
+    CBlock block1 = MakeBlock(1400000000, COutPoint(1, 0), 2);
+    uint256 hash1 = block1.vtx[1].GetHash();
+    BOOST_CHECK(!cache.Get(COutPoint(hash1, 0), entry));
+
+    cache.ConnectBlock(block1);
+    BOOST_CHECK_EQUAL(cache.size(), 3U);
+    BOOST_CHECK(cache.Get(COutPoint(hash1, 1), entry));
+    BOOST_CHECK_EQUAL(entry.nValue, 2 * COIN);
+    BOOST_CHECK_EQUAL(entry.nTxTime, 1400000000U - 60);
+    BOOST_CHECK_EQUAL(entry.nBlockTime, 1400000000U);
+    BOOST_CHECK(cache.Get(COutPoint(block1.vtx[0].GetHash(), 0), entry));
+    BOOST_CHECK_EQUAL(entry.nValue, 5 * COIN);
+
+    // Spending an output removes it
+    CBlock block2 = MakeBlock(1400000600, COutPoint(hash1, 0), 1);
+    cache.ConnectBlock(block2);
+    BOOST_CHECK(!cache.Get(COutPoint(hash1, 0), entry));
+    BOOST_CHECK(cache.Get(COutPoint(hash1, 1), entry));
+    BOOST_CHECK(cache.Get(COutPoint(block2.vtx[1].GetHash(), 0), entry));
+
+    // Disconnecting removes the outputs of the block only
+    cache.DisconnectBlock(block2);
+    BOOST_CHECK(!cache.Get(COutPoint(block2.vtx[1].GetHash(), 0), entry));
+    BOOST_CHECK(!cache.Get(COutPoint(block2.vtx[0].GetHash(), 0), entry));
+    BOOST_CHECK(cache.Get(COutPoint(hash1, 1), entry));
+
+    uint64_t nHits, nMisses;
+    cache.GetStats(nHits, nMisses);
+    BOOST_CHECK_EQUAL(nHits, 5U);
+    BOOST_CHECK_EQUAL(nMisses, 4U);
+}
+
+BOOST_AUTO_TEST_CASE(coinage_cache_eviction)
+{
+    CCoinAgeCache cache;
+    cache.SetMaxSize(10);
+    CCoinAgeEntry entry;
+
+    vector<CBlock> vBlocks;
+    for (int i = 0; i < 5; i++)
+    {
+        vBlocks.push_back(MakeBlock(1400000000 + i * 600, COutPoint(i + 1, 0), 3));
+        cache.ConnectBlock(vBlocks.back());
+        BOOST_CHECK(cache.size() <= 10);
+    }
+
+    // The oldest outputs went first
+    BOOST_CHECK(!cache.Get(COutPoint(vBlocks[0].vtx[1].GetHash(), 0), entry));
+    BOOST_CHECK(cache.Get(COutPoint(vBlocks[4].vtx[1].GetHash(), 2), entry));
+    BOOST_CHECK(cache.Get(COutPoint(vBlocks[3].vtx[0].GetHash(), 0), entry));
+
+    // A size of 0 turns the cache off
+    cache.SetMaxSize(0);
+    BOOST_CHECK_EQUAL(cache.size(), 0U);
+    cache.ConnectBlock(MakeBlock(1400010000, COutPoint(9, 0), 3));
+    BOOST_CHECK_EQUAL(cache.size(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,356 @@
+#include <vector>
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <openssl/ecdsa.h>
+
+#include "ecverify.h"
+#include "key.h"
+#include "util.h"
+
+using namespace std;
+
+// Order of secp256k1's generator
+static const unsigned char pchOrder[32] = {
+    0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+    0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFE,
+    0xBA,0xAE,0xDC,0xE6,0xAF,0x48,0xA0,0x3B,
+    0xBF,0xD2,0x5E,0x8C,0xD0,0x36,0x41,0x41
+};
+
+static vector<unsigned char> EncodeLength(size_t nLen)
+{
+    vector<unsigned char> vch;
+    if (nLen < 0x80)
+        vch.push_back(nLen);
+    else
+    {
+        vch.push_back(0x81);
+        vch.push_back(nLen);
+    }
+    return vch;
+}
+
+static vector<unsigned char> EncodeInteger(const vector<unsigned char>& vchValue)
+{
+    vector<unsigned char> vch(1, 0x02);
+    vector<unsigned char> vchLen = EncodeLength(vchValue.size());
+    vch.insert(vch.end(), vchLen.begin(), vchLen.end());
+    vch.insert(vch.end(), vchValue.begin(), vchValue.end());
+    return vch;
+}
+
+// DER encoding of the minimal, non-negative forms of r and s
+static vector<unsigned char> EncodeSignature(vector<unsigned char> vchR, vector<unsigned char> vchS)
+{
+    while (!vchR.empty() && vchR[0] == 0)
+        vchR.erase(vchR.begin());
+    while (!vchS.empty() && vchS[0] == 0)
+        vchS.erase(vchS.begin());
+    if (vchR.empty() || vchR[0] & 0x80)
+        vchR.insert(vchR.begin(), 0);
+    if (vchS.empty() || vchS[0] & 0x80)
+        vchS.insert(vchS.begin(), 0);
+    vector<unsigned char> vchBody = EncodeInteger(vchR);
+    vector<unsigned char> vchIntS = EncodeInteger(vchS);
+    vchBody.insert(vchBody.end(), vchIntS.begin(), vchIntS.end());
+    vector<unsigned char> vch(1, 0x30);
+    vector<unsigned char> vchLen = EncodeLength(vchBody.size());
+    vch.insert(vch.end(), vchLen.begin(), vchLen.end());
+    vch.insert(vch.end(), vchBody.begin(), vchBody.end());
+    return vch;
+}
+
+// r and s of a signature in strict DER, without leading zeros
+static void DecodeSignature(const vector<unsigned char>& vchSig, vector<unsigned char>& vchR, vector<unsigned char>& vchS)
+{
+    unsigned int nPos = (vchSig[1] & 0x80) ? 3 + (vchSig[1] & 0x7f) : 2;
+    unsigned int nLenR = vchSig[nPos + 1];
+    vchR.assign(vchSig.begin() + nPos + 2, vchSig.begin() + nPos + 2 + nLenR);
+    nPos += 2 + nLenR;
+    vchS.assign(vchSig.begin() + nPos + 2, vchSig.begin() + nPos + 2 + vchSig[nPos + 1]);
+    while (!vchR.empty() && vchR[0] == 0)
+        vchR.erase(vchR.begin());
+    while (!vchS.empty() && vchS[0] == 0)
+        vchS.erase(vchS.begin());
+}
+
+// The signature as OpenSSL reads it, encoded again in strict DER
+static bool ReencodeOpenSSL(const vector<unsigned char>& vchSig, vector<unsigned char>& vchDER)
+{
+    if (vchSig.empty())
+        return false;
+    const unsigned char* pbegin = &vchSig[0];
+    ECDSA_SIG* sig = d2i_ECDSA_SIG(NULL, &pbegin, vchSig.size());
+    if (sig == NULL)
+        return false;
+    vchDER.resize(i2d_ECDSA_SIG(sig, NULL));
+    unsigned char* pos = &vchDER[0];
+    i2d_ECDSA_SIG(sig, &pos);
+    ECDSA_SIG_free(sig);
+    return true;
+}
+
+// What CheckSig accepted before the backends, and CheckBlockSignature
+// still does: a new CKey checking the signature as it is
+static bool ReferenceVerify(const vector<unsigned char>& vchPubKey, const uint256& hash, const vector<unsigned char>& vchSig)
+{
+    CKey key;
+    if (vchSig.empty() || !key.SetPubKey(CPubKey(vchPubKey)))
+        return false;
+    return key.Verify(hash, vchSig);
+}
+
+// Whether the signature is valid as d2i_ECDSA_SIG reads it, whatever its
+// encoding
+static bool LaxVerify(const vector<unsigned char>& vchPubKey, const uint256& hash, const vector<unsigned char>& vchSig)
+{
+    vector<unsigned char> vchDER;
+    CKey key;
+    if (!key.SetPubKey(CPubKey(vchPubKey)) || !ReencodeOpenSSL(vchSig, vchDER))
+        return false;
+    return key.Verify(hash, vchDER);
+}
+
+// Encodings of the same r and s that OpenSSL reads, or fails to read, in
+// all the ways the parser has to follow
+static vector<vector<unsigned char> > MutateSignature(const vector<unsigned char>& vchSig)
+{
+    vector<vector<unsigned char> > vMutated;
+    vMutated.push_back(vchSig);
+
+    vector<unsigned char> vchR, vchS;
+    DecodeSignature(vchSig, vchR, vchS);
+    vector<unsigned char> vchIntR = EncodeInteger(vchR), vchIntS = EncodeInteger(vchS);
+    vector<unsigned char> vchBody = vchIntR;
+    vchBody.insert(vchBody.end(), vchIntS.begin(), vchIntS.end());
+
+    // Negative looking and padded integers
+    vector<unsigned char> vch(1, 0x30);
+    vch.push_back(vchBody.size());
+    vch.insert(vch.end(), vchBody.begin(), vchBody.end());
+    vMutated.push_back(vch);
+    vector<unsigned char> vchPadded(3, 0);
+    vchPadded.insert(vchPadded.end(), vchS.begin(), vchS.end());
+    vch.assign(1, 0x30);
+    vector<unsigned char> vchPaddedBody = EncodeInteger(vchPadded);
+    vchPaddedBody.insert(vchPaddedBody.begin(), vchIntR.begin(), vchIntR.end());
+    vch.push_back(vchPaddedBody.size());
+    vch.insert(vch.end(), vchPaddedBody.begin(), vchPaddedBody.end());
+    vMutated.push_back(vch);
+
+    // Long form and zero padded lengths
+    vch.assign(1, 0x30);
+    vch.push_back(0x84);
+    vch.push_back(0);
+    vch.push_back(0);
+    vch.push_back(0);
+    vch.push_back(vchBody.size());
+    vch.insert(vch.end(), vchBody.begin(), vchBody.end());
+    vMutated.push_back(vch);
+    vch.assign(1, 0x30);
+    vch.push_back(vchBody.size());
+    vch.push_back(0x02);
+    vch.push_back(0x81);
+    vch.push_back(vchR.size());
+    vch.insert(vch.end(), vchR.begin(), vchR.end());
+    vch.insert(vch.end(), vchIntS.begin(), vchIntS.end());
+    vch[1] = vch.size() - 2;
+    vMutated.push_back(vch);
+
+    // Indefinite length, with and without the end of contents marker
+    vch.assign(1, 0x30);
+    vch.push_back(0x80);
+    vch.insert(vch.end(), vchBody.begin(), vchBody.end());
+    vMutated.push_back(vch);
+    vch.push_back(0);
+    vch.push_back(0);
+    vMutated.push_back(vch);
+    vch.push_back(0x42);
+    vMutated.push_back(vch);
+
+    // High tag number form
+    vch.assign(1, 0x30);
+    vch.push_back(vchBody.size() + 2);
+    vch.push_back(0x1f);
+    vch.push_back(0x80);
+    vch.push_back(0x02);
+    vch.insert(vch.end(), vchIntR.begin() + 1, vchIntR.end());
+    vch.insert(vch.end(), vchIntS.begin(), vchIntS.end());
+    vMutated.push_back(vch);
+
+    // More than 32 bytes
+    vector<unsigned char> vchLong(vchS);
+    vchLong.insert(vchLong.begin(), 1);
+    vMutated.push_back(EncodeSignature(vchR, vchLong));
+
+    // Garbage after the signature, and truncations of it
+    vch = vchSig;
+    vch.push_back(0x01);
+    vch.push_back(0x02);
+    vMutated.push_back(vch);
+    for (unsigned int n = 0; n < vchSig.size(); n += 3)
+        vMutated.push_back(vector<unsigned char>(vchSig.begin(), vchSig.begin() + n));
+
+    // Single bytes changed, which hits tags and lengths as well
+    for (int i = 0; i < 16; i++)
+    {
+        vch = vchSig;
+        vch[insecure_rand() % vch.size()] ^= 1 << (insecure_rand() % 8);
+        vMutated.push_back(vch);
+    }
+    return vMutated;
+}
+
+// n - s, which OpenSSL accepts as well as s
+static vector<unsigned char> NegateS(const vector<unsigned char>& vchSig)
+{
+    vector<unsigned char> vchR, vchS;
+    DecodeSignature(vchSig, vchR, vchS);
+    vector<unsigned char> vchNeg(32, 0);
+    int nBorrow = 0;
+    for (int i = 31; i >= 0; i--)
+    {
+        int n = 32 - (int)vchS.size();
+        int nDiff = pchOrder[i] - (i >= n ? vchS[i - n] : 0) - nBorrow;
+        nBorrow = nDiff < 0;
+        vchNeg[i] = nDiff + (nBorrow ? 256 : 0);
+    }
+    return EncodeSignature(vchR, vchNeg);
+}
+
+// Compressed, uncompressed and hybrid forms of the key, and broken ones
+static vector<vector<unsigned char> > MutatePubKey(CKey& key)
+{
+    vector<vector<unsigned char> > vMutated;
+    CSecret secret;
+    bool fCompressed;
+    secret = key.GetSecret(fCompressed);
+    CKey keyFull, keyCompressed;
+    keyFull.SetSecret(secret, false);
+    keyCompressed.SetSecret(secret, true);
+
+    vector<unsigned char> vchFull = keyFull.GetPubKey().Raw();
+    vMutated.push_back(vchFull);
+    vMutated.push_back(keyCompressed.GetPubKey().Raw());
+    vector<unsigned char> vch = vchFull;
+    vch[0] = 0x06 | (vchFull[64] & 1);
+    vMutated.push_back(vch);
+    vch[0] ^= 1;
+    vMutated.push_back(vch);
+    vch = vchFull;
+    vch[64] ^= 1;
+    vMutated.push_back(vch);
+    vch = keyCompressed.GetPubKey().Raw();
+    vch[0] ^= 1;
+    vMutated.push_back(vch);
+    memset(&vch[1], 0xff, 32);
+    vMutated.push_back(vch);
+    return vMutated;
+}
+
+BOOST_AUTO_TEST_SUITE(ecverify_tests)
+
+BOOST_AUTO_TEST_CASE(parse_matches_openssl)
+{
+    seed_insecure_rand(true);
+    int nAccepted = 0, nRejected = 0;
+    for (int i = 0; i < 50; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2);
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(GetRandHash(), vchSig));
+
+        BOOST_FOREACH(const vector<unsigned char>& vch, MutateSignature(vchSig))
+        {
+            unsigned char pchR[32], pchS[32];
+            vector<unsigned char> vchDER;
+            bool fExpected = ReencodeOpenSSL(vch, vchDER);
+            BOOST_CHECK_EQUAL(ParseSignatureLax(vch, pchR, pchS), fExpected);
+            if (!fExpected)
+            {
+                nRejected++;
+                continue;
+            }
+            nAccepted++;
+
+            vector<unsigned char> vchR, vchS;
+            DecodeSignature(vchDER, vchR, vchS);
+            if (vchR.size() > 32 || vchS.size() > 32)
+            {
+                BOOST_CHECK(vector<unsigned char>(pchR, pchR + 32) == vector<unsigned char>(32, 0));
+                BOOST_CHECK(vector<unsigned char>(pchS, pchS + 32) == vector<unsigned char>(32, 0));
+            }
+            else
+                BOOST_CHECK(EncodeSignature(vector<unsigned char>(pchR, pchR + 32), vector<unsigned char>(pchS, pchS + 32)) == vchDER);
+        }
+    }
+    BOOST_CHECK(nAccepted > 0 && nRejected > 0);
+}
+
+BOOST_AUTO_TEST_CASE(verify_matches_reference)
+{
+    // Every backend built in is checked against CKey
+    vector<CSignatureVerifier*> vVerifiers;
+    vVerifiers.push_back(&GetOpenSSLVerifier());
+#ifdef USE_SECP256K1
+    vVerifiers.push_back(&GetSecp256k1Verifier());
+#endif
+    BOOST_CHECK(&GetSignatureVerifier() == vVerifiers.back());
+
+    // Signature of 23b397edccd3740a74adb603c9756370fafcde9bcc4483eb271ecad09a94dd63
+    // with an s that only a BER parser reads, valid for the first key. Only
+    // OpenSSL releases before 1.0.0p and 1.0.1k take it.
+    vector<uint256> vHash(2, uint256("c21469f396d266507fd339292bd8ff0a6d4b29538b914265387a4d17e4839d25"));
+    vector<vector<unsigned char> > vSig(2, ParseHex("304402203f16c6f40162ab686621ef3000b04e75418a0c0cb2d8aebeac894ae360ac1e780220ddc15ecdfc3507ac48e1681a33eb60996631bf6bf5bc0a0682c4db743ce7ca2b"));
+    vector<vector<unsigned char> > vPubKey;
+    vPubKey.push_back(ParseHex("04cc71eb30d653c0c3163990c47b976f3fb3f37cccdcbedb169a1dfef58bbfbfaff7d8a473e7e2e6d317b87bafe8bde97e3cf8f065dec022b51d11fcdd0d348ac4"));
+    vPubKey.push_back(ParseHex("0461cbdcc5409fb4b4d42b51d33381354d80e550078cb532a34bfa2fcfdeb7d76519aecc62770f5b0e4ef8551946d8a540911abe3e7854a26f39f58b25c15342af"));
+    BOOST_CHECK(LaxVerify(vPubKey[0], vHash[0], vSig[0]));
+    BOOST_CHECK(!LaxVerify(vPubKey[1], vHash[1], vSig[1]));
+
+    // Made up ones, with each signature and key encoded many ways
+    seed_insecure_rand(true);
+    for (int i = 0; i < 20; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2);
+        uint256 hash = GetRandHash();
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+
+        vector<vector<unsigned char> > vSigs = MutateSignature(vchSig);
+        vSigs.push_back(NegateS(vchSig));
+        BOOST_FOREACH(const vector<unsigned char>& vchPubKey, MutatePubKey(key))
+        {
+            BOOST_FOREACH(const vector<unsigned char>& vch, vSigs)
+            {
+                vHash.push_back(hash);
+                vSig.push_back(vch);
+                vPubKey.push_back(vchPubKey);
+            }
+            vHash.push_back(hash ^ uint256(1));
+            vSig.push_back(vchSig);
+            vPubKey.push_back(vchPubKey);
+        }
+    }
+
+    int nValid = 0, nValidLax = 0;
+    for (unsigned int i = 0; i < vHash.size(); i++)
+    {
+        bool fExpected = ReferenceVerify(vPubKey[i], vHash[i], vSig[i]);
+        bool fLax = LaxVerify(vPubKey[i], vHash[i], vSig[i]);
+        nValid += fExpected;
+        nValidLax += fLax;
+        BOOST_CHECK(fLax || !fExpected);
+        BOOST_FOREACH(CSignatureVerifier* pverifier, vVerifiers)
+            BOOST_CHECK_MESSAGE(pverifier->Verify(vPubKey[i], vHash[i], vSig[i]) == fExpected,
+                strprintf("%s: pubkey %s hash %s sig %s", pverifier->GetName(), HexStr(vPubKey[i]), vHash[i].ToString(), HexStr(vSig[i])));
+    }
+    BOOST_CHECK(nValid > 0 && nValid < (int)vHash.size());
+
+    BOOST_TEST_MESSAGE(strprintf("%d of %d signatures valid, %d when read as BER", nValid, vHash.size(), nValidLax));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
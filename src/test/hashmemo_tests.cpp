@@ -0,0 +1,98 @@
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+static CTransaction RandTransaction(int nInputs, int nOutputs)
+{
+    CTransaction tx;
+    tx.nTime = GetRandInt(2000000000);
+    for (int i = 0; i < nInputs; i++)
+        tx.vin.push_back(CTxIn(COutPoint(GetRandHash(), GetRandInt(10)), CScript() << vector<unsigned char>(72, 0x30)));
+    for (int i = 0; i < nOutputs; i++)
+        tx.vout.push_back(CTxOut(GetRand(100 * COIN), CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, 0x5a) << OP_EQUALVERIFY << OP_CHECKSIG));
+    return tx;
+}
+
+static CBlock RandBlock(int nTx)
+{
+    CBlock block;
+    block.nTime = GetRandInt(2000000000);
+    block.nBits = 0x1e0fffff;
+    block.nNonce = GetRandInt(1000000);
+    for (int i = 0; i < nTx; i++)
+        block.vtx.push_back(RandTransaction(2, 2));
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_SUITE(hashmemo_tests)
+
+BOOST_AUTO_TEST_CASE(hashmemo_transaction)
+{
+    CTransaction tx = RandTransaction(3, 2);
+    uint256 hash = SerializeHash(tx);
+    BOOST_CHECK(tx.GetHash() == hash);
+    BOOST_CHECK(!tx.hashMemo.IsSet());
+    tx.MemoizeHash();
+    BOOST_CHECK(tx.hashMemo.IsSet());
+    BOOST_CHECK(tx.GetHash() == hash);
+
+    // A copy starts out without the hash, so it can be changed
+    CTransaction txCopy(tx);
+    BOOST_CHECK(!txCopy.hashMemo.IsSet());
+    txCopy.nLockTime++;
+    BOOST_CHECK(txCopy.GetHash() != hash);
+    BOOST_CHECK(txCopy.GetHash() == SerializeHash(txCopy));
+
+    // Assigning, reading and SetNull forget it
+    CTransaction txOther = RandTransaction(1, 1);
+    txOther.MemoizeHash();
+    txOther = txCopy;
+    BOOST_CHECK(!txOther.hashMemo.IsSet());
+    BOOST_CHECK(txOther.GetHash() == txCopy.GetHash());
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << txCopy;
+    ss >> tx;
+    BOOST_CHECK(!tx.hashMemo.IsSet());
+    BOOST_CHECK(tx.GetHash() == txCopy.GetHash());
+
+    tx.MemoizeHash();
+    tx.SetNull();
+    BOOST_CHECK(!tx.hashMemo.IsSet());
+    BOOST_CHECK(tx.GetHash() == SerializeHash(tx));
+}
+
+BOOST_AUTO_TEST_CASE(hashmemo_block)
+{
+    CBlock block = RandBlock(10);
+    uint256 hash = block.GetHash();
+    block.MemoizeHashes();
+    BOOST_CHECK(block.hashMemo.IsSet());
+    BOOST_CHECK(block.GetHash() == hash);
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        BOOST_CHECK(tx.hashMemo.IsSet());
+        BOOST_CHECK(tx.GetHash() == SerializeHash(tx));
+    }
+    BOOST_CHECK(block.BuildMerkleTree() == block.hashMerkleRoot);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    CBlock blockOther = RandBlock(3);
+    ss << blockOther;
+    ss >> block;
+    BOOST_CHECK(!block.hashMemo.IsSet());
+    BOOST_CHECK(block.GetHash() == blockOther.GetHash());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        BOOST_CHECK(!tx.hashMemo.IsSet());
+
+    block.MemoizeHash();
+    block = blockOther;
+    BOOST_CHECK(!block.hashMemo.IsSet());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
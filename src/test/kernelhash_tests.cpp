@@ -0,0 +1,68 @@
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "hash.h"
+#include "kernelhash.h"
+#include "serialize.h"
+#include "util.h"
+
+using namespace std;
+
+// The kernel as ScanForStakeKernelHash used to hash it
+static uint256 StreamKernelHash(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset, unsigned int nTimeTxPrev, unsigned int nPrevout, unsigned int nTimeTx)
+{
+    CDataStream ss(SER_GETHASH, 0);
+    ss << nStakeModifier;
+    ss << nTimeBlockFrom << nTxPrevOffset << nTimeTxPrev << nPrevout << nTimeTx;
+    return Hash(ss.begin(), ss.end());
+}
+
+struct CSyntheticCoin
+{
+    uint64_t nStakeModifier;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTxPrevOffset;
+    unsigned int nTimeTxPrev;
+    unsigned int nPrevout;
+};
+
+static CSyntheticCoin RandCoin()
+{
+    CSyntheticCoin coin;
+    coin.nStakeModifier = (uint64_t)insecure_rand() << 32 | insecure_rand();
+    coin.nTimeBlockFrom = 1400000000 + insecure_rand() % 10000000;
+    coin.nTxPrevOffset = 81 + insecure_rand() % 100000;
+    coin.nTimeTxPrev = coin.nTimeBlockFrom - insecure_rand() % 600;
+    coin.nPrevout = insecure_rand() % 8;
+    return coin;
+}
+
+BOOST_AUTO_TEST_SUITE(kernelhash_tests)
+
+BOOST_AUTO_TEST_CASE(kernelhash_matches_stream)
+{
+    seed_insecure_rand(true);
+    for (int i = 0; i < 1000; i++)
+    {
+        CSyntheticCoin coin = RandCoin();
+        CKernelHasher hasher(coin.nStakeModifier, coin.nTimeBlockFrom, coin.nTxPrevOffset, coin.nTimeTxPrev, coin.nPrevout);
+
+        // Odd batch sizes cover both the lane and the single hash paths
+        unsigned int nCount = 1 + insecure_rand() % 11;
+        unsigned int nTimeStart = coin.nTimeBlockFrom + 864000 + insecure_rand() % 100000;
+        vector<unsigned int> vTimeTx(nCount);
+        vector<uint256> vHash(nCount);
+        for (unsigned int n = 0; n < nCount; n++)
+            vTimeTx[n] = nTimeStart - n;
+        hasher.GetHashes(&vTimeTx[0], nCount, &vHash[0]);
+
+        for (unsigned int n = 0; n < nCount; n++)
+        {
+            uint256 hashExpected = StreamKernelHash(coin.nStakeModifier, coin.nTimeBlockFrom, coin.nTxPrevOffset, coin.nTimeTxPrev, coin.nPrevout, vTimeTx[n]);
+            BOOST_CHECK(vHash[n] == hashExpected);
+            BOOST_CHECK(hasher.GetHash(vTimeTx[n]) == hashExpected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,127 @@
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "key.h"
+#include "script.h"
+#include "util.h"
+
+using namespace std;
+
+// Distinct made up (signature hash, signature, public key) triples; the
+// cache never looks inside them
+struct CSigData
+{
+    uint256 hash;
+    vector<unsigned char> vchSig;
+    CPubKey pubKey;
+};
+
+static CSigData RandSigData()
+{
+    CSigData data;
+    data.hash = GetRandHash();
+    uint256 r = GetRandHash();
+    data.vchSig.assign(r.begin(), r.end());
+    r = GetRandHash();
+    data.pubKey = CPubKey(vector<unsigned char>(r.begin(), r.end()));
+    return data;
+}
+
+static void SetAndGet(CSignatureCache* pcache, const vector<CSigData>* pvData, int* pnFound)
+{
+    BOOST_FOREACH(const CSigData& data, *pvData)
+        pcache->Set(data.hash, data.vchSig, data.pubKey);
+    BOOST_FOREACH(const CSigData& data, *pvData)
+        if (pcache->Get(data.hash, data.vchSig, data.pubKey))
+            (*pnFound)++;
+}
+
+BOOST_AUTO_TEST_SUITE(sigcache_tests)
+
+BOOST_AUTO_TEST_CASE(sigcache_get_set)
+{
+    CSignatureCache cache(1000);
+    vector<CSigData> vData;
+    for (int i = 0; i < 100; i++)
+        vData.push_back(RandSigData());
+
+    BOOST_FOREACH(const CSigData& data, vData)
+    {
+        BOOST_CHECK(!cache.Get(data.hash, data.vchSig, data.pubKey));
+        cache.Set(data.hash, data.vchSig, data.pubKey);
+        BOOST_CHECK(cache.Get(data.hash, data.vchSig, data.pubKey));
+    }
+
+    // Every part of the triple counts
+    CSigData other = vData[0];
+    other.vchSig[0] ^= 1;
+    BOOST_CHECK(!cache.Get(other.hash, other.vchSig, other.pubKey));
+    other = vData[0];
+    other.hash = GetRandHash();
+    BOOST_CHECK(!cache.Get(other.hash, other.vchSig, other.pubKey));
+
+    unsigned int nEntries, nCapacity;
+    uint64_t nHits, nMisses;
+    cache.GetStats(nEntries, nCapacity, nHits, nMisses);
+    BOOST_CHECK(nEntries <= 100 && nEntries > 90);
+    BOOST_CHECK(nCapacity >= 1000);
+    BOOST_CHECK_EQUAL(nHits + nMisses, 202U);
+    BOOST_CHECK(nMisses >= 102);
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_bounded)
+{
+    CSignatureCache cache(1000);
+    CSigData data;
+    for (int i = 0; i < 20000; i++)
+    {
+        data = RandSigData();
+        cache.Set(data.hash, data.vchSig, data.pubKey);
+    }
+
+    // The latest signature is always kept
+    BOOST_CHECK(cache.Get(data.hash, data.vchSig, data.pubKey));
+
+    unsigned int nEntries, nCapacity;
+    uint64_t nHits, nMisses;
+    cache.GetStats(nEntries, nCapacity, nHits, nMisses);
+    BOOST_CHECK(nCapacity < 1000 + CSignatureCache::SIGCACHE_SHARDS * CSignatureCache::SIGCACHE_WAYS);
+    BOOST_CHECK(nEntries <= nCapacity);
+
+    // A size of 0 keeps nothing
+    CSignatureCache cacheOff(0);
+    cacheOff.Set(data.hash, data.vchSig, data.pubKey);
+    BOOST_CHECK(!cacheOff.Get(data.hash, data.vchSig, data.pubKey));
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_concurrent)
+{
+    const int nThreads = 8;
+    CSignatureCache cache(1000000);
+    vector<vector<CSigData> > vData(nThreads);
+    vector<int> vFound(nThreads, 0);
+    for (int i = 0; i < nThreads; i++)
+        for (int j = 0; j < 2000; j++)
+            vData[i].push_back(RandSigData());
+
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&SetAndGet, &cache, &vData[i], &vFound[i]));
+    threadGroup.join_all();
+
+    // Far from full, so hardly anything was evicted. Which entries share a
+    // bucket depends on the random salt, and now and then more than
+    // SIGCACHE_WAYS of them do, so allow for a few.
+    for (int i = 0; i < nThreads; i++)
+        BOOST_CHECK(vFound[i] >= 1980 && vFound[i] <= 2000);
+    unsigned int nEntries, nCapacity;
+    uint64_t nHits, nMisses;
+    cache.GetStats(nEntries, nCapacity, nHits, nMisses);
+    BOOST_CHECK(nEntries >= (unsigned int)nThreads * 1980 && nEntries <= (unsigned int)nThreads * 2000);
+    BOOST_CHECK(nHits >= (uint64_t)nThreads * 1980);
+    BOOST_CHECK_EQUAL(nHits + nMisses, (uint64_t)nThreads * 2000);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,111 @@
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "keystore.h"
+#include "main.h"
+#include "script.h"
+#include "util.h"
+
+using namespace std;
+
+extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+
+static CScript RandScript()
+{
+    static const opcodetype ops[] = { OP_FALSE, OP_1, OP_2, OP_DUP, OP_HASH160, OP_EQUALVERIFY, OP_CHECKSIG, OP_CODESEPARATOR, OP_RETURN };
+    CScript script;
+    int nOps = GetRandInt(10);
+    for (int i = 0; i < nOps; i++)
+        script << ops[GetRandInt(sizeof(ops) / sizeof(ops[0]))];
+    if (GetRandInt(2))
+        script << vector<unsigned char>(GetRandInt(80), 0x5a);
+    return script;
+}
+
+static CTransaction RandTransaction(int nInputs, int nOutputs)
+{
+    CTransaction tx;
+    tx.nVersion = GetRandInt(3);
+    tx.nTime = GetRandInt(2000000000);
+    tx.nLockTime = GetRandInt(2) ? GetRandInt(500000) : 0;
+    for (int i = 0; i < nInputs; i++)
+    {
+        CTxIn txin(COutPoint(GetRandHash(), GetRandInt(10)), RandScript(), GetRandInt(2) ? std::numeric_limits<unsigned int>::max() : GetRandInt(1000));
+        tx.vin.push_back(txin);
+    }
+    for (int i = 0; i < nOutputs; i++)
+        tx.vout.push_back(CTxOut(GetRand(100 * COIN), RandScript()));
+    return tx;
+}
+
+BOOST_AUTO_TEST_SUITE(sighash_tests)
+
+BOOST_AUTO_TEST_CASE(sighash_cache_matches)
+{
+    for (int i = 0; i < 500; i++)
+    {
+        CTransaction tx = RandTransaction(1 + GetRandInt(20), GetRandInt(5));
+        CSignatureHashCache cache(tx);
+        for (unsigned int nIn = 0; nIn < tx.vin.size(); nIn++)
+        {
+            CScript scriptCode = RandScript();
+            int nHashType = GetRandInt(256);
+            uint256 hash;
+            if (cache.GetHash(scriptCode, nIn, nHashType, hash))
+                BOOST_CHECK(hash == SignatureHash(scriptCode, tx, nIn, nHashType));
+            else
+                BOOST_CHECK((nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE || (nHashType & SIGHASH_ANYONECANPAY));
+
+            BOOST_CHECK(cache.GetHash(scriptCode, nIn, SIGHASH_ALL, hash));
+            BOOST_CHECK(hash == SignatureHash(scriptCode, tx, nIn, SIGHASH_ALL));
+        }
+        uint256 hash;
+        BOOST_CHECK(!cache.GetHash(CScript(), tx.vin.size(), SIGHASH_ALL, hash));
+    }
+
+    // The cache does not depend on the scripts of the inputs
+    CTransaction tx = RandTransaction(5, 2);
+    CSignatureHashCache cache(tx);
+    tx.vin[2].scriptSig = RandScript();
+    uint256 hash;
+    BOOST_CHECK(cache.GetHash(tx.vout[0].scriptPubKey, 3, SIGHASH_ALL, hash));
+    BOOST_CHECK(hash == SignatureHash(tx.vout[0].scriptPubKey, tx, 3, SIGHASH_ALL));
+}
+
+BOOST_AUTO_TEST_CASE(sighash_cache_verify)
+{
+    CBasicKeyStore keystore;
+    CTransaction txFrom;
+    txFrom.vout.resize(6);
+    for (int i = 0; i < 6; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2);
+        keystore.AddKey(key);
+        if (i < 3)
+            txFrom.vout[i].scriptPubKey << key.GetPubKey() << OP_CHECKSIG;
+        else
+            txFrom.vout[i].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    }
+
+    static const int hashTypes[] = { SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE, SIGHASH_ALL | SIGHASH_ANYONECANPAY };
+    CTransaction txTo;
+    txTo.vin.resize(6);
+    txTo.vout.resize(6);
+    for (int i = 0; i < 6; i++)
+    {
+        txTo.vin[i].prevout = COutPoint(txFrom.GetHash(), i);
+        txTo.vout[i].nValue = 1;
+    }
+    for (int i = 0; i < 6; i++)
+        BOOST_CHECK(SignSignature(keystore, txFrom, txTo, i, hashTypes[i % 4]));
+
+    CSignatureHashCache cache(txTo);
+    for (int i = 0; i < 6; i++)
+    {
+        BOOST_CHECK(VerifyScript(txTo.vin[i].scriptSig, txFrom.vout[i].scriptPubKey, txTo, i, SCRIPT_VERIFY_NOCACHE, 0, &cache));
+        BOOST_CHECK(!VerifyScript(txTo.vin[i].scriptSig, txFrom.vout[(i + 1) % 6].scriptPubKey, txTo, i, SCRIPT_VERIFY_NOCACHE, 0, &cache));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
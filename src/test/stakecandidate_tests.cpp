@@ -0,0 +1,280 @@
+#include <map>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "bignum.h"
+#include "checkqueue.h"
+#include "hash.h"
+#include "kernel.h"
+#include "kernelhash.h"
+#include "main.h"
+#include "miner.h"
+#include "util.h"
+#include "wallet.h"
+
+using namespace std;
+
+// One entry of the staking coin map the candidate array replaced
+typedef map<pair<uint256, unsigned int>, pair<pair<CTxIndex, pair<const CWalletTx*,unsigned int> >, pair<CBlock, uint64_t> > > OldMetaMap;
+
+static CStakeCandidate RandCandidate(const CWalletTx* pwtx, unsigned int nTimeNow)
+{
+    CStakeCandidate candidate;
+    candidate.pwtx = pwtx;
+    candidate.nStakeModifier = (uint64_t)insecure_rand() << 32 | insecure_rand();
+    candidate.nValue = (1 + insecure_rand() % 10000) * COIN;
+    candidate.nBlockTime = nTimeNow - GetStakeMinAge() - 3600 - insecure_rand() % (60 * 24 * 60 * 60);
+    candidate.nTxOffset = 81 + insecure_rand() % 100000;
+    candidate.nTxTime = candidate.nBlockTime - insecure_rand() % 600;
+    candidate.nOut = insecure_rand() % 4;
+    return candidate;
+}
+
+// The first kernel in the way the scan searches, hashed and weighed the
+// way the staking coin map was
+static bool ReferenceScan(const vector<CStakeCandidate>& vCandidates, unsigned int nBits, unsigned int nTime, unsigned int nSearchInterval, unsigned int& nFound, unsigned int& nTimeTxFound)
+{
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    for (unsigned int i = 0; i < vCandidates.size(); i++)
+    {
+        const CStakeCandidate& candidate = vCandidates[i];
+        for (unsigned int n = 0; n < nSearchInterval; n++)
+        {
+            unsigned int nTimeTx = nTime - n;
+            CDataStream ss(SER_GETHASH, 0);
+            ss << candidate.nStakeModifier;
+            ss << candidate.nBlockTime << candidate.nTxOffset << candidate.nTxTime << candidate.nOut << nTimeTx;
+            CBigNum bnCoinDayWeight = CBigNum(candidate.nValue) * GetWeight((int64_t)candidate.nTxTime, (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
+            if (CBigNum(Hash(ss.begin(), ss.end())) <= bnCoinDayWeight * bnTargetPerCoinDay)
+            {
+                nFound = i;
+                nTimeTxFound = nTimeTx;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Searches every candidate the way the stake miner does, in chunks on the
+// stake search queue with nThreads - 1 ThreadStakeSearch workers
+static void MinerSearch(CWallet* pwallet, const StakeCandidatesPtr& pcandidates, unsigned int nBits, unsigned int nTime, int nThreads, CStakeSearchResult& result)
+{
+    CCheckQueue<CStakeKernelSearch> queue(1);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads - 1; i++)
+        threadGroup.create_thread(boost::bind(&ThreadStakeSearch, &queue));
+
+    vector<CStakeKernelSearch> vSearch;
+    unsigned int nChunk = 0;
+    for (unsigned int nOffset = 0; nOffset < pcandidates->size(); nOffset += STAKE_SEARCH_CHUNK)
+    {
+        KernelSearchSettings settings;
+        settings.nBits = nBits;
+        settings.nTime = nTime;
+        settings.nOffset = nOffset;
+        settings.nLimit = min(STAKE_SEARCH_CHUNK, (unsigned int)pcandidates->size() - nOffset);
+        settings.nSearchInterval = 60;
+        vSearch.push_back(CStakeKernelSearch(pwallet, pcandidates, settings, nChunk++, &result));
+    }
+    reverse(vSearch.begin(), vSearch.end());
+    {
+        CCheckQueueControl<CStakeKernelSearch> control(&queue);
+        control.Add(vSearch);
+        control.Wait();
+    }
+    queue.Quit();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE(stakecandidate_tests)
+
+BOOST_AUTO_TEST_CASE(scan_matches_reference)
+{
+    vector<CWalletTx> vwtx(16);
+    const unsigned int nTime = 1420000000;
+    const unsigned int nSearchInterval = 60;
+
+    seed_insecure_rand(true);
+    int nFoundCount = 0;
+    for (int nRun = 0; nRun < 200; nRun++)
+    {
+        vector<CStakeCandidate> vCandidates;
+        for (unsigned int i = 0; i < vwtx.size(); i++)
+            vCandidates.push_back(RandCandidate(&vwtx[i], nTime));
+        unsigned int nBits = (nRun % 2) ? 0x1d00ffff : 0x1e00ffff;
+
+        unsigned int nFound = 0, nTimeTxFound = 0;
+        bool fExpected = ReferenceScan(vCandidates, nBits, nTime, nSearchInterval, nFound, nTimeTxFound);
+        nFoundCount += fExpected;
+
+        KernelSearchSettings settings;
+        settings.nBits = nBits;
+        settings.nTime = nTime;
+        settings.nOffset = 0;
+        settings.nLimit = vCandidates.size();
+        settings.nSearchInterval = nSearchInterval;
+
+        CoinsSet::value_type kernelcoin;
+        unsigned int nTimeTx = 0, nBlockTime = 0;
+        uint64_t nKernelsChecked = 0;
+        BOOST_CHECK_EQUAL(ScanForStakeKernelHash(vCandidates, settings, kernelcoin, nTimeTx, nBlockTime, NULL, &nKernelsChecked), fExpected);
+        if (!fExpected)
+            BOOST_CHECK_EQUAL(nKernelsChecked, (uint64_t)vCandidates.size() * nSearchInterval);
+        if (fExpected)
+        {
+            // Timestamps are hashed in whole batches
+            unsigned int nBatchEnd = min((nTime - nTimeTxFound) / KERNEL_HASH_LANES * KERNEL_HASH_LANES + KERNEL_HASH_LANES, nSearchInterval);
+            BOOST_CHECK_EQUAL(nKernelsChecked, (uint64_t)nFound * nSearchInterval + nBatchEnd);
+
+            BOOST_CHECK(kernelcoin == vCandidates[nFound].GetCoin());
+            BOOST_CHECK_EQUAL(nTimeTx, nTimeTxFound);
+            BOOST_CHECK_EQUAL(nBlockTime, vCandidates[nFound].nBlockTime);
+
+            // A slice starting past the kernel does not see it, one
+            // starting at it finds it first
+            settings.nOffset = nFound + 1;
+            settings.nLimit = vCandidates.size();
+            if (ScanForStakeKernelHash(vCandidates, settings, kernelcoin, nTimeTx, nBlockTime))
+                BOOST_CHECK(kernelcoin != vCandidates[nFound].GetCoin());
+            settings.nOffset = nFound;
+            settings.nLimit = 1;
+            BOOST_CHECK(ScanForStakeKernelHash(vCandidates, settings, kernelcoin, nTimeTx, nBlockTime));
+            BOOST_CHECK(kernelcoin == vCandidates[nFound].GetCoin());
+        }
+    }
+
+    // Both outcomes were covered
+    BOOST_CHECK(nFoundCount > 0 && nFoundCount < 200);
+}
+
+// Memory held per staking coin by the candidate array and by the map of
+// CTxIndex and block header copies it replaced
+BOOST_AUTO_TEST_CASE(candidate_memory_footprint)
+{
+    const unsigned int nCoins = 100000;
+    const unsigned int nTime = 1420000000;
+    CWalletTx wtx;
+
+    seed_insecure_rand(true);
+    vector<CStakeCandidate> vCandidates;
+    vCandidates.reserve(nCoins);
+    for (unsigned int i = 0; i < nCoins; i++)
+        vCandidates.push_back(RandCandidate(&wtx, nTime));
+    size_t nArrayBytes = vCandidates.capacity() * sizeof(CStakeCandidate);
+
+    // Tree node pointers and colour on top of the value, before any heap
+    // memory the CTxIndex spent vector and the CBlock vectors hold
+    size_t nMapEntryBytes = sizeof(OldMetaMap::value_type) + 4 * sizeof(void*);
+
+    BOOST_CHECK(sizeof(CStakeCandidate) <= 48);
+    BOOST_CHECK(sizeof(CStakeCandidate) * 4 < nMapEntryBytes);
+    BOOST_TEST_MESSAGE(strprintf("%u staking coins: candidate array %u bytes (%u per coin), coin map at least %u bytes (%u per coin)",
+        nCoins, nArrayBytes, sizeof(CStakeCandidate), nMapEntryBytes * nCoins, nMapEntryBytes));
+}
+
+// The stake miner's chunked search on any number of threads scans every
+// coin exactly once when no kernel is found, and with one thread finds the
+// same kernel as a scan of the whole array
+BOOST_AUTO_TEST_CASE(kernel_search_chunks)
+{
+    const unsigned int nCoins = 10 * STAKE_SEARCH_CHUNK + 17;
+    const unsigned int nTime = 1420000000;
+    CWallet wallet;
+    vector<CWalletTx> vwtx(nCoins);
+
+    seed_insecure_rand(true);
+    vector<CStakeCandidate> vCandidates;
+    for (unsigned int i = 0; i < nCoins; i++)
+        vCandidates.push_back(RandCandidate(&vwtx[i], nTime));
+    StakeCandidatesPtr pcandidates(new vector<CStakeCandidate>(vCandidates));
+
+    static const int threadCounts[] = { 1, 2, 4, 8 };
+    BOOST_FOREACH(int nThreads, threadCounts)
+    {
+        CStakeSearchResult result;
+        result.pindexPrev = pindexBest;
+        MinerSearch(&wallet, pcandidates, 0x01010000, nTime, nThreads, result);
+        BOOST_CHECK(!result.fFound);
+        BOOST_CHECK(!result.fAbort);
+        BOOST_CHECK_EQUAL(result.nKernelsChecked, (uint64_t)nCoins * 60);
+    }
+
+    unsigned int nFound = 0, nTimeTxFound = 0;
+    BOOST_CHECK(ReferenceScan(vCandidates, 0x1e00ffff, nTime, 60, nFound, nTimeTxFound));
+    BOOST_FOREACH(int nThreads, threadCounts)
+    {
+        // A found kernel ends the search
+        CStakeSearchResult result;
+        result.pindexPrev = pindexBest;
+        MinerSearch(&wallet, pcandidates, 0x1e00ffff, nTime, nThreads, result);
+        BOOST_CHECK(result.fFound);
+        BOOST_CHECK(result.fAbort);
+        BOOST_CHECK(result.pwallet == &wallet);
+        BOOST_CHECK(result.nKernelsChecked < (uint64_t)nCoins * 60);
+
+        // Any of the chunks running side by side may find one first, but
+        // it is a kernel of the coin it names
+        unsigned int nCoin = result.kernelcoin.first - &vwtx[0];
+        BOOST_REQUIRE(nCoin < nCoins);
+        BOOST_CHECK(result.kernelcoin == vCandidates[nCoin].GetCoin());
+        BOOST_CHECK_EQUAL(result.nBlockTime, vCandidates[nCoin].nBlockTime);
+        unsigned int nCoinFound = 0, nTimeTxCoin = 0;
+        vector<CStakeCandidate> vCoin(1, vCandidates[nCoin]);
+        BOOST_CHECK(ReferenceScan(vCoin, 0x1e00ffff, nTime, 60, nCoinFound, nTimeTxCoin));
+        BOOST_CHECK_EQUAL(result.nTimeTx, nTimeTxCoin);
+        if (nThreads == 1)
+        {
+            BOOST_CHECK_EQUAL(nCoin, nFound);
+            BOOST_CHECK_EQUAL(result.nTimeTx, nTimeTxFound);
+        }
+    }
+}
+
+// A search that was aborted or is for a block that is no longer the best
+// does not hash anything
+BOOST_AUTO_TEST_CASE(kernel_search_abort)
+{
+    const unsigned int nCoins = 4 * STAKE_SEARCH_CHUNK;
+    const unsigned int nTime = 1420000000;
+    CWalletTx wtx;
+
+    seed_insecure_rand(true);
+    vector<CStakeCandidate>* pvCandidates = new vector<CStakeCandidate>;
+    for (unsigned int i = 0; i < nCoins; i++)
+        pvCandidates->push_back(RandCandidate(&wtx, nTime));
+    StakeCandidatesPtr pcandidates(pvCandidates);
+
+    KernelSearchSettings settings;
+    settings.nBits = 0x01010000;
+    settings.nTime = nTime;
+    settings.nOffset = 0;
+    settings.nLimit = nCoins;
+    settings.nSearchInterval = 60;
+    CoinsSet::value_type kernelcoin;
+    unsigned int nTimeTx, nBlockTime;
+    uint64_t nKernelsChecked = 0;
+    volatile bool fAbort = true;
+    BOOST_CHECK(!ScanForStakeKernelHash(*pcandidates, settings, kernelcoin, nTimeTx, nBlockTime, &fAbort, &nKernelsChecked));
+    BOOST_CHECK_EQUAL(nKernelsChecked, (uint64_t)0);
+
+    CStakeSearchResult result;
+    result.pindexPrev = pindexBest;
+    result.fAbort = true;
+    MinerSearch(NULL, pcandidates, settings.nBits, nTime, 4, result);
+    BOOST_CHECK(!result.fFound);
+    BOOST_CHECK_EQUAL(result.nKernelsChecked, (uint64_t)0);
+
+    CBlockIndex indexStale;
+    CStakeSearchResult resultStale;
+    resultStale.pindexPrev = &indexStale;
+    MinerSearch(NULL, pcandidates, settings.nBits, nTime, 4, resultStale);
+    BOOST_CHECK(!resultStale.fFound);
+    BOOST_CHECK(resultStale.fAbort);
+    BOOST_CHECK_EQUAL(resultStale.nKernelsChecked, (uint64_t)0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
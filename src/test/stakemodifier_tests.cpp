@@ -0,0 +1,162 @@
+#include <list>
+#include <vector>
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "kernel.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+static int64_t SelectionInterval()
+{
+    int64_t nSelectionInterval = 0;
+    for (int nSection = 0; nSection < 64; nSection++)
+        nSelectionInterval += GetModiferInterval() * 63 / (63 + ((63 - nSection) * (MODIFIER_INTERVAL_RATIO - 1)));
+    return nSelectionInterval;
+}
+
+// GetKernelStakeModifier as it was before the modifier block index: walk
+// pnext from the coin's block until a block that generated a modifier is at
+// least a selection interval later
+static bool WalkKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier)
+{
+    nStakeModifier = 0;
+    if (!mapBlockIndex.count(hashBlockFrom))
+        return false;
+    const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
+    int64_t nStakeModifierTime = pindexFrom->GetBlockTime();
+    const CBlockIndex* pindex = pindexFrom;
+    while (nStakeModifierTime < pindexFrom->GetBlockTime() + SelectionInterval())
+    {
+        if (!pindex->pnext)
+            return false;
+        pindex = pindex->pnext;
+        if (pindex->GeneratedStakeModifier())
+            nStakeModifierTime = pindex->GetBlockTime();
+    }
+    nStakeModifier = pindex->nStakeModifier;
+    return true;
+}
+
+// Block index entries of a synthetic block tree, registered in mapBlockIndex
+// for the lifetime of the object
+class CTestBlockTree
+{
+public:
+    list<CBlockIndex> listIndex;
+    vector<uint256> vHash;
+
+    ~CTestBlockTree()
+    {
+        BOOST_FOREACH(const uint256& hash, vHash)
+            mapBlockIndex.erase(hash);
+        UpdateActiveChain(NULL);
+        UpdateActiveChain(pindexBest);
+    }
+
+    // A block on top of pindexPrev (or a genesis block). Block times jitter
+    // around a clock that advances with the height, so they are often out of
+    // order, and now and then a block is stamped up to two selection
+    // intervals ahead. Most blocks generate a modifier and every modifier is
+    // distinct, so comparing modifiers also compares the blocks they came
+    // from.
+    CBlockIndex* AddBlock(CBlockIndex* pindexPrev)
+    {
+        int64_t nStep = SelectionInterval() / 16;
+        listIndex.push_back(CBlockIndex());
+        CBlockIndex* pindex = &listIndex.back();
+        pindex->pprev = pindexPrev;
+        pindex->nHeight = pindexPrev ? pindexPrev->nHeight + 1 : 0;
+        pindex->nTime = 1400000000 + pindex->nHeight * nStep + GetRand(3 * nStep);
+        if (GetRandInt(25) == 0)
+            pindex->nTime += GetRand(2 * SelectionInterval());
+        pindex->SetStakeModifier(listIndex.size(), GetRandInt(3) != 0);
+
+        vHash.push_back(GetRandHash());
+        pindex->phashBlock = &mapBlockIndex.insert(make_pair(vHash.back(), pindex)).first->first;
+        return pindex;
+    }
+
+    CBlockIndex* AddBranch(CBlockIndex* pindexFork, int nBlocks)
+    {
+        CBlockIndex* pindex = pindexFork;
+        for (int i = 0; i < nBlocks; i++)
+            pindex = AddBlock(pindex);
+        return pindex;
+    }
+
+    // Link pnext along the chain ending at pindexTip the way Reorganize
+    // leaves it, and make it the active chain
+    void SetTip(CBlockIndex* pindexTip)
+    {
+        BOOST_FOREACH(CBlockIndex& index, listIndex)
+            index.pnext = NULL;
+        for (CBlockIndex* pindex = pindexTip; pindex->pprev; pindex = pindex->pprev)
+            pindex->pprev->pnext = pindex;
+        UpdateActiveChain(pindexTip);
+    }
+
+    // Looks up every block of the tree and a few unknown hashes both ways
+    int CountMismatches()
+    {
+        int nMismatch = 0;
+        vector<uint256> vLookup = vHash;
+        for (int i = 0; i < 5; i++)
+            vLookup.push_back(GetRandHash());
+        BOOST_FOREACH(const uint256& hash, vLookup)
+        {
+            uint64_t nModifier = 0, nModifierWalk = 0;
+            bool fFound = GetKernelStakeModifier(hash, nModifier);
+            bool fFoundWalk = WalkKernelStakeModifier(hash, nModifierWalk);
+            if (fFound != fFoundWalk || nModifier != nModifierWalk)
+                nMismatch++;
+        }
+        return nMismatch;
+    }
+};
+
+BOOST_AUTO_TEST_SUITE(stakemodifier_tests)
+
+BOOST_AUTO_TEST_CASE(stakemodifier_index_matches_walk)
+{
+    for (int nTree = 0; nTree < 5; nTree++)
+    {
+        CTestBlockTree tree;
+        vector<CBlockIndex*> vTip;
+        vTip.push_back(tree.AddBranch(NULL, 300));
+
+        // Branches forking off at random heights, some of them off earlier
+        // branches, each of which becomes the best chain in turn
+        for (int i = 0; i < 6; i++)
+        {
+            CBlockIndex* pindexFork = vTip[GetRandInt(vTip.size())];
+            for (int nBack = GetRandInt(pindexFork->nHeight); nBack > 0; nBack--)
+                pindexFork = pindexFork->pprev;
+            vTip.push_back(tree.AddBranch(pindexFork, 1 + GetRandInt(120)));
+        }
+
+        BOOST_FOREACH(CBlockIndex* pindexTip, vTip)
+        {
+            tree.SetTip(pindexTip);
+            BOOST_CHECK_EQUAL(tree.CountMismatches(), 0);
+        }
+
+        // and back again, then grow the first chain block by block
+        BOOST_REVERSE_FOREACH(CBlockIndex* pindexTip, vTip)
+        {
+            tree.SetTip(pindexTip);
+            BOOST_CHECK_EQUAL(tree.CountMismatches(), 0);
+        }
+        CBlockIndex* pindexTip = vTip[0];
+        for (int i = 0; i < 40; i++)
+        {
+            pindexTip = tree.AddBlock(pindexTip);
+            tree.SetTip(pindexTip);
+            BOOST_CHECK_EQUAL(tree.CountMismatches(), 0);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,359 @@
+#include <algorithm>
+#include <limits>
+#include <list>
+#include <map>
+#include <stdio.h>
+#include <vector>
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "key.h"
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+#include "wallet.h"
+
+using namespace std;
+
+// A main chain on top of the genesis block, a block every twelve hours, the
+// block at nHeightLast half a day before now. Every block generates a stake
+// modifier and is written to the block file, and its transactions get tx
+// index entries, so a wallet reads the kernel data of coins in it the way
+// it does for the real chain.
+class CTestStakeChain
+{
+public:
+    static const int64_t nSpacing = 12 * 60 * 60;
+    int64_t nTimeStart;
+    list<CBlockIndex> listIndex;
+    map<uint256, CDiskTxPos> mapTxPos;
+
+    CTestStakeChain(int nHeightLast) : nTimeStart(GetAdjustedTime() - (nHeightLast + 1) * nSpacing) { }
+
+    ~CTestStakeChain()
+    {
+        LOCK(cs_main);
+        Disconnect(0);
+        BOOST_FOREACH(const CBlockIndex& index, listIndex)
+            mapBlockIndex.erase(index.GetBlockHash());
+    }
+
+    // A block on top of the best one holding vtx, whose times are set to
+    // the block's
+    CBlockIndex* AddBlock(vector<CTransaction>& vtx)
+    {
+        LOCK(cs_main);
+        CBlock block;
+        block.hashPrevBlock = hashBestChain;
+        block.nTime = nTimeStart + (nBestHeight + 1) * nSpacing;
+        block.nBits = 0x1e0fffff;
+        BOOST_FOREACH(CTransaction& tx, vtx)
+        {
+            tx.nTime = block.nTime;
+            block.vtx.push_back(tx);
+        }
+        block.hashMerkleRoot = block.BuildMerkleTree();
+
+        unsigned int nFile, nBlockPos;
+        BOOST_REQUIRE(block.WriteToDisk(nFile, nBlockPos));
+        listIndex.push_back(CBlockIndex(nFile, nBlockPos, block));
+        CBlockIndex* pindex = &listIndex.back();
+        pindex->phashBlock = &mapBlockIndex.insert(make_pair(block.GetHash(), pindex)).first->first;
+        pindex->pprev = pindexBest;
+        pindex->nHeight = nBestHeight + 1;
+        pindex->SetStakeModifier((uint64_t)pindex->nHeight << 32 | 0x5a5a5a5a, true);
+        pindexBest->pnext = pindex;
+        pindexBest = pindex;
+        nBestHeight = pindex->nHeight;
+        hashBestChain = block.GetHash();
+        UpdateActiveChain(pindexBest);
+
+        CTxDB txdb;
+        unsigned int nTxPos = nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(block.vtx.size());
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
+            mapTxPos[tx.GetHash()] = CDiskTxPos(nFile, nBlockPos, nTxPos);
+            BOOST_REQUIRE(txdb.AddTxIndex(tx, mapTxPos[tx.GetHash()], pindex->nHeight));
+            nTxPos += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+        }
+        return pindex;
+    }
+
+    // Empty blocks up to nHeight
+    void AddBlocks(int nHeight)
+    {
+        vector<CTransaction> vtx;
+        while (nBestHeight < nHeight)
+            AddBlock(vtx);
+    }
+
+    // Put back the tx index entries of vtx
+    void RestoreTxIndex(const vector<CTransaction>& vtx)
+    {
+        CTxDB txdb;
+        BOOST_FOREACH(const CTransaction& tx, vtx)
+            BOOST_REQUIRE(txdb.AddTxIndex(tx, mapTxPos[tx.GetHash()], 0));
+    }
+
+    // Make the block at nHeight the best one again
+    void Disconnect(int nHeight)
+    {
+        LOCK(cs_main);
+        while (pindexBest->nHeight > nHeight)
+            pindexBest = pindexBest->pprev;
+        pindexBest->pnext = NULL;
+        nBestHeight = pindexBest->nHeight;
+        hashBestChain = pindexBest->GetBlockHash();
+        UpdateActiveChain(pindexBest);
+    }
+};
+
+// A transaction paying nOutputs coins to key
+static CTransaction PayTo(const CKey& key, int nOutputs)
+{
+    CTransaction tx;
+    tx.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+    for (int i = 0; i < nOutputs; i++)
+        tx.vout.push_back(CTxOut(100 * COIN, CScript() << key.GetPubKey() << OP_CHECKSIG));
+    return tx;
+}
+
+// The wallet's copy of transaction nIndex of the block at pindex
+static CWalletTx WalletTx(CWallet* pwallet, const CTransaction& tx, const CBlockIndex* pindex, int nIndex)
+{
+    CWalletTx wtx(pwallet, tx);
+    wtx.hashBlock = pindex->GetBlockHash();
+    wtx.nIndex = nIndex;
+    wtx.fMerkleVerified = true;
+    return wtx;
+}
+
+// Give the wallet key and the transactions of the block at pindex
+static void AddCoins(CWallet& wallet, const CKey& key, const vector<CTransaction>& vtx, const CBlockIndex* pindex)
+{
+    BOOST_REQUIRE(wallet.AddKey(key));
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        BOOST_REQUIRE(wallet.AddToWallet(WalletTx(&wallet, vtx[i], pindex, i)));
+}
+
+static void EraseTxIndex(const vector<CTransaction>& vtx)
+{
+    CTxDB txdb;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        BOOST_REQUIRE(txdb.EraseTxIndex(tx));
+}
+
+struct StakeCacheEntryCompare
+{
+    bool operator()(const CStakeCacheEntry& a, const CStakeCacheEntry& b) const
+    {
+        return make_pair(a.hashTx, a.nOut) < make_pair(b.hashTx, b.nOut);
+    }
+};
+
+// The kernel data of the wallet's staking candidates, in a fixed order
+static vector<CStakeCacheEntry> CandidateKernels(const CWallet& wallet)
+{
+    StakeCandidatesPtr pcandidates = wallet.GetStakeCandidates();
+    vector<CStakeCacheEntry> vEntries(pcandidates->size());
+    for (unsigned int i = 0; i < pcandidates->size(); i++)
+    {
+        const CStakeCandidate& candidate = (*pcandidates)[i];
+        vEntries[i].hashTx = candidate.pwtx->GetHash();
+        vEntries[i].nOut = candidate.nOut;
+        vEntries[i].nBlockTime = candidate.nBlockTime;
+        vEntries[i].nTxOffset = candidate.nTxOffset;
+        vEntries[i].nStakeModifier = candidate.nStakeModifier;
+    }
+    sort(vEntries.begin(), vEntries.end(), StakeCacheEntryCompare());
+    return vEntries;
+}
+
+static string Serialized(const vector<CStakeCacheEntry>& vEntries)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << vEntries;
+    return ss.str();
+}
+
+// The candidates of wallet are those a wallet holding the same key and
+// transactions loads from scratch
+static void CheckMatchesRebuild(const CWallet& wallet, const CKey& key)
+{
+    CWallet walletRebuilt("stakecandidate_rebuilt.dat");
+    BOOST_REQUIRE(walletRebuilt.AddKey(key));
+    for (map<uint256, CWalletTx>::const_iterator it = wallet.mapWallet.begin(); it != wallet.mapWallet.end(); ++it)
+        BOOST_REQUIRE(walletRebuilt.AddToWallet(it->second));
+    walletRebuilt.PrepareStakeCandidates();
+    BOOST_CHECK(Serialized(CandidateKernels(wallet)) == Serialized(CandidateKernels(walletRebuilt)));
+}
+
+BOOST_AUTO_TEST_SUITE(stakewallet_tests)
+
+BOOST_AUTO_TEST_CASE(stakecache_db)
+{
+    vector<CStakeCacheEntry> vEntries(3);
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+    {
+        vEntries[i].hashTx = GetRandHash();
+        vEntries[i].nOut = i;
+        vEntries[i].nBlockTime = 1400000000 + i;
+        vEntries[i].nTxOffset = 81 + i;
+        vEntries[i].nStakeModifier = GetRand(std::numeric_limits<uint64_t>::max());
+    }
+    uint256 hashBest = GetRandHash();
+
+    CStakeCacheDB cachedb("stakecache_db.dat");
+    BOOST_REQUIRE(cachedb.Write(hashBest, vEntries));
+    uint256 hashRead;
+    vector<CStakeCacheEntry> vRead;
+    BOOST_REQUIRE(cachedb.Read(hashRead, vRead));
+    BOOST_CHECK(hashRead == hashBest);
+    BOOST_CHECK(Serialized(vRead) == Serialized(vEntries));
+
+    // A flipped byte fails the checksum
+    string strPath = (GetDataDir() / "stakecache_db.dat.stakecache").string();
+    FILE* file = fopen(strPath.c_str(), "r+b");
+    BOOST_REQUIRE(file);
+    fseek(file, 40, SEEK_SET);
+    int ch = fgetc(file);
+    fseek(file, 40, SEEK_SET);
+    fputc(ch ^ 1, file);
+    fclose(file);
+    BOOST_CHECK(!cachedb.Read(hashRead, vRead));
+
+    // A version this code does not know is turned down, checksum or not
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << FLATDATA(pchMessageStart) << (CStakeCacheDB::CURRENT_VERSION + 1) << hashBest << vEntries;
+    ss << Hash(ss.begin(), ss.end());
+    file = fopen(strPath.c_str(), "wb");
+    BOOST_REQUIRE(file);
+    fwrite(&ss[0], 1, ss.size(), file);
+    fclose(file);
+    BOOST_CHECK(!cachedb.Read(hashRead, vRead));
+
+    // A wallet without a cache
+    BOOST_CHECK(!CStakeCacheDB("stakecache_none.dat").Read(hashRead, vRead));
+}
+
+// A wallet writes the kernel data of its staking coins, and reads it back
+// instead of the block file after a restart, but only while the block it
+// was written for is in the main chain
+BOOST_AUTO_TEST_CASE(stakecache_wallet)
+{
+    CTestStakeChain chain(30);
+    CKey key;
+    key.MakeNewKey(true);
+    vector<CTransaction> vtx;
+    vtx.push_back(PayTo(key, 2));
+    vtx.push_back(PayTo(key, 1));
+    CBlockIndex* pindexCoins = chain.AddBlock(vtx);
+    chain.AddBlocks(30);
+
+    vector<CStakeCacheEntry> vKernels;
+    {
+        CWallet wallet("stakecache_wallet.dat");
+        AddCoins(wallet, key, vtx, pindexCoins);
+        BOOST_REQUIRE(wallet.PrepareStakeCandidates());
+        vKernels = CandidateKernels(wallet);
+        BOOST_REQUIRE_EQUAL(vKernels.size(), 3U);
+        wallet.WriteStakeCache(true);
+    }
+
+    // With the coins gone from the tx index only the cache has their data
+    EraseTxIndex(vtx);
+    {
+        CWallet wallet("stakecache_wallet.dat");
+        AddCoins(wallet, key, vtx, pindexCoins);
+        BOOST_REQUIRE(wallet.PrepareStakeCandidates());
+        BOOST_CHECK(Serialized(CandidateKernels(wallet)) == Serialized(vKernels));
+    }
+
+    // The block the cache was written for left the main chain
+    chain.Disconnect(29);
+    {
+        CWallet wallet("stakecache_wallet.dat");
+        AddCoins(wallet, key, vtx, pindexCoins);
+        BOOST_REQUIRE(wallet.PrepareStakeCandidates());
+        BOOST_CHECK_EQUAL(wallet.GetStakeCandidateCount(), 0U);
+    }
+
+    // or was never seen
+    BOOST_REQUIRE(CStakeCacheDB("stakecache_wallet.dat").Write(GetRandHash(), vKernels));
+    {
+        CWallet wallet("stakecache_wallet.dat");
+        AddCoins(wallet, key, vtx, pindexCoins);
+        BOOST_REQUIRE(wallet.PrepareStakeCandidates());
+        BOOST_CHECK_EQUAL(wallet.GetStakeCandidateCount(), 0U);
+    }
+}
+
+// Updating the candidates as the wallet and the chain change ends up where
+// loading them again would, and leaves the coins that did not change alone
+BOOST_AUTO_TEST_CASE(stakecandidate_update)
+{
+    CTestStakeChain chain(64);
+    CKey key;
+    key.MakeNewKey(true);
+
+    vector<CTransaction> vtxOld;
+    vtxOld.push_back(PayTo(key, 2));
+    vtxOld.push_back(PayTo(key, 1));
+    CBlockIndex* pindexOld = chain.AddBlock(vtxOld);
+    chain.AddBlocks(9);
+    vector<CTransaction> vtxNew(1, PayTo(key, 1));
+    CBlockIndex* pindexNew = chain.AddBlock(vtxNew);
+    chain.AddBlocks(39);
+    // Matures 25 blocks deep
+    vector<CTransaction> vtxStake(1, PayTo(key, 2));
+    vtxStake[0].vout[0].SetEmpty();
+    CBlockIndex* pindexStake = chain.AddBlock(vtxStake);
+    BOOST_REQUIRE(vtxStake[0].IsCoinStake());
+    chain.AddBlocks(41);
+    vector<CTransaction> vtxLate(1, PayTo(key, 1));
+    CBlockIndex* pindexLate = chain.AddBlock(vtxLate);
+    chain.AddBlocks(60);
+
+    CWallet wallet("stakecandidate_wallet.dat");
+    BOOST_REQUIRE(wallet.AddKey(key));
+    for (unsigned int i = 0; i < vtxOld.size(); i++)
+        BOOST_REQUIRE(wallet.AddToWallet(WalletTx(&wallet, vtxOld[i], pindexOld, i)));
+    BOOST_REQUIRE(wallet.AddToWallet(WalletTx(&wallet, vtxStake[0], pindexStake, 0)));
+    BOOST_REQUIRE(wallet.AddToWallet(WalletTx(&wallet, vtxLate[0], pindexLate, 0)));
+    BOOST_REQUIRE(wallet.PrepareStakeCandidates());
+    BOOST_CHECK_EQUAL(wallet.GetStakeCandidateCount(), 4U);
+    CheckMatchesRebuild(wallet, key);
+
+    // A new transaction. The coins already there are not read again, so
+    // they stay without their tx index entries.
+    EraseTxIndex(vtxOld);
+    BOOST_REQUIRE(wallet.AddToWallet(WalletTx(&wallet, vtxNew[0], pindexNew, 0)));
+    BOOST_REQUIRE(wallet.PrepareStakeCandidates());
+    BOOST_CHECK_EQUAL(wallet.GetStakeCandidateCount(), 5U);
+    chain.RestoreTxIndex(vtxOld);
+    CheckMatchesRebuild(wallet, key);
+
+    // A coin spent
+    CTransaction txSpend;
+    txSpend.vin.push_back(CTxIn(COutPoint(vtxOld[0].GetHash(), 0)));
+    txSpend.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+    wallet.WalletUpdateSpent(txSpend);
+    BOOST_REQUIRE(wallet.PrepareStakeCandidates());
+    BOOST_CHECK_EQUAL(wallet.GetStakeCandidateCount(), 4U);
+    CheckMatchesRebuild(wallet, key);
+
+    // The coinstake matures
+    chain.AddBlocks(64);
+    BOOST_REQUIRE(wallet.PrepareStakeCandidates());
+    BOOST_CHECK_EQUAL(wallet.GetStakeCandidateCount(), 5U);
+    CheckMatchesRebuild(wallet, key);
+
+    // The blocks from the last coin on are disconnected, which takes the
+    // coinstake back under maturity
+    chain.Disconnect(pindexLate->nHeight - 1);
+    BOOST_REQUIRE(wallet.PrepareStakeCandidates());
+    BOOST_CHECK_EQUAL(wallet.GetStakeCandidateCount(), 3U);
+    CheckMatchesRebuild(wallet, key);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,8 +1,10 @@
 #define BOOST_TEST_MODULE Bitcoin Test Suite
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 
 #include "db.h"
 #include "main.h"
+#include "txdb.h"
 #include "wallet.h"
 
 
@@ -15,9 +17,14 @@ extern bool fPrintToConsole;
 extern void noui_connect();
 
 struct TestingSetup {
+    boost::filesystem::path pathTemp;
     TestingSetup() {
         fPrintToDebugger = true; // don't want to write to debug.log file
         noui_connect();
+        // The chain state the tests write stays out of the user's data directory
+        pathTemp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("test_hobonickels_%%%%-%%%%");
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
         bitdb.MakeMock();
         LoadBlockIndex(true);
         pWalletManager = new CWalletManager();
@@ -31,6 +38,8 @@ struct TestingSetup {
         pWalletManager = NULL;
         pwalletMain = NULL;
         bitdb.Flush(true);
+        CTxDB().Close();
+        boost::filesystem::remove_all(pathTemp);
     }
 };
 
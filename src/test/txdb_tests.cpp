@@ -0,0 +1,261 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+using namespace std;
+
+#ifdef USE_LEVELDB
+
+// The pre-index way of finding a key in a pending batch: walk every operation.
+class CLinearBatchScanner : public leveldb::WriteBatch::Handler
+{
+public:
+    string needle;
+    string value;
+    bool fDeleted;
+    bool fFound;
+
+    CLinearBatchScanner(const string& needleIn) : needle(needleIn), fDeleted(false), fFound(false) {}
+
+    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& valueIn)
+    {
+        if (key.ToString() == needle)
+        {
+            fFound = true;
+            fDeleted = false;
+            value = valueIn.ToString();
+        }
+    }
+
+    virtual void Delete(const leveldb::Slice& key)
+    {
+        if (key.ToString() == needle)
+        {
+            fFound = true;
+            fDeleted = true;
+        }
+    }
+};
+
+extern leveldb::DB *txdb;
+
+static string BlockIndexKey(const uint256& hash)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << make_pair(string("blockindex"), hash);
+    return ssKey.str();
+}
+
+// What LevelDB itself holds, bypassing the caches of CTxDB
+static bool DiskHasBlockIndex(const uint256& hash)
+{
+    string strValue;
+    return txdb->Get(leveldb::ReadOptions(), BlockIndexKey(hash), &strValue).ok();
+}
+
+static uint256 DiskHash(const string& strName)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << strName;
+    string strValue;
+    uint256 hash = 0;
+    if (txdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue).ok())
+    {
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> hash;
+    }
+    return hash;
+}
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+BOOST_AUTO_TEST_CASE(indexed_batch_find)
+{
+    CIndexedWriteBatch batch;
+    string value;
+    bool fDeleted = false;
+
+    BOOST_CHECK(!batch.Find("a", &value, &fDeleted));
+
+    batch.Put("a", "1");
+    BOOST_CHECK(batch.Find("a", &value, &fDeleted));
+    BOOST_CHECK(!fDeleted && value == "1");
+
+    batch.Put("a", "2");
+    BOOST_CHECK(batch.Find("a", &value, &fDeleted));
+    BOOST_CHECK(!fDeleted && value == "2");
+
+    batch.Delete("a");
+    BOOST_CHECK(batch.Find("a", &value, &fDeleted));
+    BOOST_CHECK(fDeleted);
+
+    batch.Put("a", "3");
+    BOOST_CHECK(batch.Find("a", &value, &fDeleted));
+    BOOST_CHECK(!fDeleted && value == "3");
+
+    batch.Delete("b");
+    BOOST_CHECK(batch.Find("b", &value, &fDeleted));
+    BOOST_CHECK(fDeleted);
+
+    // Every operation still ends up in the underlying leveldb batch
+    CLinearBatchScanner scanner("a");
+    BOOST_CHECK(batch.GetBatch()->Iterate(&scanner).ok());
+    BOOST_CHECK(scanner.fFound && !scanner.fDeleted && scanner.value == "3");
+    BOOST_CHECK_EQUAL(batch.size(), 2U);
+}
+
+// Replays through CTxDB the writes and reads of a reorganization that
+// connects many blocks inside one transaction: each block adds the index of
+// its transaction, marks the output it spends, writes its block index record
+// and moves the best chain. Everything has to read back before the commit
+// and be gone after an abort.
+BOOST_AUTO_TEST_CASE(txdb_connect_replay)
+{
+    CTxDB txdbTest;
+    uint256 hashBestChainOld, hashCheckpointOld;
+    BOOST_REQUIRE(txdbTest.ReadHashBestChain(hashBestChainOld));
+    BOOST_REQUIRE(txdbTest.ReadSyncCheckpoint(hashCheckpointOld));
+
+    const int nBlocks = 500;
+    vector<CTransaction> vtx(nBlocks);
+    for (int i = 0; i < nBlocks; i++)
+    {
+        vtx[i].nTime = GetRandInt(2000000000);
+        vtx[i].vin.push_back(CTxIn(COutPoint(i > 0 ? vtx[i / 2].GetHash() : 0, i % 2)));
+        vtx[i].vout.resize(2);
+    }
+
+    BOOST_REQUIRE(txdbTest.TxnBegin());
+    uint256 hashBlock = 0;
+    int nMismatch = 0;
+    for (int i = 0; i < nBlocks; i++)
+    {
+        CDiskTxPos pos(1, 1000, 1000 + i);
+        if (i > 0)
+        {
+            CTxIndex txindexPrev;
+            if (!txdbTest.ReadTxIndex(vtx[i / 2].GetHash(), txindexPrev) || txindexPrev.vSpent.size() != 2)
+            {
+                nMismatch++;
+                continue;
+            }
+            txindexPrev.vSpent[i % 2] = pos;
+            txdbTest.UpdateTxIndex(vtx[i / 2].GetHash(), txindexPrev);
+        }
+        txdbTest.AddTxIndex(vtx[i], pos, i + 1);
+
+        CBlockIndex blockindex;
+        blockindex.nHeight = i + 1;
+        blockindex.nTime = vtx[i].nTime;
+        CDiskBlockIndex diskindex(&blockindex);
+        diskindex.hashPrev = hashBlock;
+        hashBlock = diskindex.GetBlockHash();
+        txdbTest.WriteBlockIndex(diskindex);
+        txdbTest.WriteHashBestChain(hashBlock);
+
+        uint256 hashBestChainRead;
+        if (!txdbTest.ReadHashBestChain(hashBestChainRead) || hashBestChainRead != hashBlock)
+            nMismatch++;
+    }
+    BOOST_CHECK_EQUAL(nMismatch, 0);
+
+    // Every spend is seen by the later reads of the same transaction
+    for (int i = 1; i < nBlocks / 2; i++)
+    {
+        CTxIndex txindex;
+        BOOST_CHECK(txdbTest.ReadTxIndex(vtx[i].GetHash(), txindex));
+        BOOST_CHECK(txindex.vSpent.size() == 2 && !txindex.vSpent[0].IsNull() && !txindex.vSpent[1].IsNull());
+    }
+
+    // The other records go through the indexed batch
+    uint256 hashCheckpoint = GetRandHash(), hashCheckpointRead;
+    BOOST_CHECK(txdbTest.WriteSyncCheckpoint(hashCheckpoint));
+    BOOST_CHECK(txdbTest.ReadSyncCheckpoint(hashCheckpointRead) && hashCheckpointRead == hashCheckpoint);
+
+    BOOST_CHECK(txdbTest.TxnAbort());
+    uint256 hashBestChainRead;
+    BOOST_CHECK(txdbTest.ReadHashBestChain(hashBestChainRead) && hashBestChainRead == hashBestChainOld);
+    CTxIndex txindex;
+    BOOST_CHECK(!txdbTest.ReadTxIndex(vtx[0].GetHash(), txindex));
+    BOOST_CHECK(!txdbTest.ContainsTx(vtx[nBlocks - 1].GetHash()));
+    BOOST_CHECK(txdbTest.ReadSyncCheckpoint(hashCheckpointRead) && hashCheckpointRead == hashCheckpointOld);
+}
+
+// Block index records carry the hashNext links of the main chain, so they
+// may only reach disk in the same write as the best chain they belong to.
+BOOST_AUTO_TEST_CASE(txindex_cache_blockindex_with_best_chain)
+{
+    CTxDB txdbTest;
+    uint256 hashBestChainOld;
+    BOOST_REQUIRE(txdbTest.ReadHashBestChain(hashBestChainOld));
+    BOOST_REQUIRE(txdbTest.FlushTxIndexCache());
+
+    CBlockIndex blockindex;
+    blockindex.nHeight = 1;
+    blockindex.nTime = GetRandInt(2000000000);
+    blockindex.nNonce = GetRandInt(2000000000);
+    CDiskBlockIndex diskindex(&blockindex);
+    uint256 hashBlock = diskindex.GetBlockHash();
+    uint256 hashBestChainNew = GetRandHash();
+
+    BOOST_REQUIRE(txdbTest.TxnBegin());
+    BOOST_CHECK(txdbTest.WriteBlockIndex(diskindex));
+    BOOST_CHECK(txdbTest.WriteHashBestChain(hashBestChainNew));
+    BOOST_CHECK(txdbTest.TxnCommit());
+
+    // Whether or not the commit flushed, both are on disk or neither is
+    BOOST_CHECK_EQUAL(DiskHasBlockIndex(hashBlock), DiskHash("hashBestChain") == hashBestChainNew);
+    uint256 hashBestChainRead;
+    BOOST_CHECK(txdbTest.ReadHashBestChain(hashBestChainRead) && hashBestChainRead == hashBestChainNew);
+
+    BOOST_CHECK(txdbTest.FlushTxIndexCache());
+    BOOST_CHECK(DiskHasBlockIndex(hashBlock));
+    BOOST_CHECK(DiskHash("hashBestChain") == hashBestChainNew);
+
+    BOOST_REQUIRE(txdbTest.TxnBegin());
+    BOOST_CHECK(txdbTest.WriteHashBestChain(hashBestChainOld));
+    BOOST_CHECK(txdbTest.TxnCommit());
+}
+
+// The sync checkpoint names a block, so it goes to disk in the same write
+// as the cached block index records, in a transaction or on its own
+BOOST_AUTO_TEST_CASE(txindex_cache_sync_checkpoint_with_blockindex)
+{
+    CTxDB txdbTest;
+    uint256 hashCheckpointOld;
+    BOOST_REQUIRE(txdbTest.ReadSyncCheckpoint(hashCheckpointOld));
+
+    for (int i = 0; i < 2; i++)
+    {
+        BOOST_REQUIRE(txdbTest.FlushTxIndexCache());
+        CBlockIndex blockindex;
+        blockindex.nHeight = 1;
+        blockindex.nTime = GetRandInt(2000000000);
+        blockindex.nNonce = GetRandInt(2000000000);
+        CDiskBlockIndex diskindex(&blockindex);
+        uint256 hashBlock = diskindex.GetBlockHash();
+
+        BOOST_REQUIRE(txdbTest.TxnBegin());
+        BOOST_CHECK(txdbTest.WriteBlockIndex(diskindex));
+        if (i == 0)
+        {
+            BOOST_CHECK(txdbTest.WriteSyncCheckpoint(hashBlock));
+            BOOST_CHECK(txdbTest.TxnCommit());
+        }
+        else
+        {
+            BOOST_CHECK(txdbTest.TxnCommit());
+            BOOST_CHECK(txdbTest.WriteSyncCheckpoint(hashBlock));
+        }
+        BOOST_CHECK(DiskHash("hashSyncCheckpoint") == hashBlock);
+        BOOST_CHECK(DiskHasBlockIndex(hashBlock));
+    }
+
+    BOOST_CHECK(txdbTest.WriteSyncCheckpoint(hashCheckpointOld));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+#endif
@@ -0,0 +1,144 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bignum.h"
+#include "kernel.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+// Differential tests of the 256-bit arithmetic used by the kernel, trust and
+// retarget code against the CBigNum code it replaced.
+
+// Random value whose width is spread evenly over 0..256 bits
+static uint256 RandArith()
+{
+    uint256 n;
+    for (int i = 0; i < 8; i++)
+    {
+        n <<= 32;
+        n |= insecure_rand();
+    }
+    return n >> (insecure_rand() % 257);
+}
+
+// Random compact value with every exponent up to past the 256-bit overflow
+static unsigned int RandCompact()
+{
+    return ((insecure_rand() % 40) << 24) | (insecure_rand() & 0x00ffffff);
+}
+
+static CBigNum BigNumAbs(const CBigNum& bn)
+{
+    return bn < 0 ? -bn : bn;
+}
+
+// GetBlockTrust as it was computed with CBigNum
+static uint256 BigNumBlockTrust(unsigned int nBits, bool fProofOfStake)
+{
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+    if (bnTarget <= 0)
+        return 0;
+    if (fProofOfStake)
+        return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+    uint256 nPoWTrust = (CBigNum(~uint256(0) >> 20) / (bnTarget+1)).getuint256();
+    return nPoWTrust > 1 ? nPoWTrust : 1;
+}
+
+BOOST_AUTO_TEST_SUITE(uint256_arith_tests)
+
+BOOST_AUTO_TEST_CASE(mul_div_against_bignum)
+{
+    seed_insecure_rand(true);
+    const CBigNum bnLimit = CBigNum(1) << 256;
+    for (int i = 0; i < 20000; i++)
+    {
+        uint256 a = RandArith(), b = RandArith();
+        CBigNum bnProduct = CBigNum(a) * CBigNum(b);
+
+        uint256 nProduct = a;
+        bool fFits = nProduct.Multiply(b);
+        BOOST_CHECK(nProduct == bnProduct.getuint256());
+        BOOST_CHECK_EQUAL(fFits, bnProduct < bnLimit);
+        BOOST_CHECK(a * b == nProduct);
+
+        if (b != 0)
+            BOOST_CHECK(a / b == (CBigNum(a) / CBigNum(b)).getuint256());
+
+        // Single word divisors take the short division path
+        uint256 c = uint256(insecure_rand() | 1);
+        BOOST_CHECK(a / c == (CBigNum(a) / CBigNum(c)).getuint256());
+
+        unsigned int nBits = a.bits();
+        BOOST_CHECK(CBigNum(a) < (CBigNum(1) << nBits));
+        BOOST_CHECK(nBits == 0 || CBigNum(a) >= (CBigNum(1) << (nBits - 1)));
+    }
+
+    uint256 one = 1;
+    BOOST_CHECK_THROW(one / uint256(0), uint_error);
+    BOOST_CHECK((~uint256(0)) / (~uint256(0)) == one);
+    BOOST_CHECK(uint256(0).bits() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(compact_against_bignum)
+{
+    seed_insecure_rand(true);
+    const CBigNum bnLimit = CBigNum(1) << 256;
+    for (int i = 0; i < 20000; i++)
+    {
+        unsigned int nCompact = RandCompact();
+        CBigNum bn;
+        bn.SetCompact(nCompact);
+
+        bool fNegative, fOverflow;
+        uint256 n;
+        n.SetCompact(nCompact, &fNegative, &fOverflow);
+        BOOST_CHECK_EQUAL(fNegative, bn < 0);
+        BOOST_CHECK_EQUAL(fOverflow, BigNumAbs(bn) >= bnLimit);
+        if (!fOverflow)
+            BOOST_CHECK(n == BigNumAbs(bn).getuint256());
+        if (!fNegative && !fOverflow)
+            BOOST_CHECK_EQUAL(n.GetCompact(), bn.GetCompact());
+
+        uint256 a = RandArith();
+        BOOST_CHECK_EQUAL(a.GetCompact(), CBigNum(a).GetCompact());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(block_trust_against_bignum)
+{
+    seed_insecure_rand(true);
+    for (int i = 0; i < 20000; i++)
+    {
+        CBlockIndex index;
+        index.nBits = RandCompact();
+        BOOST_CHECK(index.GetBlockTrust() == BigNumBlockTrust(index.nBits, false));
+        index.SetProofOfStake();
+        BOOST_CHECK(index.GetBlockTrust() == BigNumBlockTrust(index.nBits, true));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(kernel_target_against_bignum)
+{
+    seed_insecure_rand(true);
+    for (int i = 0; i < 20000; i++)
+    {
+        // Mostly realistic stake targets, sometimes anything
+        unsigned int nBits = (i % 4) ? (0x1d000000 | (insecure_rand() & 0x00ffffff)) : RandCompact();
+        int64_t nValueIn = (int64_t)(((uint64_t)insecure_rand() << 32 | insecure_rand()) % MAX_MONEY);
+        int64_t nTimeWeight = (int64_t)(insecure_rand() % (2 * nStakeMaxAge)) - nStakeMaxAge / 4;
+        uint256 hashProofOfStake = RandArith();
+
+        CBigNum bnTargetPerCoinDay;
+        bnTargetPerCoinDay.SetCompact(nBits);
+        CBigNum bnTarget = CBigNum(nValueIn) * nTimeWeight / COIN / (24 * 60 * 60) * bnTargetPerCoinDay;
+
+        uint256 targetProofOfStake;
+        BOOST_CHECK_EQUAL(KernelHashMeetsTarget(nBits, nValueIn, nTimeWeight, hashProofOfStake, &targetProofOfStake),
+                          CBigNum(hashProofOfStake) <= bnTarget);
+        BOOST_CHECK(targetProofOfStake == bnTarget.getuint256());
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
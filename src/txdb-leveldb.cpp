@@ -8,6 +8,8 @@
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 #include <leveldb/env.h>
 #include <leveldb/cache.h>
@@ -15,16 +17,87 @@
 #include <memenv/memenv.h>
 
 #include "kernel.h"
+#include "checkqueue.h"
 #include "checkpoints.h"
 #include "txdb.h"
 #include "util.h"
 #include "main.h"
+#include "net.h"
 
 using namespace std;
 using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+// Write-back cache of transaction index records. Block connection reads and
+// rewrites the CTxIndex of every spent output, so keeping recently used
+// records in memory and writing dirty ones back in large batches avoids a
+// random LevelDB read per input and a rewrite per spend. Block index records
+// and the best chain hash are held back as well and only written together
+// with the dirty transaction index records, so the block index links, the
+// transaction index and the best chain on disk always match each other.
+static CCriticalSection cs_txindexcache;
+static map<uint256, CTxIndexCacheEntry> mapTxIndexCache;
+static map<uint256, string> mapBlockIndexDirty;
+static size_t nTxIndexCacheUsage = 0;
+static size_t nTxIndexCacheDirty = 0;
+static uint256 hashBestChainCached = 0;
+static int64_t nLastTxIndexCacheFlush = 0;
+static unsigned int nTxIndexCacheFlushes = 0;
+
+// Whether the block index snapshot on disk matches the database, so that
+// block index writes have to invalidate it. Protected by cs_main.
+static bool fBlockIndexSnapshotCurrent = false;
+
+static size_t GetTxIndexCacheLimit()
+{
+    static size_t nLimit = (size_t)std::max((int64_t)1, GetArg("-txindexcache", 100)) * 1048576;
+    return nLimit;
+}
+
+// Rough heap usage of a cached record: the map node plus the vSpent array.
+static size_t TxIndexCacheEntryUsage(const CTxIndexCacheEntry& entry)
+{
+    return sizeof(pair<const uint256, CTxIndexCacheEntry>) + 4 * sizeof(void*) +
+           entry.txindex.vSpent.capacity() * sizeof(CDiskTxPos);
+}
+
+static size_t BlockIndexDirtyUsage(const string& strValue)
+{
+    return sizeof(pair<const uint256, string>) + 4 * sizeof(void*) + strValue.capacity();
+}
+
+// Inserts or replaces an unwritten block index record. Caller must hold
+// cs_txindexcache.
+static void BlockIndexDirtyStore(const uint256& hash, const string& strValue)
+{
+    map<uint256, string>::iterator mi = mapBlockIndexDirty.find(hash);
+    if (mi == mapBlockIndexDirty.end())
+        mi = mapBlockIndexDirty.insert(make_pair(hash, string())).first;
+    else
+        nTxIndexCacheUsage -= BlockIndexDirtyUsage(mi->second);
+    mi->second = strValue;
+    nTxIndexCacheUsage += BlockIndexDirtyUsage(mi->second);
+}
+
+// Inserts or replaces a cache entry. Caller must hold cs_txindexcache.
+static void TxIndexCacheStore(const uint256& hash, const CTxIndexCacheEntry& entry)
+{
+    map<uint256, CTxIndexCacheEntry>::iterator mi = mapTxIndexCache.find(hash);
+    if (mi == mapTxIndexCache.end())
+        mi = mapTxIndexCache.insert(make_pair(hash, CTxIndexCacheEntry())).first;
+    else
+    {
+        nTxIndexCacheUsage -= TxIndexCacheEntryUsage(mi->second);
+        if (mi->second.fDirty)
+            nTxIndexCacheDirty--;
+    }
+    mi->second = entry;
+    nTxIndexCacheUsage += TxIndexCacheEntryUsage(mi->second);
+    if (entry.fDirty)
+        nTxIndexCacheDirty++;
+}
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
     int nCacheSizeMB = GetArg("-dbcache", 25);
@@ -122,6 +195,7 @@ CTxDB::CTxDB(const char* pszMode)
 
 void CTxDB::Close()
 {
+    FlushTxIndexCache();
     delete txdb;
     txdb = pdb = NULL;
     delete options.filter_policy;
@@ -135,76 +209,240 @@ void CTxDB::Close()
 bool CTxDB::TxnBegin()
 {
     assert(!activeBatch);
-    activeBatch = new leveldb::WriteBatch();
+    activeBatch = new CIndexedWriteBatch();
     return true;
 }
 
 bool CTxDB::TxnCommit()
 {
     assert(activeBatch);
-    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
+    bool fSnapshotErased = false;
+    if (fBlockIndexSnapshotCurrent)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << string("blockindexsnapshot");
+        string strUnused;
+        activeBatch->Find(ssKey.str(), &strUnused, &fSnapshotErased);
+    }
+
+    // Hand the transaction index changes over to the write-back cache. While
+    // catching up they stay in memory until the cache is full; once we are
+    // at the tip every commit is written through as before. The other records
+    // of the batch, like the sync checkpoint, may name blocks whose block
+    // index records are still cached, so they go out in the same write.
+    bool fFlush = !IsInitialBlockDownload();
+    {
+        LOCK(cs_txindexcache);
+        for (map<uint256, CTxIndexCacheEntry>::iterator mi = mapTxIndexPending.begin(); mi != mapTxIndexPending.end(); ++mi)
+            TxIndexCacheStore(mi->first, mi->second);
+        for (map<uint256, string>::iterator mi = mapBlockIndexPending.begin(); mi != mapBlockIndexPending.end(); ++mi)
+            BlockIndexDirtyStore(mi->first, mi->second);
+        if (hashBestChainPending != 0)
+            hashBestChainCached = hashBestChainPending;
+        if (nTxIndexCacheUsage > GetTxIndexCacheLimit() || GetTime() - nLastTxIndexCacheFlush > 10 * 60)
+            fFlush = true;
+    }
+    mapTxIndexPending.clear();
+    mapBlockIndexPending.clear();
+    hashBestChainPending = 0;
+
+    if (fSnapshotErased)
+        fBlockIndexSnapshotCurrent = false;
+
+    bool fRet = true;
+    if (activeBatch->size() > 0)
+        fRet = FlushTxIndexCache(activeBatch->GetBatch());
+    else if (fFlush)
+        fRet = FlushTxIndexCache();
     delete activeBatch;
     activeBatch = NULL;
-    if (!status.ok()) {
-        LogPrintf("LevelDB batch commit failure: %s\n", status.ToString());
-        return false;
-    }
-    return true;
+    return fRet;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
+bool CTxDB::FlushTxIndexCache()
+{
+    return FlushTxIndexCache(NULL);
+}
+
+bool CTxDB::FlushTxIndexCache(leveldb::WriteBatch* pbatchWith)
+{
+    LOCK(cs_txindexcache);
+    nLastTxIndexCacheFlush = GetTime();
+    if (nTxIndexCacheDirty == 0 && mapBlockIndexDirty.empty() && hashBestChainCached == 0 && !pbatchWith)
+        return true;
+
+    int64_t nStart = GetTimeMillis();
+    leveldb::WriteBatch batchCache;
+    leveldb::WriteBatch& batch = pbatchWith ? *pbatchWith : batchCache;
+    unsigned int nWritten = 0;
+    for (map<uint256, CTxIndexCacheEntry>::iterator mi = mapTxIndexCache.begin(); mi != mapTxIndexCache.end(); ++mi)
+    {
+        if (!mi->second.fDirty)
+            continue;
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << make_pair(string("tx"), mi->first);
+        if (mi->second.fErased)
+            batch.Delete(ssKey.str());
+        else
+        {
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            ssValue << mi->second.txindex;
+            batch.Put(ssKey.str(), ssValue.str());
         }
+        nWritten++;
+    }
+    for (map<uint256, string>::iterator mi = mapBlockIndexDirty.begin(); mi != mapBlockIndexDirty.end(); ++mi)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << make_pair(string("blockindex"), mi->first);
+        batch.Put(ssKey.str(), mi->second);
+        nWritten++;
+    }
+    if (hashBestChainCached != 0)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << string("hashBestChain");
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue << hashBestChainCached;
+        batch.Put(ssKey.str(), ssValue.str());
     }
 
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
+    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+    if (!status.ok())
+        return error("CTxDB::FlushTxIndexCache() : LevelDB write failure: %s", status.ToString());
+
+    // Everything is on disk now: drop the written block index records and
+    // erased markers, mark the rest clean and evict clean records until we
+    // are comfortably below the limit.
+    for (map<uint256, string>::iterator mi = mapBlockIndexDirty.begin(); mi != mapBlockIndexDirty.end(); ++mi)
+        nTxIndexCacheUsage -= BlockIndexDirtyUsage(mi->second);
+    mapBlockIndexDirty.clear();
+    size_t nLimit = GetTxIndexCacheLimit();
+    for (map<uint256, CTxIndexCacheEntry>::iterator mi = mapTxIndexCache.begin(); mi != mapTxIndexCache.end(); )
+    {
+        if (mi->second.fErased || nTxIndexCacheUsage > nLimit * 3 / 4)
+        {
+            nTxIndexCacheUsage -= TxIndexCacheEntryUsage(mi->second);
+            mapTxIndexCache.erase(mi++);
+        }
+        else
+        {
+            mi->second.fDirty = false;
+            ++mi;
         }
     }
-};
+    nTxIndexCacheDirty = 0;
+    hashBestChainCached = 0;
+    nTxIndexCacheFlushes++;
+
+    LogPrint("db", "CTxDB::FlushTxIndexCache() : wrote %u records in %dms, %u cached (%u kB)\n",
+        nWritten, GetTimeMillis() - nStart, mapTxIndexCache.size(), nTxIndexCacheUsage / 1024);
+    return true;
+}
+
+void CIndexedWriteBatch::Put(const string& key, const string& value)
+{
+    batch.Put(key, value);
+    mapPending[key] = make_pair(false, value);
+}
+
+void CIndexedWriteBatch::Delete(const string& key)
+{
+    batch.Delete(key);
+    std::pair<bool, string>& pending = mapPending[key];
+    pending.first = true;
+    pending.second.clear();
+}
+
+bool CIndexedWriteBatch::Find(const string& key, string* value, bool* deleted) const
+{
+    boost::unordered_map<string, std::pair<bool, string> >::const_iterator mi = mapPending.find(key);
+    if (mi == mapPending.end())
+        return false;
+    *deleted = mi->second.first;
+    if (!*deleted)
+        *value = mi->second.second;
+    return true;
+}
 
 // When performing a read, if we have an active batch we need to check it first
 // before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
+// a database transaction begins reads are consistent with it. The batch keeps
+// an index of its pending operations, so this is a single hash lookup.
 bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
     assert(activeBatch);
     *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
+    return activeBatch->Find(key.str(), value, deleted);
+}
+
+bool CTxDB::ReadTxIndexCached(const uint256& hash, CTxIndexCacheEntry& entry) const
+{
+    if (activeBatch)
+    {
+        map<uint256, CTxIndexCacheEntry>::const_iterator mi = mapTxIndexPending.find(hash);
+        if (mi != mapTxIndexPending.end())
+        {
+            entry = mi->second;
+            return true;
+        }
+    }
+
+    LOCK(cs_txindexcache);
+    map<uint256, CTxIndexCacheEntry>::const_iterator mi = mapTxIndexCache.find(hash);
+    if (mi == mapTxIndexCache.end())
+        return false;
+    entry = mi->second;
+    return true;
+}
+
+void CTxDB::WriteTxIndexCached(const uint256& hash, const CTxIndex& txindex, bool fErased)
+{
+    if (fReadOnly)
+        assert(!"Write called on database in read-only mode");
+
+    if (activeBatch)
+    {
+        mapTxIndexPending[hash] = CTxIndexCacheEntry(txindex, true, fErased);
+        return;
     }
-    return scanner.foundEntry;
+
+    LOCK(cs_txindexcache);
+    TxIndexCacheStore(hash, CTxIndexCacheEntry(txindex, true, fErased));
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
+
+    CTxIndexCacheEntry entry;
+    if (ReadTxIndexCached(hash, entry))
+    {
+        if (entry.fErased)
+            return false;
+        txindex = entry.txindex;
+        return true;
+    }
+
+    unsigned int nFlushes;
+    {
+        LOCK(cs_txindexcache);
+        nFlushes = nTxIndexCacheFlushes;
+    }
+    if (!Read(make_pair(string("tx"), hash), txindex))
+        return false;
+
+    // Only remember what we read if no flush evicted a newer version of the
+    // record while we were reading from disk.
+    LOCK(cs_txindexcache);
+    if (nFlushes == nTxIndexCacheFlushes && !mapTxIndexCache.count(hash))
+        TxIndexCacheStore(hash, CTxIndexCacheEntry(txindex, false, false));
+    return true;
 }
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
-    return Write(make_pair(string("tx"), hash), txindex);
+    WriteTxIndexCached(hash, txindex, false);
+    return true;
 }
 
 bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
@@ -212,18 +450,23 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    WriteTxIndexCached(hash, txindex, false);
+    return true;
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
 {
     uint256 hash = tx.GetHash();
 
-    return Erase(make_pair(string("tx"), hash));
+    WriteTxIndexCached(hash, CTxIndex(), true);
+    return true;
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
 {
+    CTxIndexCacheEntry entry;
+    if (ReadTxIndexCached(hash, entry))
+        return !entry.fErased;
     return Exists(make_pair(string("tx"), hash));
 }
 
@@ -254,17 +497,63 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
 
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
-    return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
+    if (fBlockIndexSnapshotCurrent)
+    {
+        // The block index snapshot no longer matches once this is written
+        if (!Erase(string("blockindexsnapshot")))
+            return false;
+        if (!activeBatch)
+            fBlockIndexSnapshotCurrent = false;
+    }
+
+    // Block index records carry the hashNext links of the main chain, so they
+    // must not reach disk ahead of the best chain and transaction index.
+    if (fReadOnly)
+        assert(!"Write called on database in read-only mode");
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << blockindex;
+    if (activeBatch)
+    {
+        mapBlockIndexPending[blockindex.GetBlockHash()] = ssValue.str();
+        return true;
+    }
+    LOCK(cs_txindexcache);
+    BlockIndexDirtyStore(blockindex.GetBlockHash(), ssValue.str());
+    return true;
 }
 
 bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 {
+    if (activeBatch && hashBestChainPending != 0)
+    {
+        hashBestChain = hashBestChainPending;
+        return true;
+    }
+    {
+        LOCK(cs_txindexcache);
+        if (hashBestChainCached != 0)
+        {
+            hashBestChain = hashBestChainCached;
+            return true;
+        }
+    }
     return Read(string("hashBestChain"), hashBestChain);
 }
 
 bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
 {
-    return Write(string("hashBestChain"), hashBestChain);
+    // The best chain pointer must never get ahead of the transaction index
+    // on disk, so it goes through the write-back cache as well.
+    if (fReadOnly)
+        assert(!"Write called on database in read-only mode");
+    if (activeBatch)
+    {
+        hashBestChainPending = hashBestChain;
+        return true;
+    }
+    LOCK(cs_txindexcache);
+    hashBestChainCached = hashBestChain;
+    return true;
 }
 
 bool CTxDB::ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust)
@@ -274,7 +563,7 @@ bool CTxDB::ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust)
 
 bool CTxDB::WriteBestInvalidTrust(CBigNum bnBestInvalidTrust)
 {
-    return Write(string("bnBestInvalidTrust"), bnBestInvalidTrust);
+    return WriteWithCache(string("bnBestInvalidTrust"), bnBestInvalidTrust);
 }
 
 bool CTxDB::ReadSyncCheckpoint(uint256& hashCheckpoint)
@@ -284,7 +573,7 @@ bool CTxDB::ReadSyncCheckpoint(uint256& hashCheckpoint)
 
 bool CTxDB::WriteSyncCheckpoint(uint256 hashCheckpoint)
 {
-    return Write(string("hashSyncCheckpoint"), hashCheckpoint);
+    return WriteWithCache(string("hashSyncCheckpoint"), hashCheckpoint);
 }
 
 bool CTxDB::ReadCheckpointPubKey(string& strPubKey)
@@ -303,7 +592,7 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
@@ -317,79 +606,194 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
-bool CTxDB::LoadBlockIndex()
+/** A run of raw block index records deserialized together by one loader
+ *  worker. The decoded entries go to a slot owned by the iterating thread.
+ */
+class CBlockIndexDecode
 {
-    if (mapBlockIndex.size() > 0) {
-        // Already loaded once in this session. It can happen during migration
-        // from BDB.
+private:
+    vector<string> vRecord;
+    vector<pair<uint256, CDiskBlockIndex> > *pvDecoded;
+
+public:
+    CBlockIndexDecode() : pvDecoded(NULL) {}
+    CBlockIndexDecode(vector<string>& vRecordIn, vector<pair<uint256, CDiskBlockIndex> > *pvDecodedIn) : pvDecoded(pvDecodedIn)
+    {
+        vRecord.swap(vRecordIn);
+    }
+
+    bool operator()()
+    {
+        pvDecoded->resize(vRecord.size());
+        for (unsigned int i = 0; i < vRecord.size(); i++)
+        {
+            try {
+                CDataStream ssValue(vRecord[i].data(), vRecord[i].data() + vRecord[i].size(), SER_DISK, CLIENT_VERSION);
+                ssValue >> (*pvDecoded)[i].second;
+            } catch (std::exception &e) {
+                return error("LoadBlockIndex() : deserialize error: %s", e.what());
+            }
+            // This may be a full scrypt hash of the header
+            (*pvDecoded)[i].first = (*pvDecoded)[i].second.GetBlockHash();
+        }
         return true;
     }
-    // The block index is an in-memory structure that maps hashes to on-disk
-    // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-    // Seek to start key.
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256(0));
-    iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
-    {
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (fRequestShutdown || strType != "blockindex")
-            break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
 
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
-            pindexGenesisBlock = pindexNew;
+    void swap(CBlockIndexDecode &check)
+    {
+        vRecord.swap(check.vRecord);
+        std::swap(pvDecoded, check.pvDecoded);
+    }
+};
 
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
-            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
-        }
+/** Computes the trust of a run of block index entries; the chain trust is
+ *  accumulated afterwards in height order.
+ */
+class CBlockTrustCheck
+{
+private:
+    vector<CBlockIndex*> vIndex;
 
-        // NovaCoin: build setStakeSeen
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+public:
+    CBlockTrustCheck() {}
+    CBlockTrustCheck(vector<CBlockIndex*>& vIndexIn)
+    {
+        vIndex.swap(vIndexIn);
+    }
+
+    bool operator()()
+    {
+        BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+            pindex->nChainTrust = pindex->GetBlockTrust();
+        return true;
+    }
+
+    void swap(CBlockTrustCheck &check)
+    {
+        vIndex.swap(check.vIndex);
+    }
+};
+
+static const unsigned int LOAD_BLOCK_INDEX_CHUNK = 2048;
+
+bool CTxDB::LoadBlockIndexGuts()
+{
+    // Use as many loader threads as script verification (-par)
+    int nWorkers = std::max(nScriptCheckThreads, 1);
+    int64_t nStart = GetTimeMicros();
+
+    // The block index is an in-memory structure that maps hashes to on-disk
+    // locations where the contents of the block can be found. Here, we scan it
+    // out of the DB and into mapBlockIndex. This thread walks the key range
+    // and hands out chunks of raw records to the workers, which deserialize
+    // and hash them while the scan goes on.
+    list<vector<pair<uint256, CDiskBlockIndex> > > lDecoded;
+    bool fDecodeOk;
+    {
+        CCheckQueue<CBlockIndexDecode> decodequeue(1);
+        boost::thread_group workers;
+        for (int i = 0; i < nWorkers; i++)
+            workers.create_thread(boost::bind(&CCheckQueue<CBlockIndexDecode>::Thread, &decodequeue));
+
+        CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+        ssStartKey << string("blockindex");
+        const string strPrefix = ssStartKey.str();
+        ssStartKey << uint256(0);
+
+        leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+        vector<string> vRecord;
+        vRecord.reserve(LOAD_BLOCK_INDEX_CHUNK);
+        {
+            CCheckQueueControl<CBlockIndexDecode> control(&decodequeue);
+            // Seek to start key.
+            iterator->Seek(ssStartKey.str());
+            // Now read each entry.
+            while (iterator->Valid())
+            {
+                // Did we reach the end of the data to read?
+                if (fRequestShutdown || !iterator->key().starts_with(strPrefix))
+                    break;
+                vRecord.push_back(iterator->value().ToString());
+                iterator->Next();
 
-        iterator->Next();
+                if (vRecord.size() == LOAD_BLOCK_INDEX_CHUNK)
+                {
+                    lDecoded.push_back(vector<pair<uint256, CDiskBlockIndex> >());
+                    vector<CBlockIndexDecode> vDecode(1);
+                    CBlockIndexDecode(vRecord, &lDecoded.back()).swap(vDecode[0]);
+                    control.Add(vDecode);
+                    vRecord.reserve(LOAD_BLOCK_INDEX_CHUNK);
+                }
+            }
+            if (!vRecord.empty())
+            {
+                lDecoded.push_back(vector<pair<uint256, CDiskBlockIndex> >());
+                vector<CBlockIndexDecode> vDecode(1);
+                CBlockIndexDecode(vRecord, &lDecoded.back()).swap(vDecode[0]);
+                control.Add(vDecode);
+            }
+            fDecodeOk = control.Wait();
+        }
+        delete iterator;
+        decodequeue.Quit();
+        workers.join_all();
     }
-    delete iterator;
+    int64_t nDecoded = GetTimeMicros();
+
+    if (!fDecodeOk)
+        return error("LoadBlockIndex() : failed to read block index");
 
     if (fRequestShutdown)
         return true;
 
+    // Size the hash table for every entry at once instead of rehashing as it grows
+    size_t nEntries = 0;
+    BOOST_FOREACH(const vector<PAIRTYPE(uint256, CDiskBlockIndex) >& vDecoded, lDecoded)
+        nEntries += vDecoded.size();
+    mapBlockIndex.reserve(nEntries);
+
+    BOOST_FOREACH(const vector<PAIRTYPE(uint256, CDiskBlockIndex) >& vDecoded, lDecoded)
+    {
+        BOOST_FOREACH(const PAIRTYPE(uint256, CDiskBlockIndex)& item, vDecoded)
+        {
+            const uint256& blockHash = item.first;
+            const CDiskBlockIndex& diskindex = item.second;
+
+            // Construct block index object
+            CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nBlockPos      = diskindex.nBlockPos;
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nMint          = diskindex.nMint;
+            pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+            pindexNew->nFlags         = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
+            pindexNew->prevoutStake   = diskindex.prevoutStake;
+            pindexNew->nStakeTime     = diskindex.nStakeTime;
+            pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+
+            // Watch for genesis block
+            if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
+                pindexGenesisBlock = pindexNew;
+
+            if (!pindexNew->CheckIndex())
+                return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+
+            // NovaCoin: build setStakeSeen
+            if (pindexNew->IsProofOfStake())
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+        }
+    }
+    lDecoded.clear();
+    int64_t nLinked = GetTimeMicros();
+
     // Calculate nChainTrust
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
@@ -399,15 +803,66 @@ bool CTxDB::LoadBlockIndex()
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+    // The trust of each block only depends on its own header, so compute that
+    // on the workers and leave the running sum for the pass below.
+    {
+        CCheckQueue<CBlockTrustCheck> trustqueue(1);
+        boost::thread_group workers;
+        for (int i = 1; i < nWorkers; i++)
+            workers.create_thread(boost::bind(&CCheckQueue<CBlockTrustCheck>::Thread, &trustqueue));
+        {
+            CCheckQueueControl<CBlockTrustCheck> control(&trustqueue);
+            vector<CBlockTrustCheck> vChecks;
+            vector<CBlockIndex*> vIndex;
+            for (unsigned int i = 0; i < vSortedByHeight.size(); i++)
+            {
+                vIndex.push_back(vSortedByHeight[i].second);
+                if (vIndex.size() == LOAD_BLOCK_INDEX_CHUNK || i + 1 == vSortedByHeight.size())
+                {
+                    vChecks.push_back(CBlockTrustCheck(vIndex));
+                    vIndex.clear();
+                }
+            }
+            control.Add(vChecks);
+            control.Wait();
+        }
+        trustqueue.Quit();
+        workers.join_all();
+    }
+
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        if (pindex->pprev)
+            pindex->nChainTrust += pindex->pprev->nChainTrust;
         // NovaCoin: calculate stake modifier checksum
         pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex, true);
         if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
             return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016x", pindex->nHeight, pindex->nStakeModifier);
     }
+    int64_t nTrusted = GetTimeMicros();
+
+    LogPrintf("LoadBlockIndex(): %u entries with %d threads: read+decode %dms, link %dms, trust+checksum %dms\n",
+      mapBlockIndex.size(), nWorkers, (nDecoded - nStart) / 1000, (nLinked - nDecoded) / 1000, (nTrusted - nLinked) / 1000);
+    return true;
+}
+
+bool CTxDB::LoadBlockIndex()
+{
+    if (mapBlockIndex.size() > 0) {
+        // Already loaded once in this session. It can happen during migration
+        // from BDB.
+        return true;
+    }
+
+    if (!ReadBlockIndexSnapshot())
+    {
+        if (!LoadBlockIndexGuts())
+            return false;
+        if (fRequestShutdown)
+            return true;
+    }
 
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
@@ -419,6 +874,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    UpdateActiveChain(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -563,3 +1019,274 @@ bool CTxDB::LoadBlockIndex()
 
     return true;
 }
+
+// Block index snapshot. A flat file holding one fixed-width record per
+// CBlockIndex, with the previous and next blocks given as record offsets, so
+// that startup can map it and link the index without touching LevelDB. A
+// random nonce stored both in the file and under the "blockindexsnapshot" key
+// ties the file to the database state: the first block index write after a
+// snapshot erases the key, which makes the file stale.
+
+static const unsigned char pchBlockIndexSnapshotMagic[4] = { 'h', 'b', 'i', 's' };
+static const uint32_t BLOCKINDEX_SNAPSHOT_VERSION = 1;
+
+struct CBlockIndexSnapshotHeader
+{
+    unsigned char pchMagic[4];
+    uint32_t nVersion;
+    uint32_t nRecordSize;
+    uint32_t nRecords;
+    uint64_t nNonce;
+    uint256 hashBestChain;
+    uint256 hashChecksum; // Hash() of all records
+};
+
+struct CBlockIndexSnapshotRecord
+{
+    uint256 hashBlock;
+    uint256 nChainTrust;
+    uint256 hashPrevoutStake;
+    uint256 hashProofOfStake;
+    uint256 hashMerkleRoot;
+    int64_t nMint;
+    int64_t nMoneySupply;
+    uint64_t nStakeModifier;
+    int32_t nPrev; // record offset, -1 for none
+    int32_t nNext;
+    uint32_t nFile;
+    uint32_t nBlockPos;
+    int32_t nHeight;
+    uint32_t nFlags;
+    uint32_t nStakeModifierChecksum;
+    uint32_t nPrevoutStake;
+    uint32_t nStakeTime;
+    int32_t nVersion;
+    uint32_t nTime;
+    uint32_t nBits;
+    uint32_t nNonce;
+    uint32_t nReserved;
+};
+
+static boost::filesystem::path BlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blkindex.snapshot";
+}
+
+bool CTxDB::ReadBlockIndexSnapshot()
+{
+    if (GetArg("-blockindexsnapshot", 60) <= 0)
+        return false;
+
+    uint64_t nNonce = 0;
+    uint256 hashBest = 0;
+    if (!Read(string("blockindexsnapshot"), nNonce) || !ReadHashBestChain(hashBest))
+        return false;
+
+    int64_t nStart = GetTimeMicros();
+    vector<CBlockIndex*> vIndex;
+    try {
+        boost::interprocess::file_mapping mapping(BlockIndexSnapshotPath().string().c_str(), boost::interprocess::read_only);
+        boost::interprocess::mapped_region region(mapping, boost::interprocess::read_only);
+        const unsigned char* pbegin = (const unsigned char*)region.get_address();
+        if (region.get_size() < sizeof(CBlockIndexSnapshotHeader))
+            return error("ReadBlockIndexSnapshot() : snapshot truncated");
+
+        const CBlockIndexSnapshotHeader& header = *(const CBlockIndexSnapshotHeader*)pbegin;
+        if (memcmp(header.pchMagic, pchBlockIndexSnapshotMagic, sizeof(header.pchMagic)) != 0 ||
+            header.nVersion != BLOCKINDEX_SNAPSHOT_VERSION || header.nRecordSize != sizeof(CBlockIndexSnapshotRecord))
+            return error("ReadBlockIndexSnapshot() : unknown snapshot format");
+        if (header.nNonce != nNonce || header.hashBestChain != hashBest)
+        {
+            LogPrintf("ReadBlockIndexSnapshot() : snapshot is stale\n");
+            return false;
+        }
+        if (region.get_size() != sizeof(header) + (size_t)header.nRecords * sizeof(CBlockIndexSnapshotRecord))
+            return error("ReadBlockIndexSnapshot() : snapshot truncated");
+        const CBlockIndexSnapshotRecord* precords = (const CBlockIndexSnapshotRecord*)(pbegin + sizeof(header));
+        if (Hash((const char*)precords, (const char*)(precords + header.nRecords)) != header.hashChecksum)
+            return error("ReadBlockIndexSnapshot() : checksum mismatch");
+
+        vIndex.reserve(header.nRecords);
+        mapBlockIndex.reserve(header.nRecords);
+        for (unsigned int i = 0; i < header.nRecords; i++)
+            vIndex.push_back(new CBlockIndex());
+        const int nRecords = header.nRecords;
+        for (int i = 0; i < nRecords; i++)
+        {
+            const CBlockIndexSnapshotRecord& record = precords[i];
+            if (record.nPrev < -1 || record.nPrev >= nRecords || record.nNext < -1 || record.nNext >= nRecords)
+                throw runtime_error("record offset out of range");
+
+            CBlockIndex* pindex     = vIndex[i];
+            pindex->pprev           = record.nPrev >= 0 ? vIndex[record.nPrev] : NULL;
+            pindex->pnext           = record.nNext >= 0 ? vIndex[record.nNext] : NULL;
+            pindex->nFile           = record.nFile;
+            pindex->nBlockPos       = record.nBlockPos;
+            pindex->nChainTrust     = record.nChainTrust;
+            pindex->nHeight         = record.nHeight;
+            pindex->nMint           = record.nMint;
+            pindex->nMoneySupply    = record.nMoneySupply;
+            pindex->nFlags          = record.nFlags;
+            pindex->nStakeModifier  = record.nStakeModifier;
+            pindex->nStakeModifierChecksum = record.nStakeModifierChecksum;
+            pindex->prevoutStake    = COutPoint(record.hashPrevoutStake, record.nPrevoutStake);
+            pindex->nStakeTime      = record.nStakeTime;
+            pindex->hashProofOfStake = record.hashProofOfStake;
+            pindex->nVersion        = record.nVersion;
+            pindex->hashMerkleRoot  = record.hashMerkleRoot;
+            pindex->nTime           = record.nTime;
+            pindex->nBits           = record.nBits;
+            pindex->nNonce          = record.nNonce;
+
+            pair<BlockMap::iterator, bool> ret = mapBlockIndex.insert(make_pair(record.hashBlock, pindex));
+            if (!ret.second)
+                throw runtime_error("duplicate block hash");
+            pindex->phashBlock = &(ret.first->first);
+
+            if (!pindex->CheckIndex())
+                throw runtime_error("CheckIndex failed");
+            if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
+                throw runtime_error("stake modifier checkpoint mismatch");
+        }
+    } catch (std::exception &e) {
+        // Leave a clean slate for the regular loader
+        mapBlockIndex.clear();
+        BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+            delete pindex;
+        return error("ReadBlockIndexSnapshot() : %s", e.what());
+    }
+
+    BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+    {
+        // Watch for genesis block
+        if (pindexGenesisBlock == NULL && pindex->GetBlockHash() == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
+            pindexGenesisBlock = pindex;
+
+        // NovaCoin: build setStakeSeen
+        if (pindex->IsProofOfStake())
+            setStakeSeen.insert(make_pair(pindex->prevoutStake, pindex->nStakeTime));
+    }
+    fBlockIndexSnapshotCurrent = true;
+
+    LogPrintf("ReadBlockIndexSnapshot(): %u entries in %dms\n", vIndex.size(), (GetTimeMicros() - nStart) / 1000);
+    return true;
+}
+
+bool CTxDB::WriteBlockIndexSnapshot()
+{
+    static CCriticalSection cs_snapshot;
+    LOCK(cs_snapshot);
+
+    int64_t nStart = GetTimeMicros();
+    CBlockIndexSnapshotHeader header;
+    memcpy(header.pchMagic, pchBlockIndexSnapshotMagic, sizeof(header.pchMagic));
+    header.nVersion = BLOCKINDEX_SNAPSHOT_VERSION;
+    header.nRecordSize = sizeof(CBlockIndexSnapshotRecord);
+    vector<CBlockIndexSnapshotRecord> vRecord;
+    {
+        LOCK(cs_main);
+        if (fBlockIndexSnapshotCurrent || pindexGenesisBlock == NULL)
+            return true;
+
+        boost::unordered_map<const CBlockIndex*, int32_t> mapOffset;
+        mapOffset.rehash(mapBlockIndex.size());
+        int32_t nOffset = 0;
+        for (BlockMap::const_iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+            mapOffset[mi->second] = nOffset++;
+
+        vRecord.resize(mapBlockIndex.size());
+        nOffset = 0;
+        for (BlockMap::const_iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        {
+            const CBlockIndex* pindex = mi->second;
+            CBlockIndexSnapshotRecord& record = vRecord[nOffset++];
+            record.hashBlock        = mi->first;
+            record.nChainTrust      = pindex->nChainTrust;
+            record.hashPrevoutStake = pindex->prevoutStake.hash;
+            record.hashProofOfStake = pindex->hashProofOfStake;
+            record.hashMerkleRoot   = pindex->hashMerkleRoot;
+            record.nMint            = pindex->nMint;
+            record.nMoneySupply     = pindex->nMoneySupply;
+            record.nStakeModifier   = pindex->nStakeModifier;
+            record.nPrev            = pindex->pprev ? mapOffset[pindex->pprev] : -1;
+            record.nNext            = pindex->pnext ? mapOffset[pindex->pnext] : -1;
+            record.nFile            = pindex->nFile;
+            record.nBlockPos        = pindex->nBlockPos;
+            record.nHeight          = pindex->nHeight;
+            record.nFlags           = pindex->nFlags;
+            record.nStakeModifierChecksum = pindex->nStakeModifierChecksum;
+            record.nPrevoutStake    = pindex->prevoutStake.n;
+            record.nStakeTime       = pindex->nStakeTime;
+            record.nVersion         = pindex->nVersion;
+            record.nTime            = pindex->nTime;
+            record.nBits            = pindex->nBits;
+            record.nNonce           = pindex->nNonce;
+            record.nReserved        = 0;
+        }
+        header.nRecords = vRecord.size();
+        header.hashBestChain = hashBestChain;
+
+        // Mark the database before the file is written. Until the file is
+        // complete the nonces differ, and any block index write from now on
+        // removes the mark again. The mark goes to disk together with the
+        // cached block index records and best chain hash the snapshot has to
+        // match.
+        header.nNonce = GetRand(std::numeric_limits<uint64_t>::max());
+        if (!WriteWithCache(string("blockindexsnapshot"), header.nNonce))
+            return false;
+        fBlockIndexSnapshotCurrent = true;
+    }
+
+    header.hashChecksum = Hash((const char*)&vRecord[0], (const char*)(&vRecord[0] + vRecord.size()));
+
+    boost::filesystem::path pathSnapshot = BlockIndexSnapshotPath();
+    boost::filesystem::path pathTmp = pathSnapshot;
+    pathTmp += ".new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    bool fOk = file != NULL &&
+        fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(&vRecord[0], sizeof(CBlockIndexSnapshotRecord), vRecord.size(), file) == vRecord.size();
+    if (file)
+    {
+        if (fOk)
+            FileCommit(file);
+        fOk = (fclose(file) == 0) && fOk;
+    }
+    if (!fOk || !RenameOver(pathTmp, pathSnapshot))
+    {
+        LOCK(cs_main);
+        fBlockIndexSnapshotCurrent = false;
+        return error("WriteBlockIndexSnapshot() : failed to write %s", pathSnapshot.string());
+    }
+
+    LogPrint("db", "WriteBlockIndexSnapshot(): %u entries in %dms\n", vRecord.size(), (GetTimeMicros() - nStart) / 1000);
+    return true;
+}
+
+void ThreadBlockIndexSnapshot(void* parg)
+{
+    // Make this thread recognisable as the block index snapshot thread
+    RenameThread("hobocoin-snapshot");
+
+    int64_t nInterval = GetArg("-blockindexsnapshot", 60) * 60;
+    if (nInterval <= 0)
+        return;
+
+    // Counted so StopNode waits for a write in progress before the
+    // database is flushed and closed
+    vnThreadsRunning[THREAD_BLOCKINDEXSNAPSHOT]++;
+    int64_t nLastWrite = GetTime();
+    while (!fShutdown)
+    {
+        MilliSleep(1000);
+        if (fShutdown || GetTime() - nLastWrite < nInterval || IsInitialBlockDownload())
+            continue;
+        try {
+            CTxDB().WriteBlockIndexSnapshot();
+        } catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadBlockIndexSnapshot()");
+        }
+        nLastWrite = GetTime();
+    }
+    vnThreadsRunning[THREAD_BLOCKINDEXSNAPSHOT]--;
+}
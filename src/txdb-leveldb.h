@@ -12,9 +12,50 @@
 #include <string>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+/** A leveldb::WriteBatch together with a hash index of its pending puts and
+ * deletes, so that reads inside a transaction can find their own writes in
+ * constant time instead of iterating over the whole batch.
+ */
+class CIndexedWriteBatch
+{
+private:
+    leveldb::WriteBatch batch;
+    // key -> (deleted, value) of the most recent operation on that key
+    boost::unordered_map<std::string, std::pair<bool, std::string> > mapPending;
+
+public:
+    void Put(const std::string& key, const std::string& value);
+    void Delete(const std::string& key);
+
+    // Returns true if the batch contains an operation on key. For a put the
+    // value is stored in *value and *deleted is false, for a delete *deleted
+    // is set to true.
+    bool Find(const std::string& key, std::string* value, bool* deleted) const;
+
+    leveldb::WriteBatch* GetBatch() { return &batch; }
+    size_t size() const { return mapPending.size(); }
+};
+
+/** An entry of the in-memory CTxIndex cache kept in front of LevelDB. Dirty
+ * entries have not been written to disk yet; erased entries are pending
+ * deletes that shadow whatever is still on disk.
+ */
+struct CTxIndexCacheEntry
+{
+    CTxIndex txindex;
+    bool fDirty;
+    bool fErased;
+
+    CTxIndexCacheEntry() : fDirty(false), fErased(false) {}
+    CTxIndexCacheEntry(const CTxIndex& txindexIn, bool fDirtyIn, bool fErasedIn) :
+        txindex(txindexIn), fDirty(fDirtyIn), fErased(fErasedIn) {}
+};
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -45,17 +86,38 @@ private:
 
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
-    leveldb::WriteBatch *activeBatch;
+    CIndexedWriteBatch *activeBatch;
+    // Transaction index writes made while activeBatch is open. They are moved
+    // into the shared write-back cache on TxnCommit and dropped on TxnAbort.
+    std::map<uint256, CTxIndexCacheEntry> mapTxIndexPending;
+    // Serialized block index records written while activeBatch is open. Like
+    // the transaction index they only reach disk on the next cache flush.
+    std::map<uint256, std::string> mapBlockIndexPending;
+    // Best chain hash written while activeBatch is open. It is kept together
+    // with the cached transaction index so both reach disk atomically.
+    uint256 hashBestChainPending;
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
 
 protected:
+    bool LoadBlockIndexGuts();
+    bool ReadBlockIndexSnapshot();
+
     // Returns true and sets (value,false) if activeBatch contains the given key
     // or leaves value alone and sets deleted = true if activeBatch contains a
     // delete for it.
     bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
 
+    // Writes the cache as FlushTxIndexCache() does, together with the
+    // records of pbatchWith if given
+    bool FlushTxIndexCache(leveldb::WriteBatch* pbatchWith);
+
+    // Looks up a transaction index in the pending writes of this object and
+    // then in the shared cache. Returns false if neither knows about it.
+    bool ReadTxIndexCached(const uint256& hash, CTxIndexCacheEntry& entry) const;
+    void WriteTxIndexCached(const uint256& hash, const CTxIndex& txindex, bool fErased);
+
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
@@ -122,6 +184,23 @@ protected:
         return true;
     }
 
+    // Writes a record that names blocks, such as the sync checkpoint, in the
+    // same LevelDB write as the cached block index records, so it never
+    // reaches disk ahead of the blocks it names.
+    template<typename K, typename T>
+    bool WriteWithCache(const K& key, const T& value)
+    {
+        if (activeBatch)
+            return Write(key, value);
+        TxnBegin();
+        if (!Write(key, value))
+        {
+            TxnAbort();
+            return false;
+        }
+        return TxnCommit();
+    }
+
     template<typename K>
     bool Erase(const K& key)
     {
@@ -169,9 +248,17 @@ public:
     {
         delete activeBatch;
         activeBatch = NULL;
+        mapTxIndexPending.clear();
+        mapBlockIndexPending.clear();
+        hashBestChainPending = 0;
         return true;
     }
 
+    // Writes all dirty cached transaction index entries, the unwritten block
+    // index records and the cached best chain hash to LevelDB in a single
+    // batch.
+    bool FlushTxIndexCache();
+
     bool ReadVersion(int& nVersion)
     {
         nVersion = 0;
@@ -202,6 +289,13 @@ public:
     bool ReadCheckpointPubKey(std::string& strPubKey);
     bool WriteCheckpointPubKey(const std::string& strPubKey);
     bool LoadBlockIndex();
+
+    // Writes mapBlockIndex to the flat snapshot file that LoadBlockIndex
+    // prefers over the LevelDB records. Does nothing if the snapshot is
+    // still current.
+    bool WriteBlockIndexSnapshot();
 };
 
+void ThreadBlockIndexSnapshot(void* parg);
+
 #endif // BITCOIN_DB_H
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_UINT256_H
 #define BITCOIN_UINT256_H
 
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -16,6 +17,12 @@
 
 inline int Testuint256AdHoc(std::vector<std::string> vArg);
 
+class uint_error : public std::runtime_error
+{
+public:
+    explicit uint_error(const std::string& str) : std::runtime_error(str) {}
+};
+
 
 
 /** Base class without constructors for uint256 and uint160.
@@ -178,6 +185,101 @@ public:
         return *this;
     }
 
+    // Multiplies in place, keeping the low BITS bits of the product like the
+    // other operators. Returns false if the full product did not fit.
+    bool Multiply(const base_uint& b)
+    {
+        unsigned int r[2 * WIDTH];
+        for (int i = 0; i < 2 * WIDTH; i++)
+            r[i] = 0;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            if (pn[i] == 0)
+                continue;
+            uint64_t carry = 0;
+            for (int j = 0; j < WIDTH; j++)
+            {
+                uint64_t n = carry + r[i+j] + (uint64_t)pn[i] * b.pn[j];
+                r[i+j] = n & 0xffffffff;
+                carry = n >> 32;
+            }
+            r[i+WIDTH] = carry;
+        }
+        bool fFits = true;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            pn[i] = r[i];
+            if (r[i+WIDTH] != 0)
+                fFits = false;
+        }
+        return fFits;
+    }
+
+    base_uint& operator*=(const base_uint& b)
+    {
+        Multiply(b);
+        return *this;
+    }
+
+    base_uint& operator/=(const base_uint& b)
+    {
+        int nDivBits = b.bits();
+        if (nDivBits == 0)
+            throw uint_error("base_uint::operator/= : division by zero");
+
+        if (nDivBits <= 32)
+        {
+            // Short division by a single word
+            uint64_t rem = 0;
+            for (int i = WIDTH - 1; i >= 0; i--)
+            {
+                uint64_t n = (rem << 32) | pn[i];
+                pn[i] = (unsigned int)(n / b.pn[0]);
+                rem = n % b.pn[0];
+            }
+            return *this;
+        }
+
+        base_uint num = *this;
+        base_uint div = b;
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+        int nNumBits = num.bits();
+        if (nDivBits > nNumBits)
+            return *this;
+
+        // Shift-and-subtract long division
+        int shift = nNumBits - nDivBits;
+        div <<= shift;
+        while (shift >= 0)
+        {
+            if (num >= div)
+            {
+                num -= div;
+                pn[shift / 32] |= (1U << (shift & 31));
+            }
+            div >>= 1;
+            shift--;
+        }
+        return *this;
+    }
+
+    // Position of the highest set bit plus one, zero if no bit is set
+    unsigned int bits() const
+    {
+        for (int pos = WIDTH - 1; pos >= 0; pos--)
+        {
+            if (pn[pos])
+            {
+                for (int nbits = 31; nbits > 0; nbits--)
+                    if (pn[pos] & (1U << nbits))
+                        return 32 * pos + nbits + 1;
+                return 32 * pos + 1;
+            }
+        }
+        return 0;
+    }
+
 
     base_uint& operator++()
     {
@@ -577,6 +679,58 @@ public:
         else
             *this = 0;
     }
+
+    /** Decodes the compact nBits form exactly like CBigNum::SetCompact.
+     * A set sign bit with a nonzero mantissa makes the value negative, and
+     * an exponent that would shift the mantissa past 256 bits overflows; in
+     * both cases the flags are raised and the returned value is meaningless.
+     */
+    uint256& SetCompact(unsigned int nCompact, bool* pfNegative = NULL, bool* pfOverflow = NULL)
+    {
+        int nSize = nCompact >> 24;
+        unsigned int nWord = nCompact & 0x007fffff;
+        if (nSize <= 3)
+        {
+            nWord >>= 8 * (3 - nSize);
+            *this = nWord;
+        }
+        else
+        {
+            *this = nWord;
+            *this <<= 8 * (nSize - 3);
+        }
+        if (pfNegative)
+            *pfNegative = nWord != 0 && (nCompact & 0x00800000) != 0;
+        if (pfOverflow)
+            *pfOverflow = nWord != 0 && ((nSize > 34) ||
+                                         (nWord > 0xff && nSize > 33) ||
+                                         (nWord > 0xffff && nSize > 32));
+        return *this;
+    }
+
+    /** Encodes to the compact nBits form, matching CBigNum::GetCompact */
+    unsigned int GetCompact() const
+    {
+        int nSize = (bits() + 7) / 8;
+        unsigned int nCompact = 0;
+        if (nSize <= 3)
+            nCompact = (unsigned int)(Get64() << 8 * (3 - nSize));
+        else
+        {
+            uint256 bn = *this;
+            bn >>= 8 * (nSize - 3);
+            nCompact = (unsigned int)bn.Get64();
+        }
+        // The 0x00800000 bit denotes the sign, so if it is already set divide
+        // the mantissa by 256 and increase the exponent
+        if (nCompact & 0x00800000)
+        {
+            nCompact >>= 8;
+            nSize++;
+        }
+        nCompact |= nSize << 24;
+        return nCompact;
+    }
 };
 
 inline bool operator==(const uint256& a, uint64_t b)                           { return (base_uint256)a == b; }
@@ -591,6 +745,8 @@ inline const uint256 operator&(const base_uint256& a, const base_uint256& b) { r
 inline const uint256 operator|(const base_uint256& a, const base_uint256& b) { return uint256(a) |= b; }
 inline const uint256 operator+(const base_uint256& a, const base_uint256& b) { return uint256(a) += b; }
 inline const uint256 operator-(const base_uint256& a, const base_uint256& b) { return uint256(a) -= b; }
+inline const uint256 operator*(const base_uint256& a, const base_uint256& b) { return uint256(a) *= b; }
+inline const uint256 operator/(const base_uint256& a, const base_uint256& b) { return uint256(a) /= b; }
 
 inline bool operator<(const base_uint256& a, const uint256& b)          { return (base_uint256)a <  (base_uint256)b; }
 inline bool operator<=(const base_uint256& a, const uint256& b)         { return (base_uint256)a <= (base_uint256)b; }
@@ -603,6 +759,8 @@ inline const uint256 operator&(const base_uint256& a, const uint256& b) { return
 inline const uint256 operator|(const base_uint256& a, const uint256& b) { return (base_uint256)a |  (base_uint256)b; }
 inline const uint256 operator+(const base_uint256& a, const uint256& b) { return (base_uint256)a +  (base_uint256)b; }
 inline const uint256 operator-(const base_uint256& a, const uint256& b) { return (base_uint256)a -  (base_uint256)b; }
+inline const uint256 operator*(const base_uint256& a, const uint256& b) { return (base_uint256)a *  (base_uint256)b; }
+inline const uint256 operator/(const base_uint256& a, const uint256& b) { return (base_uint256)a /  (base_uint256)b; }
 
 inline bool operator<(const uint256& a, const base_uint256& b)          { return (base_uint256)a <  (base_uint256)b; }
 inline bool operator<=(const uint256& a, const base_uint256& b)         { return (base_uint256)a <= (base_uint256)b; }
@@ -615,6 +773,8 @@ inline const uint256 operator&(const uint256& a, const base_uint256& b) { return
 inline const uint256 operator|(const uint256& a, const base_uint256& b) { return (base_uint256)a |  (base_uint256)b; }
 inline const uint256 operator+(const uint256& a, const base_uint256& b) { return (base_uint256)a +  (base_uint256)b; }
 inline const uint256 operator-(const uint256& a, const base_uint256& b) { return (base_uint256)a -  (base_uint256)b; }
+inline const uint256 operator*(const uint256& a, const base_uint256& b) { return (base_uint256)a *  (base_uint256)b; }
+inline const uint256 operator/(const uint256& a, const base_uint256& b) { return (base_uint256)a /  (base_uint256)b; }
 
 inline bool operator<(const uint256& a, const uint256& b)               { return (base_uint256)a <  (base_uint256)b; }
 inline bool operator<=(const uint256& a, const uint256& b)              { return (base_uint256)a <= (base_uint256)b; }
@@ -627,6 +787,8 @@ inline const uint256 operator&(const uint256& a, const uint256& b)      { return
 inline const uint256 operator|(const uint256& a, const uint256& b)      { return (base_uint256)a |  (base_uint256)b; }
 inline const uint256 operator+(const uint256& a, const uint256& b)      { return (base_uint256)a +  (base_uint256)b; }
 inline const uint256 operator-(const uint256& a, const uint256& b)      { return (base_uint256)a -  (base_uint256)b; }
+inline const uint256 operator*(const uint256& a, const uint256& b)      { return (base_uint256)a *  (base_uint256)b; }
+inline const uint256 operator/(const uint256& a, const uint256& b)      { return (base_uint256)a /  (base_uint256)b; }
 
 
 
@@ -14,6 +14,7 @@
 #include "net.h"
 #include "init.h"
 #include "coincontrol.h"
+#include "miner.h"
 #include <boost/algorithm/string/replace.hpp>
 
 using namespace std;
@@ -165,7 +166,10 @@ bool CWallet::Unlock(const SecureString& strWalletPassphrase)
             if (!crypter.Decrypt(pMasterKey.second.vchCryptedKey, vMasterKey))
                 return false;
             if (CCryptoKeyStore::Unlock(vMasterKey))
+            {
+                WakeStakeMiner();
                 return true;
+            }
         }
     }
     return false;
@@ -413,6 +417,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
                     LogPrintf("WalletUpdateSpent found spent coin %shbn %s\n", FormatMoney(wtx.GetCredit()), wtx.GetHash().ToString());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    MarkStakeCandidatesDirty(txin.prevout.hash);
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -433,6 +438,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
               wtx.WriteToDisk();
            }
        }
+       MarkStakeCandidatesDirty(hash);
 
     }
 }
@@ -443,6 +449,7 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        nStakeGeneration++;
     }
 }
 
@@ -536,8 +543,12 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
 
         // Write to disk
         if (fInsertedNew || fUpdated)
+        {
             if (!wtx.WriteToDisk())
                 return false;
+            MarkStakeCandidatesDirty(hash);
+            WakeStakeMiner();
+        }
         if (!fHaveGUI) {
             // If default receiving address gets used, replace it with a new one
             if (vchDefaultKey.IsValid()) {
@@ -621,7 +632,14 @@ bool CWallet::EraseFromWallet(uint256 hash)
     {
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
+        {
             CWalletDB(strWalletFile).EraseTx(hash);
+
+            // The candidates may point at the erased transaction
+            vector<CStakeCandidate> vNone;
+            SetStakeCandidates(vNone);
+            InvalidateStakeCandidates();
+        }
     }
     return true;
 }
@@ -955,6 +973,7 @@ void CWallet::ReacceptWalletTransactions()
                     LogPrintf("ReacceptWalletTransactions found spent coin %shbn %s\n", FormatMoney(wtx.GetCredit()), wtx.GetHash().ToString());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    MarkStakeCandidatesDirty(wtx.GetHash());
                 }
             }
             else
@@ -1804,65 +1823,16 @@ bool CWallet::GetStakeWeightFromValue(const int64_t& nTime, const int64_t& nValu
 
 bool CWallet::GetStakeWeight(const CKeyStore& keystore, uint64_t& nMinWeight, uint64_t& nMaxWeight, uint64_t& nWeight)
 {
-    // Choose coins to use
-    int64_t nBalance = GetBalance();
-
     nMinWeight = nMaxWeight = nWeight = 0;
 
-    if (nBalance <= nReserveBalance)
+    if (!PrepareStakeCandidates())
         return false;
 
-    CTxDB txdb("r");
-    {
-        LOCK2(cs_main, cs_wallet);
-        // Cache outputs unless best block or wallet transaction set changed
-        if (!fCoinsDataActual && !IsLocked())
-        {
-            mapMeta.clear();
-            int64_t nValueIn = 0;
-            CoinsSet setCoins;
-            if (!SelectCoinsForStaking(nBalance - nReserveBalance, GetAdjustedTime(),setCoins, nValueIn))
-                return false;
-
-            if (setCoins.empty())
-                return false;
-
-            {
-                CTxIndex txindex;
-                CBlock block;
-                for(CoinsSet::iterator pcoin = setCoins.begin(); pcoin != setCoins.end(); pcoin++)
-                {
-                    // Load transaction index item
-                    if (!txdb.ReadTxIndex(pcoin->first->GetHash(), txindex))
-                        continue;
-
-                    // Read block header
-                    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-                        continue;
-
-                    uint64_t nStakeModifier = 0;
-                    if (!GetKernelStakeModifier(block.GetHash(), nStakeModifier))
-                        continue;
-
-                    // Add meta record
-                    // (txid, vout.n) => ((txindex, (tx, vout.n)), (block, modifier))
-                    mapMeta[make_pair(pcoin->first->GetHash(), pcoin->second)] = make_pair(make_pair(txindex, *pcoin), make_pair(block, nStakeModifier));
-                }
-            }
-            LogPrint("coinstake", "----GetStakeWeight: %zu meta items loaded for %zu coins for wallet %s-----\n", mapMeta.size(), setCoins.size(),strWalletFile.c_str());
-            fCoinsDataActual = true;
-        }
-    }
-
-
-    // (txid, vout.n) => ((txindex, (tx, vout.n)), (block, modifier))
-    for(MetaMap::const_iterator meta_item = mapMeta.begin(); meta_item != mapMeta.end(); meta_item++)
+    StakeCandidatesPtr pcandidates = GetStakeCandidates();
+    BOOST_FOREACH(const CStakeCandidate& candidate, *pcandidates)
     {
-        // Get coin
-        CoinsSet::value_type pcoin = meta_item->second.first.second;
-
-        int64_t nTimeWeight = GetWeight((int64_t)pcoin.first->nTime, (int64_t)GetTime());
-        CBigNum bnCoinDayWeight = CBigNum(pcoin.first->vout[pcoin.second].nValue) * nTimeWeight / COIN / (24 * 60 * 60);
+        int64_t nTimeWeight = GetWeight((int64_t)candidate.nTxTime, (int64_t)GetTime());
+        CBigNum bnCoinDayWeight = CBigNum(candidate.nValue) * nTimeWeight / COIN / (24 * 60 * 60);
 
         // Weight is greater than zero
         if (nTimeWeight > 0)
@@ -2004,149 +1974,456 @@ bool CWallet::CreateTransaction(CScript scriptPubKey, int64_t nValue, CWalletTx&
 
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, CTransaction& txNew, CKey& key)
 {
-    // The following combine threshold is important to security
-    // Should not be adjusted if you don't understand the consequences
-
-    CBigNum bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
-
-    txNew.vin.clear();
-    txNew.vout.clear();
+    if (!PrepareStakeCandidates())
+        return false;
 
-    // Mark coin stake transaction
-    CScript scriptEmpty;
-    scriptEmpty.clear();
-    txNew.vout.push_back(CTxOut(0, scriptEmpty));
+    KernelSearchSettings settings;
+    settings.nBits = nBits;
+    settings.nTime = txNew.nTime;
+    settings.nOffset = 0;
+    settings.nLimit = GetStakeCandidateCount();
+    settings.nSearchInterval = nSearchInterval;
 
-    // Choose coins to use
-    int64_t nBalance = GetBalance();
+    unsigned int nTimeTx, nBlockTime;
+    CoinsSet::value_type kernelcoin;
 
-    if (nBalance <= nReserveBalance)
+    if (!ScanStakeCandidates(settings, kernelcoin, nTimeTx, nBlockTime))
         return false;
 
-    vector<const CWalletTx*> vwtxPrev;
+    // Found a kernel
+    LogPrint("coinstake","CreateCoinStake : kernel found\n");
+    return CreateCoinStakeFromKernel(keystore, nBits, kernelcoin, nTimeTx, nBlockTime, txNew, key);
+}
 
-    CTxDB txdb("r");
+// Load the staking coins and their kernel data unless they are cached
+bool CWallet::PrepareStakeCandidates()
+{
     {
         LOCK2(cs_main, cs_wallet);
-        // Cache outputs unless best block or wallet transaction set changed
-        if (!fCoinsDataActual && !IsLocked())
+        // GetBalance walks all of mapWallet, so it is only taken again once
+        // a wallet transaction or the best block changed
+        if (nStakeBalanceGeneration != nStakeGeneration || hashStakeBalanceBest != hashBestChain)
         {
-            mapMeta.clear();
-            int64_t nValueIn = 0;
-            CoinsSet setCoins;
-            if (!SelectCoinsForStaking(nBalance - nReserveBalance, GetAdjustedTime(),setCoins, nValueIn))
-                return false;
-
-            if (setCoins.empty())
-                return false;
+            nStakeBalance = GetBalance();
+            nStakeBalanceGeneration = nStakeGeneration;
+            hashStakeBalanceBest = hashBestChain;
+        }
+        if (nStakeBalance <= nReserveBalance)
+            return false;
 
+        // Cache outputs unless best block or wallet transaction set changed
+        if ((!fCoinsDataActual || hashStakeCandidatesBest != hashBestChain) && !IsLocked())
+        {
+            // A reorganization can move coins to other blocks and change the
+            // stake modifier of coins that stayed put. As long as the block
+            // the candidates were built for is still in the main chain every
+            // block they were read from is too, and only new blocks and
+            // changed transactions need a look. With a reserve balance
+            // SelectCoinsForStaking picks which coins stake out of the whole
+            // wallet, so those wallets rebuild as well.
+            BlockMap::iterator mi = mapBlockIndex.find(hashStakeCandidatesBest);
+            bool fReorganized = (mi == mapBlockIndex.end() || !mi->second->IsInMainChain());
+            int64_t nStart = GetTimeMicros();
+            if (!fStakeCandidatesLoaded || fReorganized || nReserveBalance > 0)
             {
-                CTxIndex txindex;
-                CBlock block;
-                for(CoinsSet::iterator pcoin = setCoins.begin(); pcoin != setCoins.end(); pcoin++)
-                {
-                    // Load transaction index item
-                    if (!txdb.ReadTxIndex(pcoin->first->GetHash(), txindex))
-                        continue;
-
-                    // Read block header
-                    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-                        continue;
-
-                    uint64_t nStakeModifier = 0;
-                    if (!GetKernelStakeModifier(block.GetHash(), nStakeModifier))
-                        continue;
-
-                    // Add meta record
-                    // (txid, vout.n) => ((txindex, (tx, vout.n)), (block, modifier))
-                    mapMeta[make_pair(pcoin->first->GetHash(), pcoin->second)] = make_pair(make_pair(txindex, *pcoin), make_pair(block, nStakeModifier));
-                }
+                bool fLoaded = LoadStakeCandidates(nStakeBalance);
+                nStakeLoadTime = GetTimeMicros() - nStart;
+                if (!fLoaded)
+                    return false;
             }
-
-            LogPrint("coinstake", "----CreateCoinStake: %zu meta items loaded for %zu coins for wallet %s-----\n", mapMeta.size(), setCoins.size(),strWalletFile.c_str());
+            else
+            {
+                UpdateStakeCandidates();
+                nStakeUpdateTime = GetTimeMicros() - nStart;
+            }
+            hashStakeCandidatesBest = hashBestChain;
             fCoinsDataActual = true;
         }
     }
 
-    int64_t nCredit = 0;
-    CScript scriptPubKeyKernel;
+    return true;
+}
 
-    KernelSearchSettings settings;
-    settings.nBits = nBits;
-    settings.nTime = txNew.nTime;
-    settings.nOffset = 0;
-    settings.nLimit = mapMeta.size();
-    settings.nSearchInterval = nSearchInterval;
+// Whether output nOut of pcoin stakes at nSpendTime, by the rules of
+// AvailableCoinsForStaking. fWaiting is set for outputs that only need
+// to get older or mature.
+bool CWallet::IsStakeCandidate(const CWalletTx* pcoin, unsigned int nOut, unsigned int nSpendTime, bool& fWaiting) const
+{
+    fWaiting = false;
+    if (pcoin->IsSpent(nOut) || IsMine(pcoin->vout[nOut]) != MINE_SPENDABLE || pcoin->vout[nOut].nValue < nMinimumInputValue)
+        return false;
 
-    unsigned int nTimeTx, nBlockTime;
-    CoinsSet::value_type kernelcoin;
+    if (pcoin->GetDepthInMainChain() < 1)
+        return false;
 
-    if (ScanForStakeKernelHash(mapMeta, settings, kernelcoin, nTimeTx, nBlockTime, this))
+    // Filtering by tx timestamp instead of block timestamp may give false positives but never false negatives
+    if (pcoin->nTime + GetStakeMinAge() > nSpendTime || pcoin->GetBlocksToMaturity() > 0)
     {
-        // Found a kernel
-        LogPrint("coinstake","CreateCoinStake : kernel found\n");
-        vector<valtype> vSolutions;
-        txnouttype whichType;
-        CScript scriptPubKeyOut;
-        scriptPubKeyKernel = kernelcoin.first->vout[kernelcoin.second].scriptPubKey;
-        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-        {
-            LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
-            return false;
-        }
-        LogPrint("coinstake","CreateCoinStake : parsed kernel type=%d\n", whichType);
-        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+        fWaiting = true;
+        return false;
+    }
+
+    return true;
+}
+
+// Read the kernel data of a staking coin and add it to vCandidates
+bool CWallet::AddStakeCandidate(CTxDB& txdb, const CWalletTx* pcoin, unsigned int nOut, vector<CStakeCandidate>& vCandidates)
+{
+    CStakeCandidate candidate;
+    candidate.pwtx = pcoin;
+    candidate.nValue = pcoin->vout[nOut].nValue;
+    candidate.nTxTime = pcoin->nTime;
+    candidate.nOut = nOut;
+
+    // Kernel data saved by an earlier run
+    uint256 hash = pcoin->GetHash();
+    if (!mapStakeCache.empty())
+    {
+        map<pair<uint256, unsigned int>, CStakeCacheEntry>::const_iterator mi = mapStakeCache.find(make_pair(hash, nOut));
+        if (mi != mapStakeCache.end())
         {
-            LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
-            return false;  // only support pay to public key and pay to address
+            candidate.nStakeModifier = mi->second.nStakeModifier;
+            candidate.nBlockTime = mi->second.nBlockTime;
+            candidate.nTxOffset = mi->second.nTxOffset;
+            vCandidates.push_back(candidate);
+            return true;
         }
-        if (whichType == TX_PUBKEYHASH) // pay to address type
+    }
+
+    // Load transaction index item
+    CTxIndex txindex;
+    if (!txdb.ReadTxIndex(hash, txindex))
+        return false;
+
+    // Read block header
+    CBlock block;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        return false;
+
+    uint64_t nStakeModifier = 0;
+    if (!GetKernelStakeModifier(block.GetHash(), nStakeModifier))
+        return false;
+
+    // Keep only what the kernel needs
+    candidate.nStakeModifier = nStakeModifier;
+    candidate.nBlockTime = block.nTime;
+    candidate.nTxOffset = txindex.pos.nTxPos - txindex.pos.nBlockPos;
+    vCandidates.push_back(candidate);
+    fStakeCacheChanged = true;
+    return true;
+}
+
+// Publish vCandidates, leaving it empty. Searches still running keep the
+// array they started on.
+void CWallet::SetStakeCandidates(vector<CStakeCandidate>& vCandidates)
+{
+    AssertLockHeld(cs_wallet);
+    boost::shared_ptr<vector<CStakeCandidate> > pcandidates(new vector<CStakeCandidate>());
+    pcandidates->swap(vCandidates);
+    pStakeCandidates = pcandidates;
+}
+
+// Build the staking candidates from all coins SelectCoinsForStaking picks
+bool CWallet::LoadStakeCandidates(int64_t nBalance)
+{
+    AssertLockHeld(cs_wallet);
+
+    vector<CStakeCandidate> vCandidates;
+    SetStakeCandidates(vCandidates);
+    setStakeDirty.clear();
+    setStakeWaiting.clear();
+    fStakeCandidatesLoaded = false;
+
+    if (!fStakeCacheRead)
+        ReadStakeCache();
+
+    unsigned int nSpendTime = GetAdjustedTime();
+    int64_t nValueIn = 0;
+    CoinsSet setCoins;
+    if (!SelectCoinsForStaking(nBalance - nReserveBalance, nSpendTime, setCoins, nValueIn))
+        return false;
+
+    if (setCoins.empty())
+        return false;
+
+    CTxDB txdb("r");
+    vCandidates.reserve(setCoins.size());
+    size_t nFromCache = 0;
+    for(CoinsSet::iterator pcoin = setCoins.begin(); pcoin != setCoins.end(); pcoin++)
+    {
+        if (!mapStakeCache.empty() && mapStakeCache.count(make_pair(pcoin->first->GetHash(), pcoin->second)))
+            nFromCache++;
+        if (!AddStakeCandidate(txdb, pcoin->first, pcoin->second, vCandidates))
+            setStakeWaiting.insert(pcoin->first->GetHash()); // stake modifier not there yet
+    }
+    SetStakeCandidates(vCandidates);
+
+    // Remember what will be able to stake later, so updates only look at that
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        for (unsigned int i = 0; i < it->second.vout.size(); i++)
         {
-            // convert to pay to public key type
-            if (!keystore.GetKey(uint160(vSolutions[0]), key))
+            bool fWaiting;
+            if (!IsStakeCandidate(&it->second, i, nSpendTime, fWaiting) && fWaiting)
             {
-                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                return false;  // unable to find corresponding public key
+                setStakeWaiting.insert(it->first);
+                break;
             }
-            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
         }
-        if (whichType == TX_PUBKEY)
+    }
+
+    LogPrint("coinstake", "----LoadStakeCandidates: %zu candidates (%zu bytes) loaded for %zu coins, %zu from the stake cache, %zu transactions waiting for wallet %s-----\n",
+        pStakeCandidates->size(), GetStakeCandidateMemoryUsage(), setCoins.size(), nFromCache, setStakeWaiting.size(), strWalletFile.c_str());
+    mapStakeCache.clear();
+    fStakeCandidatesLoaded = true;
+    return true;
+}
+
+// Bring the staking candidates up to date by only looking at transactions
+// that changed or were waiting to stake. Coins are read from disk only when
+// they start staking or their transaction moved to another block.
+void CWallet::UpdateStakeCandidates()
+{
+    AssertLockHeld(cs_wallet);
+
+    set<uint256> setCheck;
+    setCheck.swap(setStakeDirty);
+    setCheck.insert(setStakeWaiting.begin(), setStakeWaiting.end());
+    setStakeWaiting.clear();
+    if (setCheck.empty())
+        return;
+
+    set<const CWalletTx*> setCheckTx;
+    BOOST_FOREACH(const uint256& hash, setCheck)
+    {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+            setCheckTx.insert(&mi->second);
+    }
+
+    // Drop the coins that stopped staking, keeping the others in order
+    unsigned int nSpendTime = GetAdjustedTime();
+    unsigned int nRemoved = 0, nAdded = 0;
+    set<pair<const CWalletTx*, unsigned int> > setKept;
+    vector<CStakeCandidate> vCandidates;
+    vCandidates.reserve(pStakeCandidates->size());
+    for (vector<CStakeCandidate>::const_iterator it = pStakeCandidates->begin(); it != pStakeCandidates->end(); ++it)
+    {
+        if (setCheckTx.count(it->pwtx))
         {
-            valtype& vchPubKey = vSolutions[0];
-            if (!keystore.GetKey(Hash160(vchPubKey), key))
+            bool fWaiting;
+            if (!IsStakeCandidate(it->pwtx, it->nOut, nSpendTime, fWaiting))
             {
-                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                return false;  // unable to find corresponding public key
+                nRemoved++;
+                continue;
             }
-            if (key.GetPubKey() != vchPubKey)
+            setKept.insert(it->GetCoin());
+        }
+        vCandidates.push_back(*it);
+    }
+
+    // Add the coins that started staking
+    CTxDB txdb("r");
+    BOOST_FOREACH(const CWalletTx* pcoin, setCheckTx)
+    {
+        for (unsigned int i = 0; i < pcoin->vout.size(); i++)
+        {
+            if (setKept.count(make_pair(pcoin, i)))
+                continue;
+
+            bool fWaiting;
+            if (IsStakeCandidate(pcoin, i, nSpendTime, fWaiting))
             {
-                LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                return false; // keys mismatch
+                if (AddStakeCandidate(txdb, pcoin, i, vCandidates))
+                    nAdded++;
+                else
+                    fWaiting = true; // stake modifier not there yet
             }
+            if (fWaiting)
+                setStakeWaiting.insert(pcoin->GetHash());
+        }
+    }
 
-            scriptPubKeyOut = scriptPubKeyKernel;
+    SetStakeCandidates(vCandidates);
+
+    LogPrint("coinstake", "----UpdateStakeCandidates: %u transactions checked, %u candidates added, %u removed, %zu total for wallet %s-----\n",
+        setCheckTx.size(), nAdded, nRemoved, pStakeCandidates->size(), strWalletFile.c_str());
+}
+
+// Called for every wallet transaction whose outputs changed
+void CWallet::MarkStakeCandidatesDirty(const uint256& hashTx)
+{
+    LOCK(cs_wallet);
+    setStakeDirty.insert(hashTx);
+    fCoinsDataActual = false;
+    nStakeGeneration++;
+}
+
+// Have the next PrepareStakeCandidates load all staking coins again
+void CWallet::InvalidateStakeCandidates()
+{
+    LOCK(cs_wallet);
+    fStakeCandidatesLoaded = false;
+    fCoinsDataActual = false;
+    nStakeGeneration++;
+}
+
+// Read the kernel data saved by an earlier run. It only holds while the
+// chain it was saved for is still the start of the best chain.
+void CWallet::ReadStakeCache()
+{
+    AssertLockHeld(cs_main);
+    fStakeCacheRead = true;
+    if (!fFileBacked)
+        return;
+
+    uint256 hashCacheBest;
+    vector<CStakeCacheEntry> vEntries;
+    if (!CStakeCacheDB(strWalletFile).Read(hashCacheBest, vEntries))
+        return;
+
+    BlockMap::iterator mi = mapBlockIndex.find(hashCacheBest);
+    if (mi == mapBlockIndex.end() || !mi->second->IsInMainChain())
+    {
+        LogPrintf("ReadStakeCache : stake cache of %s was saved for block %s, which is not in the best chain\n", strWalletFile, hashCacheBest.ToString());
+        return;
+    }
+
+    BOOST_FOREACH(const CStakeCacheEntry& entry, vEntries)
+        mapStakeCache[make_pair(entry.hashTx, entry.nOut)] = entry;
+    LogPrintf("ReadStakeCache : %u staking coins read for wallet %s\n", mapStakeCache.size(), strWalletFile);
+}
+
+// Save the kernel data of the staking candidates when coins were read
+// from disk for them, at most every ten minutes unless fForce. Called by
+// the stake miner and at shutdown only, since PrepareStakeCandidates also
+// runs on the GUI and RPC threads for the stake weight.
+void CWallet::WriteStakeCache(bool fForce)
+{
+    if (!fFileBacked)
+        return;
+
+    uint256 hashCacheBest;
+    vector<CStakeCacheEntry> vEntries;
+    {
+        LOCK(cs_wallet);
+        if (!fStakeCacheChanged || (!fForce && GetTime() - nStakeCacheWriteTime < 10 * 60))
+            return;
+        fStakeCacheChanged = false;
+        nStakeCacheWriteTime = GetTime();
+
+        hashCacheBest = hashStakeCandidatesBest;
+        vEntries.resize(pStakeCandidates->size());
+        for (unsigned int i = 0; i < pStakeCandidates->size(); i++)
+        {
+            const CStakeCandidate& candidate = (*pStakeCandidates)[i];
+            vEntries[i].hashTx = candidate.pwtx->GetHash();
+            vEntries[i].nOut = candidate.nOut;
+            vEntries[i].nBlockTime = candidate.nBlockTime;
+            vEntries[i].nTxOffset = candidate.nTxOffset;
+            vEntries[i].nStakeModifier = candidate.nStakeModifier;
         }
+    }
 
-        txNew.nTime = nTimeTx;
-        txNew.vin.push_back(CTxIn(kernelcoin.first->GetHash(), kernelcoin.second));
-        nCredit += kernelcoin.first->vout[kernelcoin.second].nValue;
-        vwtxPrev.push_back(kernelcoin.first);
-        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+    if (CStakeCacheDB(strWalletFile).Write(hashCacheBest, vEntries))
+        LogPrint("coinstake", "WriteStakeCache : %u staking coins written for wallet %s\n", vEntries.size(), strWalletFile);
+}
 
-        if((nCredit >= nSplitThreshold) && (GetWeight((int64_t)nBlockTime, (int64_t)txNew.nTime) < nStakeMaxAge))
-            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
-        LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
+// Scan settings.nLimit staking coins from settings.nOffset for a kernel
+bool CWallet::ScanStakeCandidates(KernelSearchSettings& settings, CoinsSet::value_type& kernelcoin, unsigned int& nTimeTx, unsigned int& nBlockTime, uint64_t* pnKernelsChecked)
+{
+    StakeCandidatesPtr pcandidates = GetStakeCandidates();
+    return ScanForStakeKernelHash(*pcandidates, settings, kernelcoin, nTimeTx, nBlockTime, NULL, pnKernelsChecked);
+}
+
+// Build and sign the coinstake spending a kernel found by ScanStakeCandidates
+bool CWallet::CreateCoinStakeFromKernel(const CKeyStore& keystore, unsigned int nBits, const CoinsSet::value_type& kernelcoin, unsigned int nTimeTx, unsigned int nBlockTime, CTransaction& txNew, CKey& key)
+{
+    // The following combine threshold is important to security
+    // Should not be adjusted if you don't understand the consequences
+
+    txNew.vin.clear();
+    txNew.vout.clear();
+
+    // Mark coin stake transaction
+    CScript scriptEmpty;
+    scriptEmpty.clear();
+    txNew.vout.push_back(CTxOut(0, scriptEmpty));
+
+    // The kernel was found among candidates PrepareStakeCandidates
+    // checked the balance for
+    int64_t nBalance;
+    {
+        LOCK(cs_wallet);
+        nBalance = nStakeBalance;
     }
 
+    if (nBalance <= nReserveBalance)
+        return false;
+
+    vector<const CWalletTx*> vwtxPrev;
+
+    int64_t nCredit = 0;
+    vector<valtype> vSolutions;
+    txnouttype whichType;
+    CScript scriptPubKeyOut;
+    CScript scriptPubKeyKernel = kernelcoin.first->vout[kernelcoin.second].scriptPubKey;
+    if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+    {
+        LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
+        return false;
+    }
+    LogPrint("coinstake","CreateCoinStake : parsed kernel type=%d\n", whichType);
+    if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+    {
+        LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
+        return false;  // only support pay to public key and pay to address
+    }
+    if (whichType == TX_PUBKEYHASH) // pay to address type
+    {
+        // convert to pay to public key type
+        if (!keystore.GetKey(uint160(vSolutions[0]), key))
+        {
+            LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+            return false;  // unable to find corresponding public key
+        }
+        scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+    }
+    if (whichType == TX_PUBKEY)
+    {
+        valtype& vchPubKey = vSolutions[0];
+        if (!keystore.GetKey(Hash160(vchPubKey), key))
+        {
+            LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+            return false;  // unable to find corresponding public key
+        }
+        if (key.GetPubKey() != vchPubKey)
+        {
+            LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+            return false; // keys mismatch
+        }
+
+        scriptPubKeyOut = scriptPubKeyKernel;
+    }
+
+    txNew.nTime = nTimeTx;
+    txNew.vin.push_back(CTxIn(kernelcoin.first->GetHash(), kernelcoin.second));
+    nCredit += kernelcoin.first->vout[kernelcoin.second].nValue;
+    vwtxPrev.push_back(kernelcoin.first);
+    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+
+    if((nCredit >= nSplitThreshold) && (GetWeight((int64_t)nBlockTime, (int64_t)txNew.nTime) < nStakeMaxAge))
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+    LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
+
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
         return false;
 
-    // (txid, vout.n) => ((txindex, (tx, vout.n)), (block, modifier))
-    for(MetaMap::const_iterator meta_item = mapMeta.begin(); meta_item != mapMeta.end(); meta_item++)
+    StakeCandidatesPtr pcandidates = GetStakeCandidates();
+    BOOST_FOREACH(const CStakeCandidate& candidate, *pcandidates)
     {
         // Get coin
-        CoinsSet::value_type pcoin = meta_item->second.first.second;
+        CoinsSet::value_type pcoin = candidate.GetCoin();
 
         // Attempt to add more inputs
         // Only add coins of the same key/address as kernel
@@ -2255,6 +2532,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                MarkStakeCandidatesDirty(txin.prevout.hash);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
@@ -2805,7 +3083,10 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, in
                 }
             }
             if (fUpdated)
+            {
+                MarkStakeCandidatesDirty(hash);
                 NotifyTransactionChanged(this, hash, CT_UPDATED);
+            }
         }
 
         if((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetDepthInMainChain() < 0)
@@ -2838,6 +3119,7 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                MarkStakeCandidatesDirty(txin.prevout.hash);
             }
         }
     }
@@ -2968,7 +3250,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
     for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && blit->second->IsInMainChain()) {
             // ... which are already in a block
             int nHeight = blit->second->nHeight;
@@ -3349,14 +3631,27 @@ bool CWalletManager::LoadWalletFromFile(const string& strFile, string& strName,
         LogPrintf(" rescan      %15dms\n", GetTimeMillis() - nStart);
     }
 
+    // The stake miner takes the wallet up once it is unlocked
     if ( !pWallet->IsCrypted() )
+       StartStakeMiner();
+
+    return true;
+}
+
+// Start the stake miner unless it is running or staking is stopped
+bool CWalletManager::StartStakeMiner()
+{
+    LOCK(cs_StakeMiner);
+    if (fStakeMinerRunning || fStopStaking || fShutdown)
+        return true;
+
+    fStakeMinerRunning = true;
+    if (!NewThread(ThreadStakeMinter, NULL))
     {
-       if (!NewThread(ThreadStakeMinter, pWallet))
-          LogPrintf("Error: NewThread(ThreadStakeMinter) failed\n");
+        fStakeMinerRunning = false;
+        LogPrintf("Error: NewThread(ThreadStakeMinter) failed\n");
+        return false;
     }
-    else
-      LogPrintf("Skipped ThreadStakeMinter for wallet: %s due to encryption\n", pWallet->strWalletFile);
-
     return true;
 }
 
@@ -3364,36 +3659,16 @@ void CWalletManager::RestartStakeMiner()
 {
     {
        AssertLockHeld(cs_WalletManager);
-       if (!fShutdown)
-       {
-         fStopStaking = true;
-         MilliSleep(nMinerSleep > 500 ? nMinerSleep * 2 : 1000);
-       }
-       // Re-Start Stake for the remaining wallets
-       if (!fShutdown)
-       {
-         fStopStaking = false;
-         MilliSleep(500);
-         vector<string> vstrNames;
-         vector<boost::shared_ptr<CWallet> > vpWallets;
+       if (fShutdown)
+           return;
 
-         BOOST_FOREACH(const wallet_map::value_type& item, wallets)
-         {
-            vstrNames.push_back(item.first);
-            vpWallets.push_back(item.second);
-         }
-         for (unsigned int i = 0; i < vstrNames.size(); i++)
-         {
-             if ( !vpWallets[i].get()->IsCrypted() || !vpWallets[i].get()->IsLocked() )
-              {
-                 LogPrintf ("Restarting ThreadStakeMinter for: %s\n", vstrNames[i]);
-                 if (!NewThread(ThreadStakeMinter, vpWallets[i].get()))
-                    LogPrintf("Error: NewThread(ThreadStakeMinter) failed\n");
-              }
-              else
-                LogPrintf("Skipped ThreadStakeMinter for wallet: %s due to encryption\n", vstrNames[i]);
-         }
-       }
+       // Give the stake miner time to notice the stop and drop its block
+       // template; if it is busy for longer it simply carries on. It picks
+       // up the unlocked wallets by itself on every tick.
+       fStopStaking = true;
+       MilliSleep(nMinerSleep > 500 ? nMinerSleep * 2 : 1000);
+       fStopStaking = false;
+       StartStakeMiner();
     }
 }
 
@@ -3491,6 +3766,7 @@ void CWalletManager::UnloadAllWallets()
         for (unsigned int i = 0; i < vstrNames.size(); i++)
         {
             LogPrintf("Unloading wallet %s\n", vstrNames[i]);
+            vpWallets[i]->WriteStakeCache(true);
             {
                 LOCK(vpWallets[i]->cs_wallet);
                 UnregisterWallet(vpWallets[i].get());
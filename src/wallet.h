@@ -34,6 +34,7 @@ class CWalletTx;
 class CReserveKey;
 class COutput;
 class CCoinControl;
+struct KernelSearchSettings;
 
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
@@ -83,6 +84,29 @@ public:
     )
 };
 
+/** Kernel data of one staking coin. These are the only fields the kernel
+ * search hashes and weighs, kept in a contiguous array so large wallets do
+ * not hold a CTxIndex and a block header copy per coin.
+ */
+struct CStakeCandidate
+{
+    const CWalletTx* pwtx;
+    uint64_t nStakeModifier;
+    int64_t nValue;
+    unsigned int nBlockTime;    // time of the block holding the transaction
+    unsigned int nTxOffset;     // transaction offset inside that block
+    unsigned int nTxTime;
+    unsigned int nOut;
+
+    std::pair<const CWalletTx*, unsigned int> GetCoin() const { return std::make_pair(pwtx, nOut); }
+};
+
+/** Staking candidates as published by a wallet. The array is never changed
+ * once published; updates publish a new one, so the kernel search can scan a
+ * snapshot without holding cs_wallet.
+ */
+typedef boost::shared_ptr<const std::vector<CStakeCandidate> > StakeCandidatesPtr;
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -91,7 +115,6 @@ class CWallet : public CCryptoKeyStore
 private:
     bool SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl=NULL) const;
     bool SelectCoinsSimple(int64_t nTargetValue, int64_t nMinValue, int64_t nMaxValue, unsigned int nSpendTime, int nMinConf, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
-    bool SelectCoinsForStaking(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
 
     CWalletDB *pwalletdbEncryption;
 
@@ -106,8 +129,33 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
-    // selected coins metadata
-    std::map<std::pair<uint256, unsigned int>, std::pair<std::pair<CTxIndex, std::pair<const CWalletTx*,unsigned int> >, std::pair<CBlock, uint64_t> > > mapMeta;
+    // selected coins metadata, kept up to date by UpdateStakeCandidates
+    // once LoadStakeCandidates built it. Replaced, never changed, under
+    // cs_wallet.
+    StakeCandidatesPtr pStakeCandidates;
+    bool fStakeCandidatesLoaded;
+    uint256 hashStakeCandidatesBest;    // best chain the candidates were last updated for
+    std::set<uint256> setStakeDirty;    // transactions whose outputs may have started or stopped staking
+    std::set<uint256> setStakeWaiting;  // transactions with outputs too young or immature to stake yet
+    int64_t nStakeLoadTime;             // microseconds the last full load took
+    int64_t nStakeUpdateTime;           // microseconds the last update took
+    unsigned int nStakeGeneration;      // bumped whenever a wallet transaction changes
+    unsigned int nStakeBalanceGeneration; // nStakeGeneration nStakeBalance was taken at
+    uint256 hashStakeBalanceBest;       // best chain nStakeBalance was taken at
+    int64_t nStakeBalance;              // GetBalance as of the last PrepareStakeCandidates
+
+    // kernel data read from the stake cache file, used until the first load
+    std::map<std::pair<uint256, unsigned int>, CStakeCacheEntry> mapStakeCache;
+    bool fStakeCacheRead;
+    bool fStakeCacheChanged;            // candidates were read from disk since the last write
+    int64_t nStakeCacheWriteTime;
+
+    bool IsStakeCandidate(const CWalletTx* pcoin, unsigned int nOut, unsigned int nSpendTime, bool& fWaiting) const;
+    bool AddStakeCandidate(CTxDB& txdb, const CWalletTx* pcoin, unsigned int nOut, std::vector<CStakeCandidate>& vCandidates);
+    void SetStakeCandidates(std::vector<CStakeCandidate>& vCandidates);
+    bool LoadStakeCandidates(int64_t nBalance);
+    void UpdateStakeCandidates();
+    void ReadStakeCache();
 
 public:
     /// Main wallet lock.
@@ -166,6 +214,16 @@ public:
         fWalletUnlockMintOnly = false;
         fStakeForCharity = false;
         fCoinsDataActual = false;
+        pStakeCandidates.reset(new std::vector<CStakeCandidate>());
+        fStakeCandidatesLoaded = false;
+        nStakeLoadTime = 0;
+        nStakeUpdateTime = 0;
+        nStakeGeneration = 1;
+        nStakeBalanceGeneration = 0;
+        nStakeBalance = 0;
+        fStakeCacheRead = false;
+        fStakeCacheChanged = false;
+        nStakeCacheWriteTime = 0;
         nStakeForCharityPercent = 0;
         nStakeForCharityMin = MIN_TXOUT_AMOUNT;
         nStakeForCharityMax = MAX_MONEY;
@@ -195,6 +253,7 @@ public:
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl=NULL) const;
     void AvailableCoinsForStaking(std::vector<COutput>& vCoins, unsigned int nSpendTime) const;
+    bool SelectCoinsForStaking(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
     void AvailableCoinsMinConf(std::vector<COutput>& vCoins, int nConf, int64_t nMinValue, int64_t nMaxValue) const;
     bool SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
     bool IsLockedCoin(uint256 hash, unsigned int n) const;
@@ -271,6 +330,21 @@ public:
     bool GetStakeWeight(const CKeyStore& keystore, uint64_t& nMinWeight, uint64_t& nMaxWeight, uint64_t& nWeight);
     bool GetStakeWeightFromValue(const int64_t& nTime, const int64_t& nValue, uint64_t& nWeight);
     bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, CTransaction& txNew, CKey& key);
+
+    // Staking is split in steps so CWalletManager can search the coins of
+    // all wallets at once: load the staking coins, scan a slice of them for
+    // a kernel, then build the coinstake from the kernel found
+    bool PrepareStakeCandidates();
+    void MarkStakeCandidatesDirty(const uint256& hashTx);
+    void InvalidateStakeCandidates();
+    void WriteStakeCache(bool fForce = false);
+    StakeCandidatesPtr GetStakeCandidates() const { LOCK(cs_wallet); return pStakeCandidates; }
+    unsigned int GetStakeCandidateCount() const { return GetStakeCandidates()->size(); }
+    size_t GetStakeCandidateMemoryUsage() const { return GetStakeCandidates()->capacity() * sizeof(CStakeCandidate); }
+    int64_t GetStakeCandidateLoadTime() const { return nStakeLoadTime; }
+    int64_t GetStakeCandidateUpdateTime() const { return nStakeUpdateTime; }
+    bool ScanStakeCandidates(KernelSearchSettings& settings, std::pair<const CWalletTx*,unsigned int>& kernelcoin, unsigned int& nTimeTx, unsigned int& nBlockTime, uint64_t* pnKernelsChecked = NULL);
+    bool CreateCoinStakeFromKernel(const CKeyStore& keystore, unsigned int nBits, const std::pair<const CWalletTx*,unsigned int>& kernelcoin, unsigned int nTimeTx, unsigned int nBlockTime, CTransaction& txNew, CKey& key);
     bool MergeCoins(const int64_t& nAmount, const int64_t& nMinValue, const int64_t& nMaxValue, std::list<uint256>& listMerged);
     std::string SendMoney(CScript scriptPubKey, int64_t nValue, CWalletTx& wtxNew, bool fAskFee=false, bool fAllowS4C=false);
     std::string SendMoneyToDestination(const CTxDestination &address, int64_t nValue, CWalletTx& wtxNew, bool fAskFee=false, bool fAllowS4C=false);
@@ -443,7 +517,12 @@ protected:
     mutable CCriticalSection cs_WalletManager;
     wallet_map wallets;
 
+    // Whether the stake miner thread is running, see StartStakeMiner
+    CCriticalSection cs_StakeMiner;
+    bool fStakeMinerRunning;
+
 public:
+    CWalletManager() : fStakeMinerRunning(false) { }
     ~CWalletManager() { UnloadAllWallets(); }
 
     std::set<COutPoint> setLockedCoins;
@@ -452,6 +531,9 @@ public:
     bool LoadWalletFromFile(const std::string& strFile, std::string& strName, std::ostringstream& strErrors, bool fRescan = false, bool fUpgrade = false, bool fZapWallet = false, int nMaxVersion = 0);
     bool UnloadWallet(const std::string& strName);
     void UnloadAllWallets();
+    // One stake miner thread stakes for all unlocked wallets
+    void StakeMiner();
+    bool StartStakeMiner();
     void RestartStakeMiner();
     void StakeForCharity();
     int64_t GetTotalBalance();
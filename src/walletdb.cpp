@@ -1037,3 +1037,110 @@ bool CWalletDB::Recover(CDBEnv& dbenv, std::string filename)
 {
     return CWalletDB::Recover(dbenv, filename, false);
 }
+
+//
+// CStakeCacheDB
+//
+
+CStakeCacheDB::CStakeCacheDB(const std::string& strWalletFile)
+{
+    pathCache = GetDataDir() / (strWalletFile + ".stakecache");
+}
+
+bool CStakeCacheDB::Write(const uint256& hashBestChain, const std::vector<CStakeCacheEntry>& vEntries)
+{
+    // Generate random temporary filename
+    unsigned short randv = 0;
+    RAND_bytes((unsigned char *)&randv, sizeof(randv));
+    boost::filesystem::path pathTmp = pathCache.string() + strprintf(".%04x", randv);
+
+    // serialize the cache, checksum data up to that point, then append csum
+    CDataStream ssCache(SER_DISK, CLIENT_VERSION);
+    ssCache << FLATDATA(pchMessageStart);
+    ssCache << CURRENT_VERSION;
+    ssCache << hashBestChain;
+    ssCache << vEntries;
+    uint256 hash = Hash(ssCache.begin(), ssCache.end());
+    ssCache << hash;
+
+    // open temp output file, and associate with CAutoFile
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("CStakeCacheDB::Write() : open failed");
+
+    // Write and commit header, data
+    try {
+        fileout << ssCache;
+    }
+    catch (std::exception &e) {
+        return error("CStakeCacheDB::Write() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    // replace the existing cache, if any, with the new one
+    if (!RenameOver(pathTmp, pathCache))
+        return error("CStakeCacheDB::Write() : Rename-into-place failed");
+
+    return true;
+}
+
+bool CStakeCacheDB::Read(uint256& hashBestChain, std::vector<CStakeCacheEntry>& vEntries)
+{
+    // A wallet that never staked has no cache
+    if (!boost::filesystem::exists(pathCache))
+        return false;
+
+    // open input file, and associate with CAutoFile
+    FILE *file = fopen(pathCache.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("CStakeCacheDB::Read() : open failed");
+
+    // use file size to size memory buffer
+    int fileSize = boost::filesystem::file_size(pathCache);
+    int dataSize = fileSize - sizeof(uint256);
+    // Don't try to resize to a negative number if file is small
+    if ( dataSize < 0 ) dataSize = 0;
+    vector<unsigned char> vchData;
+    vchData.resize(dataSize);
+    uint256 hashIn;
+
+    // read data and checksum from file
+    try {
+        filein.read((char *)&vchData[0], dataSize);
+        filein >> hashIn;
+    }
+    catch (std::exception &e) {
+        return error("CStakeCacheDB::Read() 2 : I/O error or stream data corrupted");
+    }
+    filein.fclose();
+
+    CDataStream ssCache(vchData, SER_DISK, CLIENT_VERSION);
+
+    // verify stored checksum matches input data
+    uint256 hashTmp = Hash(ssCache.begin(), ssCache.end());
+    if (hashIn != hashTmp)
+        return error("CStakeCacheDB::Read() : checksum mismatch; data corrupted");
+
+    unsigned char pchMsgTmp[4];
+    int nVersion = 0;
+    try {
+        // verify the network and the format match ours
+        ssCache >> FLATDATA(pchMsgTmp);
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+            return error("CStakeCacheDB::Read() : invalid network magic number");
+        ssCache >> nVersion;
+        if (nVersion != CURRENT_VERSION)
+            return error("CStakeCacheDB::Read() : unknown version %d", nVersion);
+
+        ssCache >> hashBestChain;
+        ssCache >> vEntries;
+    }
+    catch (std::exception &e) {
+        return error("CStakeCacheDB::Read() : I/O error or stream data corrupted");
+    }
+
+    return true;
+}
@@ -215,4 +215,41 @@ public:
     static bool Recover(CDBEnv& dbenv, std::string filename);
 };
 
+
+/** Kernel data of a staking coin as stored in the stake cache */
+class CStakeCacheEntry
+{
+public:
+    uint256 hashTx;
+    unsigned int nOut;
+    unsigned int nBlockTime;
+    unsigned int nTxOffset;
+    uint64_t nStakeModifier;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashTx);
+        READWRITE(nOut);
+        READWRITE(nBlockTime);
+        READWRITE(nTxOffset);
+        READWRITE(nStakeModifier);
+    )
+};
+
+/** Access to the stake cache of a wallet (<wallet file>.stakecache), which
+ * saves reading the block header of every staking coin after a restart.
+ * The kernel data in it holds for the chain up to hashBestChain.
+ */
+class CStakeCacheDB
+{
+private:
+    boost::filesystem::path pathCache;
+public:
+    static const int CURRENT_VERSION = 1;
+
+    CStakeCacheDB(const std::string& strWalletFile);
+    bool Write(const uint256& hashBestChain, const std::vector<CStakeCacheEntry>& vEntries);
+    bool Read(uint256& hashBestChain, std::vector<CStakeCacheEntry>& vEntries);
+};
+
 #endif // BITCOIN_WALLETDB_H